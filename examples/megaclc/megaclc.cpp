@@ -2425,6 +2425,46 @@ void exec_savecurrentstate(ac::ACState&)
     g_chatApi->saveCurrentState();
 }
 
+void exec_metrics(ac::ACState& s)
+{
+    // Prometheus format by default, so the output file can be collected by node_exporter's textfile collector
+    bool json = s.extractflag("-json");
+    unique_ptr<const char[]> metrics(g_chatApi->getNetworkMetrics(json ? c::MegaChatApi::METRICS_FORMAT_JSON
+                                                                       : c::MegaChatApi::METRICS_FORMAT_PROMETHEUS));
+    if (!metrics)
+    {
+        conlock(cout) << "Metrics not available, the chat engine is not initialized" << endl;
+        return;
+    }
+
+    if (s.words.size() > 1)
+    {
+        // write to a temporary file and rename it, so a reader never sees a partial file
+        string filename = s.words[1].s;
+        string tmpFilename = filename + ".tmp";
+        {
+            ofstream file(tmpFilename.c_str());
+            if (file.fail() || !file.is_open())
+            {
+                conlock(cout) << "could not open file: " << tmpFilename << endl;
+                return;
+            }
+            file << metrics.get();
+        }
+#ifdef WIN32
+        remove(filename.c_str());   // rename() doesn't replace existing files
+#endif
+        if (rename(tmpFilename.c_str(), filename.c_str()))
+        {
+            conlock(cout) << "could not write file: " << filename << endl;
+        }
+    }
+    else
+    {
+        conlock(cout) << metrics.get() << endl;
+    }
+}
+
 void exec_detail(ac::ACState& s)
 {
     g_detailHigh = s.words[1].s == "high";
@@ -3744,6 +3784,7 @@ ac::ACN autocompleteSyntax()
     p->Add(exec_sendtypingnotification, sequence(text("sendtypingnotification"), param("roomid")));
     p->Add(exec_ismessagereceptionconfirmationactive, sequence(text("ismessagereceptionconfirmationactive")));
     p->Add(exec_savecurrentstate, sequence(text("savecurrentstate")));
+    p->Add(exec_metrics, sequence(text("metrics"), opt(flag("-json")), opt(localFSFile())));
 
     p->Add(exec_openchatpreview,    sequence(text("openchatpreview"), param("chatlink")));
     p->Add(exec_closechatpreview,   sequence(text("closechatpreview"), param("chatid")));
@@ -183,6 +183,10 @@ public:
          * @param userid - the user handle of the user who left the chat.
          */
         virtual void onUserLeave(uint64_t /*userid*/) {}
+        /** @brief The name of a member has been resolved or has changed.
+         * It's notified even if the chat has no IChatHandler attached.
+         */
+        virtual void onMemberNameChanged(uint64_t /*userid*/, const std::string& /*newName*/) {}
     };
 
     class IChatListHandler
@@ -24,8 +24,12 @@ static inline void marshallCall(F&& func, void *appCtx)
     struct Msg: public megaMessage
     {
         F mFunc;
+        int64_t mPostTs;  // only set when the loop profiler is enabled
         Msg(F&& aFunc, megaMessageFunc cHandler)
-        : megaMessage(cHandler), mFunc(std::forward<F>(aFunc)){}
+        : megaMessage(cHandler), mFunc(std::forward<F>(aFunc)),
+          mPostTs(gLoopProfiler.isEnabled() ? LoopProfiler::now() : 0) {}
+        // identifies the call site by the type of the marshalled callable
+        static const char* site() { return KR_FUNCTION_SIGNATURE; }
 #ifndef NDEBUG
         unsigned magic = 0x3e9a3591;
 #endif
@@ -48,6 +52,7 @@ static inline void marshallCall(F&& func, void *appCtx)
     {
         AutoDel pMsg(static_cast<Msg*>(ptr));
         assert(pMsg->magic == 0x3e9a3591);
+        LoopProfiler::Scope profile("marshall", pMsg->mPostTs ? Msg::site() : nullptr, pMsg->mPostTs);
         if (!gCatchException)
         {
             pMsg->mFunc();
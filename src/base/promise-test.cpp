@@ -5,10 +5,42 @@
 #include <asyncTest-framework.h>
 #define PROMISE_ON_UNHANDLED_ERROR testUnhandledError
 #include <promise.h>
+#include <chrono>
 
 TESTS_INIT();
 using namespace promise;
 
+// count heap allocations, to check the allocation-free paths of the promise library
+static size_t gNumAllocs = 0;
+void* operator new(size_t size)
+{
+    gNumAllocs++;
+    void* ptr = malloc(size);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+template <class F>
+size_t allocsPerRun(F&& func, int runs)
+{
+    func(); // warm up the promise pool of this thread
+    size_t before = gNumAllocs;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        func();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    size_t allocs = gNumAllocs - before;
+    printf("    %.2f allocations, %lld ns per chain\n", (double)allocs / runs, (long long)(elapsed / runs));
+    return allocs;
+}
+
 std::function<void(const std::string&, int, int)> gUnhandledHandler =
 [](const std::string& msg, int type, int code)
 {
@@ -630,5 +662,59 @@ TestGroup("Unhandled promise fail")
     });
 });
 
+TestGroup("Allocation tests")
+{
+    asyncTest("then() chain on an already resolved promise should not allocate")
+    {
+        int result = 0;
+        size_t allocs = allocsPerRun([&result]()
+        {
+            Promise<int> pms(1);
+            pms.then([](int a)
+            {
+                return a + 1;
+            })
+            .then([&result](int a)
+            {
+                result = a;
+            });
+        }, 10000);
+        doneOrError(allocs == 0 && result == 2, );
+    });
+    asyncTest("fail() on an already failed promise should not allocate")
+    {
+        Error err("test error");
+        bool handled = false;
+        size_t allocs = allocsPerRun([&err, &handled]()
+        {
+            Promise<int> pms(err);
+            pms.fail([&handled](const Error&)
+            {
+                handled = true;
+                return 1;
+            });
+        }, 10000);
+        doneOrError(allocs == 0 && handled, );
+    });
+    asyncTest("then() chain on a pending promise should reuse pooled objects")
+    {
+        int result = 0;
+        size_t allocs = allocsPerRun([&result]()
+        {
+            Promise<int> pms;
+            pms.then([](int a)
+            {
+                return a + 1;
+            })
+            .then([&result](int a)
+            {
+                result = a;
+            });
+            pms.resolve(1);
+        }, 10000);
+        doneOrError(allocs == 0 && result == 2, );
+    });
+});
+
 return test::gNumFailed;
 }
@@ -60,7 +60,88 @@ struct FuncTraits <R(C::*)(Args...)> { typedef R RetType; enum {nargs = sizeof..
 template <class C, class R, class...Args>
 struct FuncTraits <R(C::*)(Args...) const> { typedef R RetType; enum {nargs = sizeof...(Args)};};
 //===
-struct IVirtDtor
+/** @brief Per-thread freelists of small fixed-size blocks, used for the
+ * internal objects of promises (shared state, callback lists and callbacks).
+ * Promises are created and destroyed in bulk, and without the pool every
+ * then() costs several malloc/free pairs. Blocks are recycled on the thread
+ * that frees them, and each size class keeps at most kMaxFreeBlocks spare
+ * blocks, so the pool does not retain memory after a burst.
+ * Define PROMISE_DISABLE_POOL to use the global allocator instead.
+ */
+#ifndef PROMISE_DISABLE_POOL
+class BlockPool
+{
+protected:
+    enum { kGranularity = 16, kNumClasses = 16, kMaxFreeBlocks = 256 };
+    struct Node { Node* next; };
+    struct FreeLists
+    {
+        Node* heads[kNumClasses] = {};
+        unsigned counts[kNumClasses] = {};
+        bool destroyed = false;
+        ~FreeLists()
+        {
+            for (int i = 0; i < kNumClasses; i++)
+            {
+                while (heads[i])
+                {
+                    Node* node = heads[i];
+                    heads[i] = node->next;
+                    ::operator delete(node);
+                }
+            }
+            destroyed = true;
+        }
+    };
+    static FreeLists& freeLists()
+    {
+        static thread_local FreeLists lists;
+        return lists;
+    }
+    static int sizeClass(size_t size) { return (int)((size + kGranularity - 1) / kGranularity) - 1; }
+public:
+    static void* alloc(size_t size)
+    {
+        int cls = sizeClass(size);
+        if (cls >= kNumClasses)
+            return ::operator new(size);
+
+        auto& lists = freeLists();
+        Node* node = lists.heads[cls];
+        if (!node)
+            return ::operator new((cls + 1) * kGranularity);
+
+        lists.heads[cls] = node->next;
+        lists.counts[cls]--;
+        return node;
+    }
+    static void release(void* ptr, size_t size)
+    {
+        int cls = sizeClass(size);
+        auto& lists = freeLists();
+        if (cls >= kNumClasses || lists.destroyed || lists.counts[cls] >= kMaxFreeBlocks)
+        {
+            ::operator delete(ptr);
+            return;
+        }
+        Node* node = static_cast<Node*>(ptr);
+        node->next = lists.heads[cls];
+        lists.heads[cls] = node;
+        lists.counts[cls]++;
+    }
+};
+#endif
+
+/** Base for classes whose instances should be allocated from BlockPool */
+struct PoolAllocated
+{
+#ifndef PROMISE_DISABLE_POOL
+    static void* operator new(size_t size) { return BlockPool::alloc(size); }
+    static void operator delete(void* ptr, size_t size) { BlockPool::release(ptr, size); }
+#endif
+};
+
+struct IVirtDtor: public PoolAllocated
 {  virtual ~IVirtDtor() {}  };
 
 template <class T>
@@ -146,7 +227,12 @@ template <class C>
 class CallbackList
 {
 protected:
-    std::vector<C*> items;
+    // Most promises have a single then() and/or fail() handler, so keep the
+    // first few in place and only allocate for longer lists
+    enum { kInlineCount = 2 };
+    C* mInline[kInlineCount];
+    int mCount = 0;
+    std::vector<C*> mOverflow;
 public:
     CallbackList(){}
 /**
@@ -158,45 +244,64 @@ public:
     template<class SP>
     inline void push(SP& cb)
     {
-        items.push_back(cb.release());
+        pushRaw(cb.get());
+        cb.release();
     }
 
     inline C*& operator[](int idx)
     {
-        assert((idx >= 0) && (idx < (int)items.size()));
-        return items[idx];
+        assert((idx >= 0) && (idx < mCount));
+        return (idx < kInlineCount) ? mInline[idx] : mOverflow[idx - kInlineCount];
     }
-    inline const C*& operator[](int idx) const
+    inline C* const& operator[](int idx) const
     {
-        assert((idx >= 0) && (idx < items.size()));
-        return items[idx];
+        assert((idx >= 0) && (idx < mCount));
+        return (idx < kInlineCount) ? mInline[idx] : mOverflow[idx - kInlineCount];
     }
     inline C*& first()
     {
-        assert(!items.empty());
-        return items[0];
+        assert(mCount);
+        return mInline[0];
     }
     inline int count() const
     {
-        return items.size();
+        return mCount;
     }
     inline void addListMoveItems(CallbackList& other)
     {
-        items.insert(items.end(), other.items.begin(), other.items.end());
-        other.items.clear();
+        for (int i = 0; i < other.mCount; i++)
+        {
+            pushRaw(other[i]);
+        }
+        other.mCount = 0;
+        other.mOverflow.clear();
     }
     void clear()
     {
         static_assert(std::is_base_of<IVirtDtor, C>::value, "Callback type must be inherited from IVirtDtor");
-        for (auto it = items.begin(); it != items.end(); it++)
+        for (int i = 0; i < mCount; i++)
         {
-            delete ((IVirtDtor*)*it); //static_cast wont work here because there is no info that ICallback inherits from IVirtDtor
+            delete ((IVirtDtor*)(*this)[i]); //static_cast wont work here because there is no info that ICallback inherits from IVirtDtor
         }
-        items.clear();
+        mCount = 0;
+        mOverflow.clear();
     }
     ~CallbackList()
     {
-        assert(items.empty());
+        assert(!mCount);
+    }
+protected:
+    inline void pushRaw(C* cb)
+    {
+        if (mCount < kInlineCount)
+        {
+            mInline[mCount] = cb;
+        }
+        else
+        {
+            mOverflow.push_back(cb);
+        }
+        mCount++;
     }
 };
 
@@ -261,9 +366,9 @@ protected:
         return new Callback<typename MaskVoid<P>::type, CB, TP>(std::forward<CB>(cb), next);
     }
 //===
-    struct SharedObj
+    struct SharedObj: public PoolAllocated
     {
-        struct CbLists
+        struct CbLists: public PoolAllocated
         {
             CallbackList<ISuccessCb> mSuccessCbs;
             CallbackList<IFailCb> mFailCbs;
@@ -455,6 +560,34 @@ protected:
         return ret;
     }
 
+/** Calls a then() or fail() handler and returns the promise it produced. Exceptions thrown
+ * by the handler are converted into a rejected promise.
+ */
+    template <typename Out, typename RealOut, typename In, class CB>
+    static Promise<Out> invokeCb(CB& cb, const In& arg)
+    {
+        try
+        {
+            return CallCbHandleVoids::template call<Out, RealOut, In>(cb, arg);
+        }
+        catch(std::exception& e)
+        {
+            return Error(e.what(), kErrException);
+        }
+        catch(Error& e)
+        {
+            return e;
+        }
+        catch(const char* e)
+        {
+            return Error(e, kErrException);
+        }
+        catch(...)
+        {
+            return Error("(unknown exception type)", kErrException);
+        }
+    }
+
 /** Creates a wrapper function around a then() or fail() handler that handles exceptions and propagates
  * the result to resolve/reject chained promises. \c In is the type of the callback's parameter,
  * \c Out is its return type, \c CB is the type of the callback itself.
@@ -468,31 +601,7 @@ protected:
             mutable->void
         {
             Promise<Out>& next = handler.nextPromise; //the 'chaining' promise
-            Promise<Out> promise((_Empty())); //the promise returned by the user callback
-            try
-            {
-                promise = CallCbHandleVoids::template call<Out, RealOut, In>(cb, result);
-            }
-            catch(std::exception& e)
-            {
-                next.reject(Error(e.what(), kErrException));
-                return;
-            }
-            catch(Error& e)
-            {
-                next.reject(e);
-                return;
-            }
-            catch(const char* e)
-            {
-                next.reject(Error(e, kErrException));
-                return;
-            }
-            catch(...)
-            {
-                next.reject(Error("(unknown exception type)", kErrException));
-                return;
-            }
+            Promise<Out> promise = invokeCb<Out, RealOut, In>(cb, result); //the promise returned by the user callback
 
 // connect the promise returned by the user's callback (actually its master)
 // to the chaining promise, returned earlier by then() or fail()
@@ -539,20 +648,17 @@ public:
             return mSharedObj->mError;
 
         typedef typename RemovePromise<typename FuncTraits<F>::RetType>::Type Out;
-        Promise<Out> next;
 
+        // Fast path: already resolved, so the promise returned by the callback is
+        // the result of then(). No callback object or chaining promise is needed
+        if (mSharedObj->mResolved == kSucceeded)
+            return invokeCb<Out, typename FuncTraits<F>::RetType, typename MaskVoid<T>::type>(cb, mSharedObj->mResult);
+
+        assert((mSharedObj->mResolved == kNotResolved));
+        Promise<Out> next;
         std::unique_ptr<ISuccessCb> resolveCb(createChainedCb<typename MaskVoid<T>::type, Out,
             typename FuncTraits<F>::RetType>(std::forward<F>(cb), next));
-
-        if (mSharedObj->mResolved == kSucceeded)
-        {
-            (*resolveCb)(mSharedObj->mResult);
-        }
-        else
-        {
-            assert((mSharedObj->mResolved == kNotResolved));
-            thenCbs().push(resolveCb);
-        }
+        thenCbs().push(resolveCb);
 
         return next;
     }
@@ -576,20 +682,19 @@ public:
         if (mSharedObj->mResolved == kSucceeded)
             return mSharedObj->mResult; //don't call the errorback, just return the successful resolve value
 
-        Promise<T> next;
-        std::unique_ptr<IFailCb> failCb(createChainedCb<Error, T,
-            typename FuncTraits<F>::RetType>(std::forward<F>(eb), next));
-
         if (mSharedObj->mResolved == kFailed)
         {
-            (*failCb)(mSharedObj->mError);
+            // same fast path as in then()
+            Promise<T> ret = invokeCb<T, typename FuncTraits<F>::RetType, Error>(eb, mSharedObj->mError);
             mSharedObj->mError.setHandled();
+            return ret;
         }
-        else
-        {
-            assert((mSharedObj->mResolved == kNotResolved));
-            failCbs().push(failCb);
-        }
+
+        assert((mSharedObj->mResolved == kNotResolved));
+        Promise<T> next;
+        std::unique_ptr<IFailCb> failCb(createChainedCb<Error, T,
+            typename FuncTraits<F>::RetType>(std::forward<F>(eb), next));
+        failCbs().push(failCb);
 
         return next;
     }
@@ -33,6 +33,7 @@ struct TimerMsg: public megaMessage
 {
     timerevent* timerEvent = nullptr;
     bool canceled = false;
+    int64_t postTs = 0; // when the last firing was posted, only set if the loop profiler is enabled
     megaHandle handle;
     TimerMsg(megaMessageFunc aFunc)
         :megaMessage(aFunc),
@@ -67,6 +68,7 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
         {}
         unsigned time;
         int loop;
+        static const char* site() { return KR_FUNCTION_SIGNATURE; }
     };
     megaMessageFunc cfunc = persist
         ? (megaMessageFunc) [](void* arg)
@@ -74,6 +76,7 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
               Msg* msg = static_cast<Msg*>(arg);
               if (msg->canceled)
                   return;
+              LoopProfiler::Scope profile("timer", msg->postTs ? Msg::site() : nullptr, msg->postTs);
               msg->cb();
           }
         : (megaMessageFunc) [](void* arg)
@@ -85,7 +88,10 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
                   timerMutex.unlock();
                   return;
               }
-              msg->cb();
+              {
+                  LoopProfiler::Scope profile("timer", msg->postTs ? Msg::site() : nullptr, msg->postTs);
+                  msg->cb();
+              }
               if (msg->canceled)
               {
                   timerMutex.unlock();
@@ -110,7 +116,9 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
         uv_timer_start(pMsg->timerEvent,
                        [](uv_timer_t* handle)
                        {
-                           megaPostMessageToGui(handle->data, ((Msg*)handle->data)->appCtx);
+                           Msg* msg = static_cast<Msg*>(handle->data);
+                           msg->postTs = gLoopProfiler.isEnabled() ? LoopProfiler::now() : 0;
+                           megaPostMessageToGui(msg, msg->appCtx);
                        }, pMsg->time, pMsg->loop ? pMsg->time : 0);
     }, ctx);    
     return pMsg->handle;
@@ -1,33 +1,46 @@
 #include "base64url.h"
 #include <stdexcept>
 
-static char b64enctable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+const char b64urlEncTable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 std::string base64urlencode(const void *data, size_t inlen)
 {
-    std::string encoded_data;
-    encoded_data.reserve(((inlen+2) / 3) * 4);
-    for (size_t i = 0; i < inlen;)
+    std::string encoded_data(base64urlEncodedSize(inlen), '\0');
+    if (inlen)
     {
-        uint8_t octet_a = i < inlen ? static_cast<const char*>(data)[i++] : 0;
-        uint8_t octet_b = i < inlen ? static_cast<const char*>(data)[i++] : 0;
-        uint8_t octet_c = i < inlen ? static_cast<const char*>(data)[i++] : 0;
-
-        uint32_t triple = (octet_a << 16) + (octet_b << 8) + octet_c;
+        base64urlencode(data, inlen, &encoded_data[0]);
+    }
+    return encoded_data;
+}
 
-        encoded_data+= b64enctable[(triple >> 18) & 0x3F];
-        encoded_data+= b64enctable[(triple >> 12) & 0x3F];
-        encoded_data+= b64enctable[(triple >> 6) & 0x3F];
-        encoded_data+= b64enctable[triple & 0x3F];
+size_t base64urlencode(const void *data, size_t inlen, char *out)
+{
+    const uint8_t *in = static_cast<const uint8_t*>(data);
+    char *pos = out;
+    size_t i = 0;
+    for (; i + 3 <= inlen; i += 3)
+    {
+        uint32_t triple = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        *pos++ = b64urlEncTable[(triple >> 18) & 0x3F];
+        *pos++ = b64urlEncTable[(triple >> 12) & 0x3F];
+        *pos++ = b64urlEncTable[(triple >> 6) & 0x3F];
+        *pos++ = b64urlEncTable[triple & 0x3F];
     }
-    int mod = inlen % 3;
-    if (mod)
+
+    size_t rest = inlen - i;
+    if (rest)
     {
-        encoded_data.resize(encoded_data.size() - (3 - mod));
+        uint32_t triple = (in[i] << 16) | ((rest > 1) ? (in[i + 1] << 8) : 0);
+        *pos++ = b64urlEncTable[(triple >> 18) & 0x3F];
+        *pos++ = b64urlEncTable[(triple >> 12) & 0x3F];
+        if (rest > 1)
+        {
+            *pos++ = b64urlEncTable[(triple >> 6) & 0x3F];
+        }
     }
-    return encoded_data;
+    return pos - out;
 }
 
-static const unsigned char b64dectable[] = {
+const unsigned char b64urlDecTable[] = {
     255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
     255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
     255,255,255,255,255,255,255,255,255,255,255,62, 255, 62,255, 63,
@@ -59,11 +72,11 @@ size_t base64urldecode(const char* str, size_t len, void* bin, size_t binlen)
     unsigned char* out = (unsigned char*)bin;
     for(;in <= last;)
     {
-        unsigned char one = b64dectable[*in++];
+        unsigned char one = b64urlDecTable[*in++];
         if (one > 63)
             throw std::runtime_error(std::string("Invalid char "+std::to_string(*(in-1))+ " in base64 stream at offset ") + std::to_string(((char*)(in-1)-str)));
 
-        unsigned char two = b64dectable[*in++];
+        unsigned char two = b64urlDecTable[*in++];
         if (two > 63)
             throw std::runtime_error(std::string("Invalid char "+std::to_string(*(in-1))+ " in base64 stream at offset ") + std::to_string(((char*)(in-1)-str)));
 
@@ -71,7 +84,7 @@ size_t base64urldecode(const char* str, size_t len, void* bin, size_t binlen)
         if (in > last)
             break;
 
-        unsigned char three = b64dectable[*in++];
+        unsigned char three = b64urlDecTable[*in++];
         if (three > 63)
             throw std::runtime_error(std::string("Invalid char "+std::to_string(*(in-1))+ " in base64 stream at offset ") + std::to_string(((char*)(in-1)-str)));
         *out++ = (two << 4) | (three >> 2);
@@ -79,7 +92,7 @@ size_t base64urldecode(const char* str, size_t len, void* bin, size_t binlen)
         if (in > last)
             break;
 
-        unsigned char four = b64dectable[*in++];
+        unsigned char four = b64urlDecTable[*in++];
         if (four > 63)
             throw std::runtime_error(std::string("Invalid char "+std::to_string(*(in-1))+ " in base64 stream at offset ") + std::to_string(((char*)(in-1)-str)));
 
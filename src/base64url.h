@@ -1,8 +1,100 @@
 #ifndef BASE64_H
 #define BASE64_H
 #include <string>
+#include <stdint.h>
 
 std::string base64urlencode(const void *data, size_t inlen);
+/** @brief Encodes into \c out, which must have room for base64urlEncodedSize(inlen) chars (not NUL-terminated).
+ * @return The length of the encoded data */
+size_t base64urlencode(const void *data, size_t inlen, char *out);
 size_t base64urldecode(const char* str, size_t len, void* bin, size_t binlen);
-#endif // BASE64_H
 
+extern const char b64urlEncTable[];
+extern const unsigned char b64urlDecTable[];
+
+/** Length of the base64url encoding (without padding) of \c len bytes */
+constexpr size_t base64urlEncodedSize(size_t len) { return (len * 4 + 2) / 3; }
+
+/** @brief Encodes ids of a fixed size (6 bytes for chat-link handles, 8 for the rest) into
+ * \c out, which must have room for base64urlEncodedSize(N) chars. The loops are unrolled
+ * by the compiler, and no memory is allocated.
+ * @return The length of the encoded data
+ */
+template <size_t N>
+inline size_t base64urlencodeFixed(const void *data, char *out)
+{
+    static_assert(N == 6 || N == 8, "Fixed-width base64url encoding is only for ids");
+    const uint8_t *in = static_cast<const uint8_t*>(data);
+    size_t i = 0;
+    for (; i + 3 <= N; i += 3)
+    {
+        uint32_t triple = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        *out++ = b64urlEncTable[(triple >> 18) & 0x3F];
+        *out++ = b64urlEncTable[(triple >> 12) & 0x3F];
+        *out++ = b64urlEncTable[(triple >> 6) & 0x3F];
+        *out++ = b64urlEncTable[triple & 0x3F];
+    }
+    if (N % 3 == 2)
+    {
+        uint32_t triple = (in[i] << 16) | (in[i + 1] << 8);
+        *out++ = b64urlEncTable[(triple >> 18) & 0x3F];
+        *out++ = b64urlEncTable[(triple >> 12) & 0x3F];
+        *out++ = b64urlEncTable[(triple >> 6) & 0x3F];
+    }
+    return base64urlEncodedSize(N);
+}
+
+/** @brief Decodes the base64urlEncodedSize(N) chars of \c str into the N bytes of \c out.
+ * @return false if \c str has invalid chars. Use base64urldecode() to get the error detail
+ */
+template <size_t N>
+inline bool base64urldecodeFixed(const char *str, void *out)
+{
+    static_assert(N == 6 || N == 8, "Fixed-width base64url decoding is only for ids");
+    const unsigned char *in = reinterpret_cast<const unsigned char*>(str);
+    uint8_t *bin = static_cast<uint8_t*>(out);
+    unsigned char invalid = 0;
+    size_t i = 0;
+    size_t o = 0;
+    for (; o + 3 <= N; i += 4, o += 3)
+    {
+        unsigned char one = b64urlDecTable[in[i]];
+        unsigned char two = b64urlDecTable[in[i + 1]];
+        unsigned char three = b64urlDecTable[in[i + 2]];
+        unsigned char four = b64urlDecTable[in[i + 3]];
+        invalid |= one | two | three | four;
+        bin[o] = static_cast<uint8_t>((one << 2) | (two >> 4));
+        bin[o + 1] = static_cast<uint8_t>((two << 4) | (three >> 2));
+        bin[o + 2] = static_cast<uint8_t>((three << 6) | four);
+    }
+    if (N % 3 == 2)
+    {
+        unsigned char one = b64urlDecTable[in[i]];
+        unsigned char two = b64urlDecTable[in[i + 1]];
+        unsigned char three = b64urlDecTable[in[i + 2]];
+        invalid |= one | two | three;
+        bin[o] = static_cast<uint8_t>((one << 2) | (two >> 4));
+        bin[o + 1] = static_cast<uint8_t>((two << 4) | (three >> 2));
+    }
+    return (invalid & 0xC0) == 0;  // invalid chars are decoded as 255
+}
+
+/** @brief Compile-time decoding of the 11 chars of an id, i.e. for constants. The result has
+ * the same byte layout in memory as the one of base64urldecode() in a little-endian host */
+constexpr unsigned base64urlConstChar(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? static_cast<unsigned>(c - 'A')
+         : (c >= 'a' && c <= 'z') ? static_cast<unsigned>(c - 'a' + 26)
+         : (c >= '0' && c <= '9') ? static_cast<unsigned>(c - '0' + 52)
+         : (c == '-') ? 62u : 63u;
+}
+// each byte is within the 12 bits of two consecutive chars, at bit offset (8*i) % 6
+constexpr uint64_t base64urlConstByte(const char *b64, unsigned i)
+{
+    return (((base64urlConstChar(b64[i * 8 / 6]) << 6) | base64urlConstChar(b64[i * 8 / 6 + 1])) >> (4 - (i * 8) % 6)) & 0xFF;
+}
+constexpr uint64_t base64urlConstId(const char *b64, unsigned i = 0)
+{
+    return (i == 8) ? 0 : (base64urlConstByte(b64, i) << (8 * i)) | base64urlConstId(b64, i + 1);
+}
+#endif // BASE64_H
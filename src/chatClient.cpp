@@ -68,6 +68,52 @@ bool Client::isInBackground() const
     return mIsInBackground;
 }
 
+unsigned Client::maxResidentMsgsPerChat() const
+{
+    return mMaxResidentMsgsPerChat;
+}
+
+unsigned Client::maxResidentMsgs() const
+{
+    return mMaxResidentMsgs;
+}
+
+void Client::setResidentHistoryLimits(unsigned maxPerChat, unsigned maxTotal)
+{
+    mMaxResidentMsgsPerChat = maxPerChat;
+    mMaxResidentMsgs = maxTotal;
+    if (mChatdClient)
+    {
+        mChatdClient->scheduleHistoryEviction();
+    }
+}
+
+MemoryReport Client::getMemoryReport() const
+{
+    MemoryReport report;
+    if (mChatdClient)
+    {
+        mChatdClient->addMemoryUsage(report);
+    }
+    if (mUserAttrCache)
+    {
+        mUserAttrCache->addMemoryUsage(report);
+    }
+    mPresencedClient.addMemoryUsage(report);
+    return report;
+}
+
+Metrics Client::getMetrics() const
+{
+    Metrics metrics;
+    if (mChatdClient)
+    {
+        mChatdClient->addMetrics(metrics);
+    }
+    mPresencedClient.addMetrics(metrics);
+    return metrics;
+}
+
 /* Warning - the database is not initialzed at construction, but only after
  * init() is called. Therefore, no code in this constructor should access or
  * depend on the database
@@ -78,6 +124,7 @@ Client::Client(::mega::MegaApi& sdk, WebsocketsIO *websocketsIO, IApp& aApp, con
           appCtx(ctx),
           api(sdk, ctx),
           app(aApp),
+          mDbPrefetcher(new ChatdDbPrefetcher(db)),
           mDnsCache(db, chatd::Client::chatdVersion),
           contactList(new ContactList(*this)),
           chats(new ChatRoomList(*this)),
@@ -1083,6 +1130,7 @@ void Client::onRequestFinish(::mega::MegaApi* /*apiObj*/, ::mega::MegaRequest *r
 //be in that dir, and it is in use
 void Client::wipeDb(const std::string& sid)
 {
+    mDbPrefetcher->stop();
     db.close();
     std::string path = dbPath(sid);
     remove(path.c_str());
@@ -1294,6 +1342,8 @@ void Client::sendStats()
         return;
     }
 
+    const WebsocketsIO::TlsStats &tlsStats = websocketIO->tlsStats();
+    mInitStats.setTlsHandshakes(tlsStats.fullHandshakes, tlsStats.resumedHandshakes);
     std::string stats = mInitStats.onCompleted(api.sdk.getNumNodes(), chats->size(), contactList->size());
     KR_LOG_DEBUG("Init stats: %s", stats.c_str());
     api.callIgnoreResult(&::mega::MegaApi::sendEvent, 99008, jsonUnescape(stats).c_str());
@@ -1570,6 +1620,12 @@ void Client::terminate(bool deleteDb)
         else if (db.isOpen())
         {
             KR_LOG_INFO("Doing final COMMIT to database");
+            mDbPrefetcher->stop();
+            if (mChatdClient)
+            {
+                // the client may be already disconnected, but pointers may be still pending
+                mChatdClient->flushPendingPointers(false);
+            }
             db.commit();
             db.close();
         }
@@ -1961,6 +2017,8 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
   (chatd::Priv)aChat.getOwnPrivilege(), aChat.getCreationTime(), aChat.isArchived()),
   mRoomGui(nullptr)
 {
+    parent.indexRoom(mChatid);
+
     // Initialize list of peers and fetch their names
     auto peers = aChat.getPeerList();
     std::vector<promise::Promise<void>> promises;
@@ -1972,6 +2030,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
             auto handle = peers->getPeerHandle(i);
             assert(handle != parent.mKarereClient.myHandle());
             mPeers[handle] = new Member(*this, handle, (chatd::Priv)peers->getPeerPrivilege(i)); //may try to access mContactGui, but we have set it to nullptr, so it's ok
+            parent.indexMember(mChatid, handle);
             promises.push_back(mPeers[handle]->nameResolved());
         }
     }
@@ -2039,6 +2098,8 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
     :ChatRoom(parent, chatid, true, aShard, aOwnPriv, ts, aIsArchived),
     mRoomGui(nullptr)
 {
+    parent.indexRoom(mChatid);
+
     // Initialize list of peers
     SqliteStmt stmt(parent.mKarereClient.db, "select userid, priv from chat_peers where chatid=?");
     stmt << mChatid;
@@ -2066,6 +2127,8 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
 :ChatRoom(parent, chatid, true, aShard, aOwnPriv, ts, aIsArchived, title),
   mRoomGui(nullptr)
 {
+    parent.indexRoom(mChatid);
+
     Buffer unifiedKeyBuf;
     unifiedKeyBuf.write(0, (uint8_t)strongvelope::kDecrypted);  // prefix to indicate it's decrypted
     unifiedKeyBuf.append(unifiedKey->data(), unifiedKey->size());
@@ -2133,6 +2196,7 @@ PeerChatRoom::PeerChatRoom(ChatRoomList& parent, const uint64_t& chatid,
     mPeerPriv(peerPriv),
     mRoomGui(nullptr)
 {
+    parent.indexMember(mChatid, mPeer);
     initContact(peer);
     initWithChatd();
     mRoomGui = addAppItem();
@@ -2152,6 +2216,7 @@ PeerChatRoom::PeerChatRoom(ChatRoomList& parent, const mega::MegaTextChat& chat)
 
     KR_LOG_DEBUG("Added 1on1 chatroom '%s' from API",  ID_CSTR(mChatid));
 
+    parent.indexMember(mChatid, mPeer);
     initContact(mPeer);
     initWithChatd();
     mRoomGui = addAppItem();
@@ -2174,6 +2239,9 @@ PeerChatRoom::~PeerChatRoom()
     {
         client.mChatdClient->leave(mChatid);
     }
+
+    parent.unindexMember(mChatid, mPeer);
+    parent.unindexRoom(mChatid);
 }
 
 void PeerChatRoom::initContact(const uint64_t& peer)
@@ -2340,6 +2408,7 @@ promise::Promise<void> GroupChatRoom::addMember(uint64_t userid, chatd::Priv pri
     else
     {
         mPeers.emplace(userid, new Member(*this, userid, priv)); //usernames will be updated when the Member object gets the username attribute
+        parent.indexMember(mChatid, userid);
     }
     if (saveToDb)
     {
@@ -2363,6 +2432,7 @@ bool GroupChatRoom::removeMember(uint64_t userid)
 
     delete it->second;
     mPeers.erase(it);
+    parent.unindexMember(mChatid, userid);
     parent.mKarereClient.db.query("delete from chat_peers where chatid=? and userid=?", mChatid, userid);
 
     return true;
@@ -2660,6 +2730,163 @@ void ChatRoomList::onChatsUpdate(::mega::MegaTextChatList& rooms)
     }
 }
 
+uint64_t ChatRoomList::memberHash(uint64_t userid)
+{
+    // splitmix64 finalizer, so sums of hashes of different sets rarely collide
+    userid += 0x9e3779b97f4a7c15ULL;
+    userid = (userid ^ (userid >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    userid = (userid ^ (userid >> 27)) * 0x94d049bb133111ebULL;
+    return userid ^ (userid >> 31);
+}
+
+void ChatRoomList::setMemberSetHash(uint64_t chatid, uint64_t hash)
+{
+    auto it = mMemberSetHashes.find(chatid);
+    if (it != mMemberSetHashes.end())
+    {
+        auto bucket = mRoomsByMemberSet.find(it->second);
+        if (bucket != mRoomsByMemberSet.end())
+        {
+            bucket->second.erase(chatid);
+            if (bucket->second.empty())
+            {
+                mRoomsByMemberSet.erase(bucket);
+            }
+        }
+        it->second = hash;
+    }
+    else
+    {
+        mMemberSetHashes[chatid] = hash;
+    }
+    mRoomsByMemberSet[hash].insert(chatid);
+}
+
+void ChatRoomList::indexRoom(uint64_t chatid)
+{
+    if (mMemberSetHashes.find(chatid) == mMemberSetHashes.end())
+    {
+        setMemberSetHash(chatid, 0);    // no peers yet
+    }
+}
+
+void ChatRoomList::unindexRoom(uint64_t chatid)
+{
+    auto it = mMemberSetHashes.find(chatid);
+    if (it == mMemberSetHashes.end())
+    {
+        return;
+    }
+
+    auto bucket = mRoomsByMemberSet.find(it->second);
+    if (bucket != mRoomsByMemberSet.end())
+    {
+        bucket->second.erase(chatid);
+        if (bucket->second.empty())
+        {
+            mRoomsByMemberSet.erase(bucket);
+        }
+    }
+    mMemberSetHashes.erase(it);
+}
+
+void ChatRoomList::indexMember(uint64_t chatid, uint64_t userid)
+{
+    if (!mRoomsByPeer[userid].insert(chatid).second)
+    {
+        return; // already indexed
+    }
+
+    auto it = mMemberSetHashes.find(chatid);
+    uint64_t hash = (it != mMemberSetHashes.end()) ? it->second : 0;
+    setMemberSetHash(chatid, hash + memberHash(userid));
+}
+
+void ChatRoomList::unindexMember(uint64_t chatid, uint64_t userid)
+{
+    auto rooms = mRoomsByPeer.find(userid);
+    if (rooms == mRoomsByPeer.end() || !rooms->second.erase(chatid))
+    {
+        return;
+    }
+    if (rooms->second.empty())
+    {
+        mRoomsByPeer.erase(rooms);
+    }
+
+    auto it = mMemberSetHashes.find(chatid);
+    assert(it != mMemberSetHashes.end());
+    setMemberSetHash(chatid, it->second - memberHash(userid));
+}
+
+PeerChatRoom* ChatRoomList::findPeerChatRoom(uint64_t userid) const
+{
+    auto rooms = mRoomsByPeer.find(userid);
+    if (rooms == mRoomsByPeer.end())
+    {
+        return nullptr;
+    }
+
+    for (auto& chatid: rooms->second)
+    {
+        auto it = find(chatid);
+        if (it != end() && !it->second->isGroup())
+        {
+            return static_cast<PeerChatRoom*>(it->second);
+        }
+    }
+    return nullptr;
+}
+
+std::vector<ChatRoom*> ChatRoomList::findRoomsByMembers(const SetOfIds& peers) const
+{
+    std::vector<ChatRoom*> result;
+
+    uint64_t hash = 0;
+    for (auto& userid: peers)
+    {
+        hash += memberHash(userid);
+    }
+
+    auto bucket = mRoomsByMemberSet.find(hash);
+    if (bucket == mRoomsByMemberSet.end())
+    {
+        return result;
+    }
+
+    // different sets of peers may share the hash, so check the actual peers of every candidate
+    for (auto& chatid: bucket->second)
+    {
+        auto it = find(chatid);
+        if (it == end())
+        {
+            continue;
+        }
+
+        ChatRoom *room = it->second;
+        bool sameParticipants;
+        if (room->isGroup())
+        {
+            const GroupChatRoom::MemberMap& members = static_cast<GroupChatRoom*>(room)->peers();
+            sameParticipants = (members.size() == peers.size());
+            for (auto m = members.begin(); sameParticipants && m != members.end(); m++)
+            {
+                sameParticipants = peers.has(m->first);
+            }
+        }
+        else
+        {
+            sameParticipants = (peers.size() == 1 && *peers.begin() == static_cast<PeerChatRoom*>(room)->peer());
+        }
+
+        if (sameParticipants)
+        {
+            result.push_back(room);
+        }
+    }
+    return result;
+}
+
 ChatRoomList::~ChatRoomList()
 {
     for (auto& room: *this)
@@ -2831,8 +3058,10 @@ GroupChatRoom::~GroupChatRoom()
 
     for (auto& m: mPeers)
     {
+        parent.unindexMember(mChatid, m.first);
         delete m.second;
     }
+    parent.unindexRoom(mChatid);
 }
 
 promise::Promise<void> GroupChatRoom::leave()
@@ -2950,7 +3179,7 @@ promise::Promise<void> GroupChatRoom::autojoinPublicChat(uint64_t ph)
 void ChatRoom::init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
 {
     mChat = &chat;
-    dbIntf = new ChatdSqliteDb(*mChat, parent.mKarereClient.db);
+    dbIntf = new ChatdSqliteDb(*mChat, parent.mKarereClient.db, parent.mKarereClient.mDbPrefetcher.get());
     if (mAppChatHandler)
     {
         setAppChatHandler(mAppChatHandler);
@@ -2969,6 +3198,9 @@ void ChatRoom::setAppChatHandler(IApp::IChatHandler* handler)
 //return to the event loop
     mChat->setListener(mAppChatHandler);
     mAppChatHandler->init(*mChat, dummyIntf);
+
+    // if still waiting to join after a reconnection, this chat goes first
+    mChat->connection().prioritizeJoin(mChatid);
 }
 
 void ChatRoom::removeAppChatHandler()
@@ -2977,6 +3209,9 @@ void ChatRoom::removeAppChatHandler()
         return;
     mAppChatHandler = nullptr;
     mChat->setListener(this);
+
+    // the history of the chat can be evicted from RAM now
+    mChat->client().scheduleHistoryEviction();
 }
 
 bool ChatRoom::hasChatHandler() const
@@ -3298,8 +3533,10 @@ bool GroupChatRoom::syncMembers(const mega::MegaTextChat& chat)
         if (it == users.end()) //we have a user that is not in the chatroom anymore
         {
             peersChanged = true;
-            ourIt++;    // prevent iterator becoming invalid due to removal
+            // removal shifts the following members down, so ourIt already points to the next one
+            size_t pos = ourIt - mPeers.begin();
             removeMember(userid);
+            ourIt = mPeers.begin() + pos;
         }
         else    // existing peer changed privilege
         {
@@ -3516,6 +3753,10 @@ GroupChatRoom::Member::Member(GroupChatRoom& aRoom, const uint64_t& user, chatd:
         {
             self->mName.assign("\0", 1);
         }
+        if (self->mRoom.mRoomGui)
+        {
+            self->mRoom.mRoomGui->onMemberNameChanged(self->mHandle, self->mName);
+        }
         if (self->mRoom.mAppChatHandler)
         {
             self->mRoom.mAppChatHandler->onMemberNameChanged(self->mHandle, self->mName);
@@ -3562,13 +3803,29 @@ promise::Promise<void> GroupChatRoom::Member::nameResolved() const
 
 void Client::connectToChatd()
 {
+    // start all the shards at once, but those of the chats opened by the app go first
+    std::vector<ChatRoom*> others;
     for (auto& item: *chats)
     {
         auto& chat = *item.second;
-        if (!chat.chat().isDisabled())
+        if (chat.chat().isDisabled())
+        {
+            continue;
+        }
+
+        if (isChatRoomOpened(item.first))
         {
             chat.connect();
         }
+        else
+        {
+            others.push_back(item.second);
+        }
+    }
+
+    for (auto chat: others)
+    {
+        chat->connect();
     }
 }
 
@@ -4082,6 +4339,12 @@ std::string InitStats::onCompleted(long long numNodes, size_t numChats, size_t n
     return json;
 }
 
+void InitStats::setTlsHandshakes(unsigned int full, unsigned int resumed)
+{
+    mTlsFullHandshakes = full;
+    mTlsResumedHandshakes = resumed;
+}
+
 mega::dstime InitStats::currentTime()
 {
 #if defined(_WIN32) && defined(_MSC_VER)
@@ -4360,6 +4623,12 @@ std::string InitStats::toJson()
     jsonValue.SetInt64(mInitState);
     jSonObject.AddMember(rapidjson::Value("sid"), jsonValue, jSonDocument.GetAllocator());
 
+    // Add number of full and resumed TLS handshakes
+    jsonValue.SetUint(mTlsFullHandshakes);
+    jSonObject.AddMember(rapidjson::Value("tlsf"), jsonValue, jSonDocument.GetAllocator());
+    jsonValue.SetUint(mTlsResumedHandshakes);
+    jSonObject.AddMember(rapidjson::Value("tlsr"), jsonValue, jSonDocument.GetAllocator());
+
     // Add init stats version
     uint32_t version = INITSTATSVERSION;
     jsonValue.SetUint(version);
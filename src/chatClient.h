@@ -35,6 +35,7 @@ namespace strongvelope { class ProtocolHandler; }
 
 struct sqlite3;
 class Buffer;
+class ChatdDbPrefetcher;
 
 #define ID_CSTR(id) Id(id).toString().c_str()
 
@@ -327,7 +328,7 @@ public:
     };
     /**
      * @brief A map that holds all the members of a group chat room, keyed by the userid */
-    typedef std::map<uint64_t, Member*> MemberMap;
+    typedef FlatMap<uint64_t, Member*> MemberMap;
 
     /** @cond PRIVATE */
 protected:
@@ -460,7 +461,31 @@ public:
     void loadFromDb();
     void previewCleanup(karere::Id chatid);
     void onChatsUpdate(mega::MegaTextChatList& chats);
+
+    // Maintenance of the indexes by member. Called by the chatrooms whenever their peers change
+    void indexMember(uint64_t chatid, uint64_t userid);
+    void unindexMember(uint64_t chatid, uint64_t userid);
+    void indexRoom(uint64_t chatid);
+    void unindexRoom(uint64_t chatid);
 /** @endcond PRIVATE */
+
+    /** @brief Returns the 1on1 chatroom with the specified user, or NULL if there isn't any */
+    PeerChatRoom* findPeerChatRoom(uint64_t userid) const;
+
+    /** @brief Returns the chatrooms (1on1 or groupchats) whose peers are exactly
+     * the users in \c peers (our own user is not considered a peer)
+     */
+    std::vector<ChatRoom*> findRoomsByMembers(const karere::SetOfIds& peers) const;
+
+protected:
+    /** Hash of the set of peers of a chatroom, the sum of the hashes of every
+     * peer so it can be updated incrementally when peers join or leave */
+    static uint64_t memberHash(uint64_t userid);
+    void setMemberSetHash(uint64_t chatid, uint64_t hash);
+
+    std::map<uint64_t, karere::SetOfIds> mRoomsByPeer;
+    std::map<uint64_t, karere::SetOfIds> mRoomsByMemberSet;
+    std::map<uint64_t, uint64_t> mMemberSetHashes;   // chatid -> hash of its set of peers
 };
 
 /** @brief Represents a karere contact. Also handles presence change events. */
@@ -633,8 +658,9 @@ class InitStats
          * - Version 1: Initial version
          * - Version 2: Fix errors and discard atypical values
          * - Version 3: Implement DNS, Chatd and Presenced Ip/Url cache
+         * - Version 4: Add number of full and resumed TLS handshakes
          */
-        const uint32_t INITSTATSVERSION = 3;
+        const uint32_t INITSTATSVERSION = 4;
 
         /** @brief Init states in init stats */
         enum
@@ -666,6 +692,9 @@ class InitStats
         };
 
         std::string onCompleted(long long numNodes, size_t numChats, size_t numContacts);
+
+        /** @brief Set the number of TLS handshakes done by the network layer */
+        void setTlsHandshakes(unsigned int full, unsigned int resumed);
         bool isCompleted() const;
         void onCanceled();
 
@@ -736,6 +765,12 @@ private:
     /** @brief Number of contacts in the account */
     long int mNumContacts = 0;
 
+    /** @brief Number of TLS connections that required a full handshake */
+    unsigned int mTlsFullHandshakes = 0;
+
+    /** @brief Number of TLS connections that resumed a previous session */
+    unsigned int mTlsResumedHandshakes = 0;
+
     /** @brief Flag that indicates whether the stats have already been sent */
     bool mCompleted = false;
 
@@ -864,6 +899,7 @@ public:
     MyMegaApi api;              // MegaApi's instance
     IApp& app;                  // app's interface
     SqliteDb db;                // db-layer interface
+    std::unique_ptr<ChatdDbPrefetcher> mDbPrefetcher;  // loads history from db in background
     DNScache mDnsCache;         // dns cache
 
     std::unique_ptr<chatd::Client> mChatdClient;
@@ -925,7 +961,12 @@ protected:
     AliasesMap mAliasesMap;
     bool mIsInBackground = false;
 
+    // limits of messages kept in the RAM history buffers, 0 means no limit
+    unsigned mMaxResidentMsgsPerChat = kDefaultMaxResidentMsgsPerChat;
+    unsigned mMaxResidentMsgs = kDefaultMaxResidentMsgs;
+
 public:
+    enum: unsigned { kDefaultMaxResidentMsgsPerChat = 0, kDefaultMaxResidentMsgs = 0 };
 
     /**
      * @brief Creates a karere Client.
@@ -1120,6 +1161,27 @@ public:
     bool isInBackground() const;
     void updateAliases(Buffer *data);
 
+    /** @brief Max number of messages kept in RAM for a chat not opened by the app (0 if no limit) */
+    unsigned maxResidentMsgsPerChat() const;
+    /** @brief Max number of messages kept in RAM for all chats (0 if no limit) */
+    unsigned maxResidentMsgs() const;
+    /**
+     * @brief Sets the limits of messages kept in RAM. When exceeded, the oldest messages
+     * of the chats not opened by the app, the least recently viewed first, are evicted
+     * from RAM. They are loaded again from db when the app requests history.
+     *
+     * Chats opened by the app are never evicted, so the total may exceed \c maxTotal.
+     * A value of 0 means no limit.
+     */
+    void setResidentHistoryLimits(unsigned maxPerChat, unsigned maxTotal);
+
+    /** @brief Walks the containers of chatd, strongvelope, the user attribute cache and
+     * presenced, to report the memory used by each of them */
+    MemoryReport getMemoryReport() const;
+
+    /** @brief Snapshot of the traffic and processing counters of chatd and presenced */
+    Metrics getMetrics() const;
+
     /** @brief Returns a string that contains the user alias in UTF-8 if exists, otherwise returns an empty string*/
     std::string getUserAlias(uint64_t userId);
 
@@ -303,6 +303,161 @@ uint8_t Client::keepaliveType()
     return mKarereClient->isInBackground() ? OP_KEEPALIVEAWAY : OP_KEEPALIVE;
 }
 
+unsigned Client::maxOutstandingJoins() const
+{
+    return mMaxOutstandingJoins;
+}
+
+void Client::setMaxOutstandingJoins(unsigned count)
+{
+    mMaxOutstandingJoins = count;
+}
+
+size_t Client::residentMsgCount() const
+{
+    size_t count = 0;
+    for (auto& it: mChatForChatId)
+    {
+        count += it.second->size();
+    }
+    return count;
+}
+
+void Client::addMemoryUsage(karere::MemoryReport& report) const
+{
+    for (auto& it: mChatForChatId)
+    {
+        it.second->addMemoryUsage(report);
+    }
+    report.addNodes("chatd.lastMsgTs", mLastMsgTs);
+
+    size_t recvBuffers = 0;
+    for (auto& it: mConnections)
+    {
+        recvBuffers += it.second->wsStats().recvBufferBytes;
+    }
+    report.add("chatd.recvBuffers", recvBuffers, mConnections.size());
+}
+
+void Client::addMetrics(karere::Metrics& metrics) const
+{
+    for (auto& it: mConnections)
+    {
+        it.second->addMetrics(metrics);
+    }
+
+    for (unsigned type = 0; type < 256; type++)
+    {
+        karere::Metrics::Labels labels = { {"type", std::to_string(type)} };
+        const karere::LatencyStats& decrypt = mDecryptStats[type];
+        if (decrypt.count.get())
+        {
+            metrics.add("chatd_decrypted_messages_total", karere::Metrics::kCounter,
+                        "Messages decrypted, by message type", labels, decrypt.count.get());
+            metrics.add("chatd_decrypt_microseconds_total", karere::Metrics::kCounter,
+                        "Time to decrypt messages, including waiting for keys", labels, decrypt.totalUs.get());
+            metrics.add("chatd_decrypt_max_microseconds", karere::Metrics::kGauge,
+                        "Longest time to decrypt a message", labels, decrypt.maxUs.get());
+        }
+        const karere::LatencyStats& encrypt = mEncryptStats[type];
+        if (encrypt.count.get())
+        {
+            metrics.add("chatd_encrypted_messages_total", karere::Metrics::kCounter,
+                        "Messages encrypted, by message type", labels, encrypt.count.get());
+            metrics.add("chatd_encrypt_microseconds_total", karere::Metrics::kCounter,
+                        "Time to encrypt messages, including waiting for keys", labels, encrypt.totalUs.get());
+            metrics.add("chatd_encrypt_max_microseconds", karere::Metrics::kGauge,
+                        "Longest time to encrypt a message", labels, encrypt.maxUs.get());
+        }
+    }
+
+    // only the chats with messages pending to send, to keep the number of samples bounded
+    for (auto& it: mChatForChatId)
+    {
+        size_t depth = it.second->mSending.size();
+        if (depth)
+        {
+            metrics.add("chatd_send_queue_depth", karere::Metrics::kGauge,
+                        "Messages in the sending queue of the chat", { {"chatid", it.first.toString()} }, depth);
+        }
+    }
+}
+
+void Client::scheduleHistoryEviction()
+{
+    if (mHistoryEvictionTimer
+            || (!mKarereClient->maxResidentMsgsPerChat() && !mKarereClient->maxResidentMsgs()))
+    {
+        return;
+    }
+
+    auto wptr = weakHandle();
+    mHistoryEvictionTimer = karere::setTimeout([this, wptr]()
+    {
+        if (wptr.deleted())
+            return;
+
+        mHistoryEvictionTimer = 0;
+        evictHistory();
+    }, kHistoryEvictionDelay, mKarereClient->appCtx);
+}
+
+void Client::evictHistory()
+{
+    // evict down to 3/4 of the limits, so the next few messages don't trigger another eviction
+    unsigned maxPerChat = mKarereClient->maxResidentMsgsPerChat();
+    unsigned maxTotal = mKarereClient->maxResidentMsgs();
+    size_t total = 0;
+    std::vector<Chat*> candidates;
+    for (auto& it: mChatForChatId)
+    {
+        Chat& chat = *it.second;
+        total += chat.size();
+        if (!mKarereClient->isChatRoomOpened(it.first))
+        {
+            candidates.push_back(&chat);
+        }
+    }
+
+    size_t evicted = 0;
+    if (maxPerChat)
+    {
+        for (auto chat: candidates)
+        {
+            if (chat->size() > (Idx)maxPerChat)
+            {
+                evicted += chat->evictHistory(maxPerChat / 4 * 3);
+            }
+        }
+    }
+
+    if (maxTotal && (total - evicted) > maxTotal)
+    {
+        // least recently viewed chats first
+        std::sort(candidates.begin(), candidates.end(), [](const Chat* a, const Chat* b)
+        {
+            return a->lastHistoryAccessTs() < b->lastHistoryAccessTs();
+        });
+
+        size_t target = maxTotal / 4 * 3;
+        for (auto chat: candidates)
+        {
+            size_t excess = total - evicted - target;
+            Idx size = chat->size();
+            evicted += chat->evictHistory(((size_t)size > excess) ? size - (Idx)excess : 0);
+            if (total - evicted <= target)
+            {
+                break;
+            }
+        }
+    }
+
+    if (evicted)
+    {
+        CHATD_LOG_DEBUG("Evicted %zu messages from RAM, %zu messages still resident", evicted, total - evicted);
+    }
+}
+
 std::shared_ptr<Chat> Client::chatFromId(Id chatid) const
 {
     auto it = mChatForChatId.find(chatid);
@@ -335,11 +490,46 @@ promise::Promise<void> Client::notifyUserStatus()
 
 void Client::cancelSeenTimers()
 {
-   for (std::set<megaHandle>::iterator it = mSeenTimers.begin(); it != mSeenTimers.end(); ++it)
-   {
-        cancelTimeout(*it, mKarereClient->appCtx);
-   }
-   mSeenTimers.clear();
+    flushPendingPointers(false);
+}
+
+void Client::schedulePointersFlush(Id chatid)
+{
+    mChatsWithPendingPointers.insert(chatid);
+    if (mPointersFlushTimer)
+    {
+        return; // the chat will be flushed together with the others
+    }
+
+    auto wptr = weakHandle();
+    mPointersFlushTimer = karere::setTimeout([this, wptr]()
+    {
+        if (wptr.deleted())
+            return;
+
+        mPointersFlushTimer = 0;
+        flushPendingPointers();
+    }, kSeenTimeout, mKarereClient->appCtx);
+}
+
+void Client::flushPendingPointers(bool sendSeen)
+{
+    if (mPointersFlushTimer)
+    {
+        cancelTimeout(mPointersFlushTimer, mKarereClient->appCtx);
+        mPointersFlushTimer = 0;
+    }
+
+    std::set<karere::Id> chatids;
+    chatids.swap(mChatsWithPendingPointers);
+    for (auto& chatid: chatids)
+    {
+        auto it = mChatForChatId.find(chatid);
+        if (it != mChatForChatId.end())
+        {
+            it->second->flushPendingPointers(sendSeen);
+        }
+    }
 }
 
 bool Client::isMessageReceivedConfirmationActive() const
@@ -488,7 +678,6 @@ void Connection::onSocketClose(int errcode, int errtype, const std::string& reas
 
     assert(oldState != kStateDisconnected);
 
-    usingipv6 = !usingipv6;
     mTargetIp.clear();
 
     if (oldState == kStateConnected)
@@ -633,6 +822,10 @@ void Connection::setState(State state)
             }, kConnectTimeout * 1000, mChatdClient.mKarereClient->appCtx);
         }
 
+        // pending joins will be scheduled again upon reconnection
+        mJoinQueue.clear();
+        mJoinsInFlight.clear();
+
         // notify chatrooms that connection is down
         for (auto& chatid: mChatIds)
         {
@@ -661,6 +854,7 @@ void Connection::setState(State state)
     }
     else if (mState == kStateConnected)
     {
+        mTargetIp = wsConnectedIp();    // the winner, if both IP families were raced
         CHATDS_LOG_DEBUG("Chatd connected to %s", mTargetIp.c_str());
 
         mDnsCache.connectDone(mShardNo, mTargetIp);
@@ -908,49 +1102,29 @@ void Connection::doConnect()
     string ipv4, ipv6;
     bool cachedIPs = mDnsCache.getIp(mShardNo, ipv4, ipv6);
     assert(cachedIPs);
-    mTargetIp = (usingipv6 && ipv6.size()) ? ipv6 : ipv4;
+
+    // start with the family that connected last time, and race it against the other one
+    bool preferIpv6 = ipv6.size() && (ipv4.empty() || mDnsCache.isIpv6Preferred(mShardNo));
+    mTargetIp = preferIpv6 ? ipv6 : ipv4;
+    const string &fallbackIp = preferIpv6 ? ipv4 : ipv6;
 
     const karere::Url &url = mDnsCache.getUrl(mShardNo);
     assert (url.isValid());
 
     setState(kStateConnecting);
-    CHATDS_LOG_DEBUG("Connecting to chatd using the IP: %s", mTargetIp.c_str());
+    CHATDS_LOG_DEBUG("Connecting to chatd using the IP: %s (fallback IP: %s)", mTargetIp.c_str(), fallbackIp.c_str());
 
     bool rt = wsConnect(mChatdClient.mKarereClient->websocketIO, mTargetIp.c_str(),
+              fallbackIp.c_str(),
               url.host.c_str(),
               url.port,
               url.path.c_str(),
               url.isSecure);
 
-    if (!rt)    // immediate failure --> try the other IP family (if available)
+    if (!rt)
     {
-        CHATDS_LOG_DEBUG("Connection to chatd failed using the IP: %s", mTargetIp.c_str());
-
-        string oldTargetIp = mTargetIp;
-        mTargetIp.clear();
-        if (oldTargetIp == ipv6 && ipv4.size())
-        {
-            mTargetIp = ipv4;
-        }
-        else if (oldTargetIp == ipv4 && ipv6.size())
-        {
-            mTargetIp = ipv6;
-        }
-
-        if (mTargetIp.size())
-        {
-            CHATDS_LOG_DEBUG("Retrying using the IP: %s", mTargetIp.c_str());
-            if (wsConnect(mChatdClient.mKarereClient->websocketIO, mTargetIp.c_str(),
-                                      url.host.c_str(),
-                                      url.port,
-                                      url.path.c_str(),
-                                      url.isSecure))
-            {
-                return;
-            }
-            CHATDS_LOG_DEBUG("Connection to chatd failed using the IP: %s", mTargetIp.c_str());
-        }
-        else
+        CHATDS_LOG_DEBUG("Connection to chatd failed using the IPs: %s %s", ipv4.c_str(), ipv6.c_str());
+        if (ipv4.empty() || ipv6.empty())
         {
             // do not close the socket, which forces a new retry attempt and turns the DNS response obsolete
             // Instead, let the DNS request to complete, in order to refresh IPs
@@ -1052,6 +1226,22 @@ int Connection::shardNo() const
     return mShardNo;
 }
 
+void Connection::addMetrics(karere::Metrics& metrics) const
+{
+    karere::Metrics::Labels labels = { {"shard", std::to_string(mShardNo)} };
+    mTraffic.addMetrics(metrics, "chatd", labels, wsStats(), &Command::opcodeToStr);
+
+    uint64_t historyMsgs = mHistoryMsgs.get();
+    uint64_t historyFetchUs = mHistoryFetchUs.get();
+    metrics.add("chatd_history_messages_total", karere::Metrics::kCounter,
+                "Messages received while fetching history from server", labels, historyMsgs);
+    metrics.add("chatd_history_fetch_microseconds_total", karere::Metrics::kCounter,
+                "Time spent by the chats fetching history from server", labels, historyFetchUs);
+    metrics.add("chatd_history_messages_per_second", karere::Metrics::kGauge,
+                "Messages received per second of history fetch from server", labels,
+                historyFetchUs ? (historyMsgs * 1000000 / historyFetchUs) : 0);
+}
+
 promise::Promise<void> Connection::connect()
 {
     return fetchUrl()
@@ -1104,6 +1294,9 @@ promise::Promise<void> Connection::fetchUrl()
 
 void Client::disconnect()
 {
+    // persist pending pointers while connections and DB are still available
+    flushPendingPointers(false);
+
     for (auto& conn: mConnections)
     {
         conn.second->disconnect();
@@ -1145,6 +1338,7 @@ bool Connection::sendBuf(Buffer&& buf)
         });
     }
 
+    mTraffic.frameOut(buf.buf(), buf.dataSize());  // the content is not usable after sending it
     bool rc = wsSendMessage(buf.buf(), buf.dataSize());
     buf.free();
 
@@ -1446,13 +1640,38 @@ string KeyCommand::toString() const
 // rejoin all open chats after reconnection (this is mandatory)
 bool Connection::rejoinExistingChats()
 {
+    // Instead of sending all the JOINs at once, and getting the history of every chat in
+    // arbitrary order, chats are joined in order of priority with a limited number of
+    // joins in flight: the chats opened by the app first, then the ones with messages
+    // pending to be sent and finally the rest, most recently active first.
+    struct JoinPriority
+    {
+        karere::Id chatid;
+        int group;
+        uint32_t lastMsgTs;
+    };
+    std::vector<JoinPriority> chats;
+    chats.reserve(mChatIds.size());
     for (auto& chatid: mChatIds)
     {
         try
         {
             Chat& chat = mChatdClient.chats(chatid);
-            if (!chat.isDisabled())
-                chat.login();
+            if (chat.isDisabled())
+            {
+                continue;
+            }
+
+            int group = 2;
+            if (mChatdClient.mKarereClient->isChatRoomOpened(chatid))
+            {
+                group = 0;
+            }
+            else if (!chat.mSending.empty())
+            {
+                group = 1;
+            }
+            chats.push_back({chatid, group, chat.lastMessageTs()});
         }
         catch(std::exception& e)
         {
@@ -1460,9 +1679,96 @@ bool Connection::rejoinExistingChats()
             return false;
         }
     }
+
+    std::stable_sort(chats.begin(), chats.end(), [](const JoinPriority& a, const JoinPriority& b)
+    {
+        return (a.group != b.group) ? (a.group < b.group) : (a.lastMsgTs > b.lastMsgTs);
+    });
+
+    mJoinQueue.clear();
+    mJoinsInFlight.clear();
+    for (auto& item: chats)
+    {
+        mJoinQueue.push_back(item.chatid);
+    }
+
+    joinNextChats();
     return true;
 }
 
+void Connection::joinNextChats()
+{
+    if (!isOnline())
+    {
+        return;
+    }
+
+    unsigned maxJoins = mChatdClient.maxOutstandingJoins();
+    while (!mJoinQueue.empty() && (!maxJoins || mJoinsInFlight.size() < maxJoins))
+    {
+        karere::Id chatid = mJoinQueue.front();
+        mJoinQueue.pop_front();
+
+        auto it = mChatdClient.mChatForChatId.find(chatid);
+        if (it == mChatdClient.mChatForChatId.end())
+        {
+            continue;   // the chat was removed in the meantime
+        }
+
+        // the chat may have been joined already by other means (ie. the app opened it)
+        Chat& chat = *it->second;
+        if (chat.isDisabled() || chat.onlineState() != kChatStateConnecting)
+        {
+            continue;
+        }
+
+        mJoinsInFlight.insert(chatid);
+        bool failed = false;
+        try
+        {
+            chat.login();
+        }
+        catch (std::exception& e)
+        {
+            CHATDS_LOG_ERROR("joinNextChats: failed to join chat %s: %s", ID_CSTR(chatid), e.what());
+            failed = true;
+        }
+
+        // the slot is released when the chat leaves the joining state (see Chat::setOnlineState),
+        // which may never happen if login() failed
+        if (failed || chat.onlineState() != kChatStateJoining)
+        {
+            mJoinsInFlight.erase(chatid);
+        }
+    }
+
+    if (mJoinQueue.empty() && mJoinsInFlight.empty())
+    {
+        CHATDS_LOG_DEBUG("All chats have been joined");
+    }
+}
+
+void Connection::onJoinFinished(karere::Id chatid)
+{
+    if (mJoinsInFlight.erase(chatid))
+    {
+        joinNextChats();
+    }
+}
+
+void Connection::prioritizeJoin(karere::Id chatid)
+{
+    auto it = std::find(mJoinQueue.begin(), mJoinQueue.end(), chatid);
+    if (it == mJoinQueue.end() || it == mJoinQueue.begin())
+    {
+        return;
+    }
+
+    CHATDS_LOG_DEBUG("Chat %s opened by the app, joining it next", ID_CSTR(chatid));
+    mJoinQueue.erase(it);
+    mJoinQueue.push_front(chatid);
+}
+
 // send JOIN
 void Chat::join()
 {
@@ -1554,6 +1860,10 @@ void Chat::onDisconnect()
 
 HistSource Chat::getHistory(unsigned count)
 {
+    if (mChatdClient.mKarereClient->isChatRoomOpened(mChatId))
+    {
+        mLastHistoryAccessTs = time(NULL);
+    }
     if (isNotifyingOldHistFromServer())
     {
         return kHistSourceServer;
@@ -1598,6 +1908,10 @@ HistSource Chat::getHistory(unsigned count)
             mNextHistFetchIdx -= countSoFar;
             if (countSoFar >= (int)count)
             {
+                if (mNextHistFetchIdx == end)
+                {
+                    prefetchHistoryFromDb(count); // next request will reach the db
+                }
                 CALL_LISTENER(onHistoryDone, kHistSourceRam);
                 return kHistSourceRam;
             }
@@ -1678,6 +1992,7 @@ void Chat::requestHistoryFromServer(int32_t count)
     mServerFetchState = (count > 0)
         ? kHistFetchingNewFromServer
         : kHistFetchingOldFromServer;
+    mHistFetchStartTs = karere::LoopProfiler::now();
 
     mFetchRequest.push(FetchType::kFetchMessages);
     sendCommand(Command(OP_HIST) + mChatId + count);
@@ -1809,6 +2124,12 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
 }
 Chat::~Chat()
 {
+    if (mPointersDirty && mDbInterface)
+    {
+        // the chat is destroyed (or removed) before the client flushed its pointers
+        CALL_DB(setLastSeenAndReceived, mLastSeenId, mLastReceivedId);
+    }
+
     CALL_LISTENER(onDestroy); //we don't delete because it may have its own idea of its lifetime (i.e. it could be a GUI class)
     try { delete mCrypto; }
     catch(std::exception& e)
@@ -1839,17 +2160,23 @@ Idx Chat::getHistoryFromDb(unsigned count)
 {
     assert(mHasMoreHistoryInDb); //we are within the db range
     std::vector<Message*> messages;
-    CALL_DB(fetchDbHistory, lownum()-1, count, messages);
-    for (auto msg: messages)
+    Idx maxIdx = lownum() - 1;
+    if (mDbInterface->takePrefetchedDbHistory(maxIdx, count, messages))
     {
-        // Load msg reactions from cache
-        ::mega::multimap<std::string, karere::Id> reactions;
-        CALL_DB(getMessageReactions, msg->id(), reactions);
-        for (auto &it : reactions)
+        CHATID_LOG_DEBUG("Got %zu messages of history from the prefetched page", messages.size());
+    }
+    else
+    {
+        CALL_DB(fetchDbHistory, maxIdx, count, messages);
+        if (!messages.empty())
         {
-            msg->addReaction(it.first, it.second);
+            // Load msg reactions from cache, for the whole page at once
+            CALL_DB(getReactionsForRange, maxIdx - static_cast<Idx>(messages.size()) + 1, maxIdx, messages);
         }
+    }
 
+    for (auto msg: messages)
+    {
         msgIncoming(false, msg, true); //increments mLastHistFetch/DecryptCount, may reset mHasMoreHistoryInDb if this msgid == mLastKnownMsgid
     }
     if (mNextHistFetchIdx == CHATD_IDX_INVALID)
@@ -1867,9 +2194,23 @@ Idx Chat::getHistoryFromDb(unsigned count)
     // more unseen messages
     if ((messages.size() < count) && mHasMoreHistoryInDb)
         throw std::runtime_error(mChatId.toString()+": Db says it has no more messages, but we still haven't seen mOldestKnownMsgId of "+std::to_string((int64_t)mOldestKnownMsgId.val));
+
+    prefetchHistoryFromDb(count);
     return (Idx)messages.size();
 }
 
+void Chat::prefetchHistoryFromDb(unsigned count)
+{
+    // history is loaded backwards, so if the app keeps scrolling up in this chat
+    // the next page will be the one right before the oldest message in RAM
+    if (!mHasMoreHistoryInDb || !mChatdClient.mKarereClient->isChatRoomOpened(mChatId))
+    {
+        return;
+    }
+
+    CALL_DB(prefetchDbHistory, lownum() - 1, count);
+}
+
 #define READ_ID(varname, offset)\
     assert(offset==pos-base); Id varname(buf.read<uint64_t>(pos)); pos+=sizeof(uint64_t)
 #define READ_CHATID(offset)\
@@ -1885,6 +2226,7 @@ Idx Chat::getHistoryFromDb(unsigned count)
 void Connection::wsHandleMsgCb(char *data, size_t len)
 {
     mTsLastRecv = time(NULL);
+    mTraffic.frameIn();
     execCommand(StaticBuffer(data, len));
 }
 
@@ -1906,6 +2248,8 @@ void Connection::execCommand(const StaticBuffer& buf)
     while (pos < buf.dataSize())
     {
       char opcode = buf.buf()[pos];
+      karere::LoopProfiler::Scope profile("chatd", Command::opcodeToStr(opcode));
+      mTraffic.commandsIn[static_cast<uint8_t>(opcode)].add();
       Id chatid;
       try
       {
@@ -1980,6 +2324,11 @@ void Connection::execCommand(const StaticBuffer& buf)
                 }
                 else
                 {
+                    if (chat.isFetchingFromServer())
+                    {
+                        mHistoryMsgs.add();
+                    }
+
                     if (!chat.isFetchingNodeHistory() || opcode == OP_NEWMSG)
                     {
                         chat.msgIncoming((opcode == OP_NEWMSG), msg.release(), false);
@@ -2325,6 +2674,7 @@ void Connection::execCommand(const StaticBuffer& buf)
             default:
             {
                 CHATDS_LOG_ERROR("Unknown opcode %d, ignoring all subsequent commands", opcode);
+                mTraffic.parseErrors.add();
                 return;
             }
         }
@@ -2332,6 +2682,7 @@ void Connection::execCommand(const StaticBuffer& buf)
       catch(BufferRangeError& e)
       {
             CHATDS_LOG_ERROR("%s: Buffer bound check error while parsing %s:\n\t%s\n\tAborting command processing", ID_CSTR(chatid), Command::opcodeToStr(opcode), e.what());
+            mTraffic.parseErrors.add();
             return;
       }
       catch(std::exception& e)
@@ -2402,6 +2753,11 @@ void Chat::onHistDone()
 void Chat::onFetchHistDone()
 {
     assert(isFetchingFromServer());
+    if (mHistFetchStartTs)
+    {
+        mConnection.mHistoryFetchUs.add(karere::LoopProfiler::now() - mHistFetchStartTs);
+        mHistFetchStartTs = 0;
+    }
 
     //resetHistFetch() may have been called while fetching from server,
     //so state may be fetching-from-ram or fetching-from-db
@@ -3130,10 +3486,12 @@ bool Chat::msgEncryptAndSend(OutputQueue::iterator it)
          msg->id(), msg->ts, msg->updated);
 
     CHATD_LOG_CRYPTO_CALL("Calling ICrypto::encrypt()");
+    int64_t encryptStartTs = karere::LoopProfiler::now();
     auto pms = mCrypto->msgEncrypt(msg, it->recipients, msgCmd);
     // if using current keyid or original keyid from msg, promise is resolved immediately
     if (pms.succeeded())
     {
+        mChatdClient.mEncryptStats[msg->type].add(karere::LoopProfiler::now() - encryptStartTs);
         MsgCommand *msgCmd = pms.value().first;
         KeyCommand *keyCmd = pms.value().second;
         assert(!keyCmd                                              // no newkey required...
@@ -3152,10 +3510,11 @@ bool Chat::msgEncryptAndSend(OutputQueue::iterator it)
     mEncryptionHalted = true;
     CHATID_LOG_DEBUG("Can't encrypt message immediately, halting output");
 
-    pms.then([this, msg, rowid](std::pair<MsgCommand*, KeyCommand*> result)
+    pms.then([this, msg, rowid, encryptStartTs](std::pair<MsgCommand*, KeyCommand*> result)
     {
         assert(mEncryptionHalted);
         assert(!mSending.empty());
+        mChatdClient.mEncryptStats[msg->type].add(karere::LoopProfiler::now() - encryptStartTs);
 
         MsgCommand *msgCmd = result.first;
         KeyCommand *keyCmd = result.second;
@@ -3308,7 +3667,7 @@ Message* Chat::msgModify(Message& msg, const char* newdata, size_t newlen, void*
 void Chat::onLastReceived(Id msgid)
 {
     mLastReceivedId = msgid;
-    CALL_DB(setLastReceived, msgid);
+    persistPointers();
     auto it = mIdToIndexMap.find(msgid);
     if (it == mIdToIndexMap.end())
     { // we don't have that message in the buffer yet, so we don't know its index
@@ -3421,7 +3780,7 @@ void Chat::onLastSeen(Id msgid)
         {
             CHATID_LOG_DEBUG("onLastSeen: Setting last seen msgid to %s", ID_CSTR(msgid));
             mLastSeenId = msgid;
-            CALL_DB(setLastSeen, msgid);
+            persistPointers();
 
             return;
         }
@@ -3444,7 +3803,7 @@ void Chat::onLastSeen(Id msgid)
 
     CHATID_LOG_DEBUG("setMessageSeen: Setting last seen msgid to %s", ID_CSTR(msgid));
     mLastSeenId = msgid;
-    CALL_DB(setLastSeen, msgid);
+    persistPointers();
 
     if (idx != CHATD_IDX_INVALID)   // if msgid is known locally, notify the unread count
     {
@@ -3485,18 +3844,35 @@ bool Chat::setMessageSeen(Idx idx)
         return false;
     }
 
-    auto wptr = weakHandle();
-    karere::Id id = msg.id();
-    megaHandle seenTimer = karere::setTimeout([this, wptr, idx, id, seenTimer]()
+    // only the newest message is sent as SEEN, when the client flushes the pointers of all chats
+    if ((mPendingSeenIdx == CHATD_IDX_INVALID) || (idx > mPendingSeenIdx))
     {
-        if (wptr.deleted())
-          return;
+        mPendingSeenIdx = idx;
+        mPendingSeenId = msg.id();
+        mChatdClient.schedulePointersFlush(mChatId);
+    }
 
-        mChatdClient.mSeenTimers.erase(seenTimer);
+    return true;
+}
 
-        if ((mLastSeenIdx != CHATD_IDX_INVALID) && (idx <= mLastSeenIdx))
-            return;
+void Chat::persistPointers()
+{
+    mPointersDirty = true;
+    mChatdClient.schedulePointersFlush(mChatId);
+}
+
+void Chat::flushPendingPointers(bool sendSeen)
+{
+    Id id = mPendingSeenId;
+    mPendingSeenId = Id::inval();
+    mPendingSeenIdx = CHATD_IDX_INVALID;
 
+    // the message may have been removed meanwhile (truncate, clear history...)
+    auto it = id.isValid() ? mIdToIndexMap.find(id) : mIdToIndexMap.end();
+    if (sendSeen && (it != mIdToIndexMap.end())
+            && ((mLastSeenIdx == CHATD_IDX_INVALID) || (it->second > mLastSeenIdx)))
+    {
+        Idx idx = it->second;
         CHATID_LOG_DEBUG("setMessageSeen: Setting last seen msgid to %s", ID_CSTR(id));
         sendCommand(Command(OP_SEEN) + mChatId + id);
 
@@ -3523,13 +3899,21 @@ bool Chat::setMessageSeen(Idx idx)
             }
         }
         mLastSeenId = id;
-        CALL_DB(setLastSeen, mLastSeenId);
+        mPointersDirty = true;
         CALL_LISTENER(onUnreadChanged);
-    }, kSeenTimeout, mChatdClient.mKarereClient->appCtx);
+    }
 
-    mChatdClient.mSeenTimers.insert(seenTimer);
+    if (mPendingReceivedId.isValid())
+    {
+        sendCommand(Command(OP_RECEIVED) + mChatId + mPendingReceivedId);
+        mPendingReceivedId = Id::inval();
+    }
 
-    return true;
+    if (mPointersDirty)
+    {
+        mPointersDirty = false;
+        CALL_DB(setLastSeenAndReceived, mLastSeenId, mLastReceivedId);
+    }
 }
 
 bool Chat::setMessageSeen(Id msgid)
@@ -3629,6 +4013,7 @@ void Chat::joinRangeHist(const ChatDbInfo& dbInfo)
 {
     assert(dbInfo.oldestDbId && dbInfo.newestDbId);
     mServerFetchState = kHistFetchingNewFromServer;
+    mHistFetchStartTs = karere::LoopProfiler::now();
 
     mFetchRequest.push(FetchType::kFetchMessages);
     sendCommand(Command(OP_JOINRANGEHIST) + mChatId + dbInfo.oldestDbId + at(highnum()).id());
@@ -3640,6 +4025,7 @@ void Chat::handlejoinRangeHist(const ChatDbInfo& dbInfo)
     assert(previewMode());
     assert(dbInfo.oldestDbId && dbInfo.newestDbId);
     mServerFetchState = kHistFetchingNewFromServer;
+    mHistFetchStartTs = karere::LoopProfiler::now();
 
     uint64_t ph = getPublicHandle();
     Command comm (OP_HANDLEJOINRANGEHIST);
@@ -3650,7 +4036,12 @@ void Chat::handlejoinRangeHist(const ChatDbInfo& dbInfo)
 
 Client::~Client()
 {
-    cancelSeenTimers();
+    // usually already flushed by disconnect()
+    flushPendingPointers(false);
+    if (mHistoryEvictionTimer)
+    {
+        cancelTimeout(mHistoryEvictionTimer, mKarereClient->appCtx);
+    }
     mKarereClient->userAttrCache().removeCb(mRichPrevAttrCbHandle);
 }
 
@@ -4291,6 +4682,138 @@ void Chat::deleteMessagesBefore(Idx idx)
     }
 }
 
+void Chat::addMemoryUsage(karere::MemoryReport& report) const
+{
+    size_t bytes = (mForwardList.capacity() + mBackwardList.capacity()) * sizeof(std::unique_ptr<Message>);
+    for (auto& msg: mForwardList)
+    {
+        bytes += msg->memoryUsage();
+    }
+    for (auto& msg: mBackwardList)
+    {
+        bytes += msg->memoryUsage();
+    }
+    report.add("chatd.history", bytes, size());
+    report.addNodes("chatd.idIndex", mIdToIndexMap);
+    report.addNodes("chatd.backrefIndex", mRefidToIdxMap);
+
+    bytes = 0;
+    for (auto& item: mSending)
+    {
+        bytes += sizeof(item) + karere::MemoryReport::kNodeOverhead
+                + item.recipients.items().capacity() * sizeof(karere::Id);
+        if (item.msg)
+        {
+            bytes += item.msg->memoryUsage();
+        }
+        if (item.msgCmd)
+        {
+            bytes += sizeof(MsgCommand) + item.msgCmd->bufSize();
+        }
+        if (item.keyCmd)
+        {
+            bytes += sizeof(KeyCommand) + item.keyCmd->bufSize();
+        }
+    }
+    report.add("chatd.sending", bytes, mSending.size());
+
+    bytes = (mPendingReactions.capacity() * sizeof(PendingReaction))
+            + (mPendingEncryptedReactions.capacity() * sizeof(EncryptedReaction));
+    for (auto& reaction: mPendingEncryptedReactions)
+    {
+        bytes += reaction.data.capacity();
+    }
+    report.add("chatd.pendingReactions", bytes, mPendingReactions.size());
+
+    mAttachmentNodes->addMemoryUsage(report);
+    if (mCrypto)
+    {
+        mCrypto->addMemoryUsage(report);
+    }
+}
+
+Idx Chat::evictHistory(Idx keep)
+{
+    // keep at least what is loaded at startup, so the app gets some history right away
+    if (keep < (Idx)initialHistoryFetchCount)
+    {
+        keep = initialHistoryFetchCount;
+    }
+
+    if (size() <= keep
+            || !mOldestKnownMsgId
+            || mLastTextMsg.isFetching()
+            || isFetchingFromServer()
+            || mDecryptOldHaltedAt != CHATD_IDX_INVALID
+            || mDecryptNewHaltedAt != CHATD_IDX_INVALID
+            || !mPendingReactions.empty()
+            || mReactionBatchesInFlight
+            || mChatdClient.mKarereClient->isChatRoomOpened(mChatId))
+    {
+        return 0;
+    }
+
+    // messages referred by pending operations are looked up in RAM, so they can't be evicted
+    Idx newLownum = highnum() - keep + 1;
+    auto keepFrom = [&newLownum](Idx idx)
+    {
+        if (idx != CHATD_IDX_INVALID && idx < newLownum)
+        {
+            newLownum = idx;
+        }
+    };
+    keepFrom(mPendingSeenIdx);
+    for (auto& item: mSending)
+    {
+        keepFrom(msgIndexFromId(item.msg->id()));
+    }
+    for (auto& it: mPendingEdits)
+    {
+        keepFrom(msgIndexFromId(it.first));
+    }
+    for (auto& msgid: mMsgsToUpdateWithRichLink)
+    {
+        keepFrom(msgIndexFromId(msgid));
+    }
+
+    Idx low = lownum();
+    for (Idx i = low; i < newLownum; i++)
+    {
+        const Message& msg = at(i);
+        if (msg.isPendingToDecrypt())   // not saved in db yet
+        {
+            newLownum = i;
+            break;
+        }
+    }
+    if (newLownum <= low)
+    {
+        return 0;
+    }
+
+    for (Idx i = low; i < newLownum; i++)
+    {
+        const Message& msg = at(i);
+        mIdToIndexMap.erase(msg.id());
+        if (msg.backRefId)
+        {
+            // added again when the message is reloaded from db
+            auto it = mRefidToIdxMap.find(msg.backRefId);
+            if (it != mRefidToIdxMap.end() && it->second == i)
+            {
+                mRefidToIdxMap.erase(it);
+            }
+        }
+    }
+    deleteMessagesBefore(newLownum);
+    mHasMoreHistoryInDb = true;
+    // the app resets it anyway when opening the chat again
+    resetGetHistory();
+
+    CHATID_LOG_DEBUG("Evicted %d messages from RAM, resident range is now %d - %d", newLownum - low, lownum(), highnum());
+    return newLownum - low;
+}
+
 Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
 {
     assert(idx != CHATD_IDX_INVALID);
@@ -4387,6 +4910,7 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
     mIdToIndexMap[msgid] = idx;
     handleLastReceivedSeen(msgid);
     msgIncomingAfterAdd(isNew, isLocal, *message, idx);
+    mChatdClient.scheduleHistoryEviction();
     return idx;
 }
 
@@ -4479,10 +5003,12 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         }
     }
     CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt()");
+    int64_t decryptStartTs = karere::LoopProfiler::now();
     auto pms = mCrypto->msgDecrypt(&msg);
     if (pms.succeeded())
     {
         assert(!msg.isEncrypted());
+        mChatdClient.mDecryptStats[msg.type].add(karere::LoopProfiler::now() - decryptStartTs);
         msgIncomingAfterDecrypt(isNew, false, msg, idx);
         return true;
     }
@@ -4534,7 +5060,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
 
         return message;
     })
-    .then([this, isNew, isLocal, idx](Message* message)
+    .then([this, isNew, isLocal, idx, decryptStartTs](Message* message)
     {
 #ifndef NDEBUG
         if (isNew)
@@ -4542,6 +5068,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         else
             assert(mDecryptOldHaltedAt == idx);
 #endif
+        mChatdClient.mDecryptStats[message->type].add(karere::LoopProfiler::now() - decryptStartTs);
         msgIncomingAfterDecrypt(isNew, false, *message, idx);
         if (isNew)
         {
@@ -4648,7 +5175,9 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
             mLastIdReceivedFromServer = msgid;
             // TODO: the update of those variables should be persisted
 
-            sendCommand(Command(OP_RECEIVED) + mChatId + msgid);
+            // sent with the next flush of pointers, only for the newest message
+            mPendingReceivedId = msgid;
+            mChatdClient.schedulePointersFlush(mChatId);
         }
     }
     if (msg.backRefId && !mRefidToIdxMap.emplace(msg.backRefId, idx).second)
@@ -4895,23 +5424,7 @@ void Chat::onAddReaction(Id msgId, Id userId, std::string reaction)
         return;
     }
 
-    auto wptr = weakHandle();
-    mCrypto->reactionDecrypt(message, reaction)
-    .then([this, wptr, &message, userId](std::shared_ptr<Buffer> data)   // data is the UTF-8 string (the emoji)
-    {
-        if (wptr.deleted())
-            return;
-
-        const std::string reaction(data->buf(), data->size());
-        message.addReaction(reaction, userId);
-        CALL_DB(addReaction, message.mId, userId, reaction.c_str());
-
-        CALL_LISTENER(onReactionUpdate, message.mId, reaction.c_str(), message.getReactionCount(reaction));
-    })
-    .fail([this, msgId](const ::promise::Error& err)
-    {
-        CHATID_LOG_ERROR("onAddReaction: failed to decrypt reaction. msgid: %s, error: %s", ID_CSTR(msgId), err.what());
-    });
+    queueReaction(message, userId, std::move(reaction), true);
 }
 
 void Chat::onDelReaction(Id msgId, Id userId, std::string reaction)
@@ -4936,26 +5449,88 @@ void Chat::onDelReaction(Id msgId, Id userId, std::string reaction)
         return;
     }
 
+    queueReaction(message, userId, std::move(reaction), false);
+}
+
+void Chat::queueReaction(Message& message, Id userId, std::string&& reaction, bool isAdd)
+{
+    mPendingReactions.push_back({message.id(), userId, isAdd});
+    mPendingEncryptedReactions.emplace_back(message, std::move(reaction));
+    if (mPendingReactions.size() > 1)
+    {
+        return; // the decryption of the batch is already scheduled
+    }
+
+    // wait for the rest of reactions received in the same burst
     auto wptr = weakHandle();
-    mCrypto->reactionDecrypt(message, reaction)
-    .then([this, wptr, &message, userId](std::shared_ptr<Buffer> data)
+    marshallCall([wptr, this]()
     {
         if (wptr.deleted())
             return;
 
-        const std::string reaction(data->buf(), data->bufSize());
-        message.delReaction(reaction, userId);
+        decryptPendingReactions();
+    }, mChatdClient.mKarereClient->appCtx);
+}
+
+void Chat::decryptPendingReactions()
+{
+    auto reactions = std::make_shared<std::vector<PendingReaction>>();
+    reactions->swap(mPendingReactions);
+    std::vector<EncryptedReaction> encrypted;
+    encrypted.swap(mPendingEncryptedReactions);
+
+    mReactionBatchesInFlight++;
+    auto wptr = weakHandle();
+    mCrypto->reactionDecrypt(encrypted)
+    .then([this, wptr, reactions](const std::vector<std::shared_ptr<Buffer>>& decrypted)
+    {
+        if (wptr.deleted())
+            return;
 
-        if (!previewMode())
+        mReactionBatchesInFlight--;
+        // apply them in the same order they were received
+        for (size_t i = 0; i < reactions->size(); i++)
         {
-            CALL_DB(delReaction, message.mId, userId, reaction.c_str());
-        }
+            const PendingReaction& pending = (*reactions)[i];
+            if (!decrypted[i])
+            {
+                CHATID_LOG_ERROR("%s: failed to decrypt reaction. msgid: %s", pending.isAdd ? "onAddReaction" : "onDelReaction", ID_CSTR(pending.msgId));
+                continue;
+            }
+
+            // the message may have been removed while decrypting
+            Idx messageIdx = msgIndexFromId(pending.msgId);
+            if (messageIdx == CHATD_IDX_INVALID)
+            {
+                continue;
+            }
+
+            Message &message = at(messageIdx);
+            const std::string reaction(decrypted[i]->buf(), decrypted[i]->size());   // the UTF-8 string (the emoji)
+            if (pending.isAdd)
+            {
+                message.addReaction(reaction, pending.userId);
+                CALL_DB(addReaction, message.mId, pending.userId, reaction.c_str());
+            }
+            else
+            {
+                message.delReaction(reaction, pending.userId);
+                if (!previewMode())
+                {
+                    CALL_DB(delReaction, message.mId, pending.userId, reaction.c_str());
+                }
+            }
 
-        CALL_LISTENER(onReactionUpdate, message.mId, reaction.c_str(), message.getReactionCount(reaction));
+            CALL_LISTENER(onReactionUpdate, message.mId, reaction.c_str(), message.getReactionCount(reaction));
+        }
     })
-    .fail([this, msgId](const ::promise::Error& err)
+    .fail([this, wptr](const ::promise::Error& err)
     {
-        CHATID_LOG_ERROR("onDelReaction: failed to decryp reaction. msgid: %s, error: %s", ID_CSTR(msgId), err.what());
+        if (wptr.deleted())
+            return;
+
+        mReactionBatchesInFlight--;
+        CHATID_LOG_ERROR("Failed to decrypt reactions: %s", err.what());
     });
 }
 
@@ -5014,6 +5589,7 @@ void Chat::setOnlineState(ChatState state)
 
     CHATID_LOG_DEBUG("Online state change: %s --> %s", chatStateToStr(mOnlineState), chatStateToStr(state));
 
+    ChatState oldState = mOnlineState;
     mOnlineState = state;
     CALL_CRYPTO(onOnlineStateChange, state);
     mListener->onOnlineStateChange(state);  // avoid log message, we already have the one above
@@ -5044,6 +5620,12 @@ void Chat::setOnlineState(ChatState state)
             }
         }
     }
+
+    if (oldState == kChatStateJoining)
+    {
+        // joined, rejected or disconnected: let the connection proceed with the next chat waiting to be joined
+        mConnection.onJoinFinished(mChatId);
+    }
 }
 
 void Chat::onLastTextMsgUpdated(const Message& msg, Idx idx)
@@ -5222,7 +5804,8 @@ void Client::leave(Id chatid)
         CHATD_LOG_ERROR("Client::leave: Unknown chat %s", ID_CSTR(chatid));
         return;
     }
-    conn->second->mChatIds.erase(chatid);
+    Connection *connection = conn->second;
+    connection->mChatIds.erase(chatid);
     mConnectionForChatId.erase(conn);
     auto it = mChatForChatId.find(chatid);
     if (it != mChatForChatId.end())
@@ -5233,6 +5816,9 @@ void Client::leave(Id chatid)
         }
         mChatForChatId.erase(it);
     }
+
+    // the chat may have been removed while joining: release its slot
+    connection->onJoinFinished(chatid);
 }
 
 IRtcHandler* Client::setRtcHandler(IRtcHandler *handler)
@@ -5453,37 +6039,109 @@ bool Message::isValidEmail(const string &buf)
     return regex_match(buf, regularExpresion);
 }
 
-FilteredHistory::FilteredHistory(DbInterface &db, Chat &chat)
+void NodeHistoryBuffer::reset(Idx newestIdx)
+{
+    mMsgs.clear();
+    mIdxById.clear();
+    mNewestIdx = newestIdx;
+}
+
+Idx NodeHistoryBuffer::find(Id msgid) const
+{
+    auto it = mIdxById.find(msgid);
+    return (it != mIdxById.end()) ? it->second : CHATD_IDX_INVALID;
+}
+
+Message *NodeHistoryBuffer::get(Id msgid) const
+{
+    Idx idx = find(msgid);
+    return (idx != CHATD_IDX_INVALID) ? at(idx) : NULL;
+}
+
+Idx NodeHistoryBuffer::pushNewest(Message *msg)
+{
+    assert(find(msg->id()) == CHATD_IDX_INVALID);
+    mMsgs.emplace_front(msg);
+    mIdxById[msg->id()] = ++mNewestIdx;
+    return mNewestIdx;
+}
+
+Idx NodeHistoryBuffer::pushOldest(Message *msg)
+{
+    assert(find(msg->id()) == CHATD_IDX_INVALID);
+    mMsgs.emplace_back(msg);
+    Idx idx = oldestIdx();
+    mIdxById[msg->id()] = idx;
+    return idx;
+}
+
+void NodeHistoryBuffer::truncateBefore(Idx idx)
+{
+    if (idx <= oldestIdx())
+    {
+        return;
+    }
+
+    if (idx > mNewestIdx)
+    {
+        reset(mNewestIdx);
+        return;
+    }
+
+    size_t keep = static_cast<size_t>(mNewestIdx - idx + 1);
+    for (size_t i = keep; i < mMsgs.size(); i++)
+    {
+        mIdxById.erase(mMsgs[i]->id());
+    }
+    mMsgs.erase(mMsgs.begin() + keep, mMsgs.end());
+}
+
+void NodeHistoryBuffer::addMemoryUsage(karere::MemoryReport& report) const
+{
+    size_t bytes = 0;
+    for (auto& msg: mMsgs)
+    {
+        bytes += sizeof(msg) + msg->memoryUsage();
+    }
+    report.add("chatd.nodeHistory", bytes, mMsgs.size());
+    report.addNodes("chatd.nodeHistoryIndex", mIdxById);
+}
+
+FilteredHistory::FilteredHistory(DbInterface &db, NodeHistoryFetcher &chat)
     : mDb(&db), mChat(&chat), mListener(NULL)
 {
     init();
     CALL_DB_FH(getNodeHistoryInfo, mNewestIdx, mOldestIdxInDb);
     mOldestIdx = (mNewestIdx < 0) ? 0 : (mNewestIdx + 1);
+    mBuffer.reset(mNewestIdx);
+    mNextIdxToNotify = mNewestIdx;
 }
 
-void FilteredHistory::addMessage(Message &msg, bool isNew, bool isLocal)
+void FilteredHistory::setMessageType(Message &msg)
 {
     if (msg.size()) // protect against deleted node-attachment messages
     {
         msg.type = msg.buf()[1] + Message::Type::kMsgOffset;
         assert(msg.type == Message::Type::kMsgAttachment);
     }
+}
 
+void FilteredHistory::addMessage(Message &msg, bool isNew, bool isLocal)
+{
+    setMessageType(msg);
     Id msgid = msg.id();
     if (isNew)
     {
-        mBuffer.emplace_front(new Message(msg));
-        mIdToMsgMap[msgid] =  mBuffer.begin();
+        Idx idx = mBuffer.pushNewest(new Message(msg));
         mNewestIdx++;
         CALL_DB_FH(addMsgToNodeHistory, msg, mNewestIdx);
-        CALL_LISTENER_FH(onReceived, mBuffer.front().get(), mNewestIdx);
+        CALL_LISTENER_FH(onReceived, mBuffer.newest(), idx);
     }
     else    // from DB or from NODEHIST/HIST
     {
-        if (mIdToMsgMap.find(msgid) == mIdToMsgMap.end())  // if it doesn't exist
+        if (mBuffer.find(msgid) == CHATD_IDX_INVALID)  // if it doesn't exist
         {
-            mBuffer.emplace_back(isLocal ? &msg : new Message(msg));    // if it's local (from DB), take the ownership
-            mIdToMsgMap[msgid] = --mBuffer.end();
+            Idx idx = mBuffer.pushOldest(isLocal ? &msg : new Message(msg));    // if it's local (from DB), take the ownership
             mOldestIdx--;
             if (!isLocal)
             {
@@ -5495,22 +6153,26 @@ void FilteredHistory::addMessage(Message &msg, bool isNew, bool isLocal)
             // I can receive an old message but we don't have to notify because it was not requested by the app
             if (mListener && (mFetchingFromServer || isLocal))
             {
-                CALL_LISTENER_FH(onLoaded, mBuffer.back().get(), mOldestIdx);
-                mNextMsgToNotify = mBuffer.end();
+                CALL_LISTENER_FH(onLoaded, mBuffer.oldest(), idx);
+                mNextIdxToNotify = idx - 1;
             }
         }
+        else if (isLocal)
+        {
+            delete &msg;
+        }
     }
 }
 
 void FilteredHistory::deleteMessage(const Message &msg)
 {
-    auto it = mIdToMsgMap.find(msg.id());
-    if (it != mIdToMsgMap.end())
+    Message *bufferedMsg = mBuffer.get(msg.id());
+    if (bufferedMsg)
     {
         // Remove message's content and modify updated field, it is the same that delete a file
-        (*it->second)->free();
-        (*it->second)->updated = msg.updated;
-        (*it->second)->type = msg.type;
+        bufferedMsg->free();
+        bufferedMsg->updated = msg.updated;
+        bufferedMsg->type = msg.type;
         // Only it's necessary notify messages that are loaded in RAM
         CALL_LISTENER_FH(onDeleted, msg.id());
     }
@@ -5522,21 +6184,11 @@ void FilteredHistory::truncateHistory(Id id)
 {
     if (id.isValid())
     {
-        auto it = mIdToMsgMap.find(id);
-        if (it != mIdToMsgMap.end())
+        // id is a message in the history, we want to remove from the next message until the oldest
+        Idx idx = mBuffer.find(id);
+        if (idx != CHATD_IDX_INVALID)
         {
-            // id is a message in the history, we want to remove from the next message until the oldest
-            for (auto itLoop = ++it->second; itLoop != mBuffer.end(); itLoop++)
-            {
-                mIdToMsgMap.erase((*itLoop)->id());
-
-                // if next message to notify was truncated, point to the end of the buffer
-                if (itLoop == mNextMsgToNotify)
-                {
-                    mNextMsgToNotify = mBuffer.end();
-                }
-            }
-            mBuffer.erase(it->second, mBuffer.end());
+            mBuffer.truncateBefore(idx);
         }
 
         CALL_DB_FH(truncateNodeHistory, id);
@@ -5548,7 +6200,7 @@ void FilteredHistory::truncateHistory(Id id)
     {
         if (!mBuffer.empty())
         {
-            CALL_LISTENER_FH(onTruncated, (*mBuffer.begin())->id());
+            CALL_LISTENER_FH(onTruncated, mBuffer.newest()->id());
         }
 
         clear();
@@ -5557,56 +6209,64 @@ void FilteredHistory::truncateHistory(Id id)
     mHaveAllHistory = true;
 }
 
+void FilteredHistory::addMemoryUsage(karere::MemoryReport& report) const
+{
+    mBuffer.addMemoryUsage(report);
+}
+
 void FilteredHistory::clear()
 {
-    mBuffer.clear();
-    mIdToMsgMap.clear();
     CALL_DB_FH(clearNodeHistory);
     init();
 }
 
 HistSource FilteredHistory::getHistory(uint32_t count)
 {
-    // Get messages from RAM
-    if (mNextMsgToNotify != mBuffer.end())
-    {
-        uint32_t msgsLoadedFromRam = 0;
-        auto it = mNextMsgToNotify;
-        while ((it != mBuffer.end()) && (msgsLoadedFromRam < count))
-        {
-            Idx index = mNewestIdx - std::distance(mBuffer.begin(), it);
-            CALL_LISTENER_FH(onLoaded,  it->get(), index);
-            msgsLoadedFromRam++;
+    HistSource source = HistSource::kHistSourceRam;
 
-            it++;
-            mNextMsgToNotify = it;
-        }
-
-        if (msgsLoadedFromRam)
-        {
-            CALL_LISTENER_FH(onLoaded, NULL, 0); // All messages requested has been returned or no more messages from this source
-            return HistSource::kHistSourceRam;
-        }
-    }
-
-    // Get messages from DB
-    if (mOldestIdx > mOldestIdxInDb)  // more messages available in DB
+    // Load messages from DB into RAM in chunks larger than the requested count, so
+    // paging through many attachments doesn't need a query per page
+    if (!mBuffer.hasIdx(mNextIdxToNotify) && mOldestIdx > mOldestIdxInDb)  // more messages available in DB
     {
         // First time we want messages from newest. If already have messages, we want to load from the oldest message
         Idx indexValue = mBuffer.empty() ? mNewestIdx : mOldestIdx - 1;
 
         std::vector<chatd::Message*> messages;
-        CALL_DB_FH(fetchDbNodeHistory, indexValue, count, messages);
-        if (messages.size())
+        CALL_DB_FH(fetchDbNodeHistory, indexValue, std::max<uint32_t>(count, kDbFetchChunk), messages);
+        Idx nextIdxToNotify = mBuffer.oldestIdx() - 1;
+        for (unsigned int i = 0; i < messages.size(); i++)
         {
-            for (unsigned int i = 0; i < messages.size(); i++)
+            Message *msg = messages[i];
+            if (mBuffer.find(msg->id()) == CHATD_IDX_INVALID)
             {
-                addMessage(*messages[i], false, true);   // takes ownership of Message*
+                setMessageType(*msg);
+                mBuffer.pushOldest(msg);    // takes ownership of Message*
+                mOldestIdx--;
+
+                // only notify from DB if it provided messages not loaded yet
+                mNextIdxToNotify = nextIdxToNotify;
+                source = HistSource::kHistSourceDb;
+            }
+            else
+            {
+                delete msg;
             }
+        }
+    }
 
-            CALL_LISTENER_FH(onLoaded, NULL, 0);  // All messages requested has been returned or no more messages from this source
-            return HistSource::kHistSourceDb;
+    // Get messages from RAM
+    if (mBuffer.hasIdx(mNextIdxToNotify))
+    {
+        uint32_t msgsLoadedFromRam = 0;
+        while (mBuffer.hasIdx(mNextIdxToNotify) && (msgsLoadedFromRam < count))
+        {
+            CALL_LISTENER_FH(onLoaded, mBuffer.at(mNextIdxToNotify), mNextIdxToNotify);
+            msgsLoadedFromRam++;
+            mNextIdxToNotify--;
         }
+
+        CALL_LISTENER_FH(onLoaded, NULL, 0); // All messages requested has been returned or no more messages from this source
+        return source;
     }
 
     // Get messages from Server
@@ -5614,7 +6274,7 @@ HistSource FilteredHistory::getHistory(uint32_t count)
     {
         if (!mFetchingFromServer)
         {
-            const Message *msgNode = !mBuffer.empty() ? mBuffer.back().get() : NULL;
+            const Message *msgNode = !mBuffer.empty() ? mBuffer.oldest() : NULL;
             const Message *msgText = mChat->oldest();
             Id oldestMsgid = Id::inval();
             if (msgNode && msgText)
@@ -5655,7 +6315,7 @@ void FilteredHistory::setHandler(FilteredHistoryHandler *handler)
     if (mListener)
         throw std::runtime_error("App node history handler is already set, remove it first");
 
-    mNextMsgToNotify = mBuffer.begin();
+    mNextIdxToNotify = mBuffer.newestIdx();
     mListener = handler;
 }
 
@@ -5673,19 +6333,13 @@ void FilteredHistory::finishFetchingFromServer()
 
 Message *FilteredHistory::getMessage(Id id)
 {
-    Message *msg = NULL;
-    auto msgItetrator = mIdToMsgMap.find(id);
-    if (msgItetrator != mIdToMsgMap.end())
-    {
-        msg = msgItetrator->second->get();
-    }
-
-    return msg;
+    return mBuffer.get(id);
 }
 
 Idx FilteredHistory::getMessageIdx(Id id)
 {
-    return mDb->getIdxOfMsgidFromNodeHistory(id);
+    Idx idx = mBuffer.find(id);
+    return (idx != CHATD_IDX_INVALID) ? idx : mDb->getIdxOfMsgidFromNodeHistory(id);
 }
 
 void FilteredHistory::init()
@@ -5693,7 +6347,8 @@ void FilteredHistory::init()
     mNewestIdx = -1;
     mOldestIdx = 0;
     mOldestIdxInDb = 0;
-    mNextMsgToNotify = mBuffer.begin();
+    mBuffer.reset(mNewestIdx);
+    mNextIdxToNotify = mNewestIdx;
     mHaveAllHistory = false;
 }
 
@@ -8,6 +8,7 @@
 #include <set>
 #include <list>
 #include <deque>
+#include <unordered_map>
 #include <base/promise.h>
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
@@ -45,6 +46,17 @@ typedef int32_t Idx;
 class Chat;
 class ICrypto;
 
+/** @brief An encrypted reaction, with the attributes of its message needed to decrypt it */
+struct EncryptedReaction
+{
+    karere::Id msgid;
+    karere::Id msgUserid;
+    KeyId keyid;
+    std::string data;
+    EncryptedReaction(const Message& msg, std::string aData)
+        : msgid(msg.id()), msgUserid(msg.userid), keyid(msg.keyid), data(std::move(aData)) {}
+};
+
 
 /** @brief Reason codes passed to Listener::onManualSendRequired() */
 enum ManualSendReason: uint8_t
@@ -70,7 +82,8 @@ enum HistSource
 enum
 {
     kSeenTimeout = 200,     /// Delay to send SEEN (ms)
-    kSyncTimeout = 2500     /// Timeout to recv SYNC (ms)
+    kSyncTimeout = 2500,    /// Timeout to recv SYNC (ms)
+    kHistoryEvictionDelay = 5000    /// Delay to check the limits of resident messages (ms)
 };
 
 enum { kMaxMsgSize = 120000 };  // (in bytes)
@@ -441,9 +454,6 @@ protected:
     /** Target IP address being used for the reconnection in-flight */
     std::string mTargetIp;
 
-    /** ip version to try first (both are tried) */
-    bool usingipv6 = false;
-
     /** RetryController that manages the reconnection's attempts */
     std::unique_ptr<karere::rh::IRetryController> mRetryCtrl;
 
@@ -461,9 +471,23 @@ protected:
     /** Handler of the timeout for the connection establishment */
     megaHandle mConnectTimer = 0;
 
+    /** Chats waiting to be joined after (re)connection, sorted by priority */
+    std::deque<karere::Id> mJoinQueue;
+
+    /** Chats whose JOIN/JOINRANGEHIST has been sent, but HISTDONE not received yet */
+    std::set<karere::Id> mJoinsInFlight;
+
     /** This promise is resolved when output data is written to the sockets */
     promise::Promise<void> mSendPromise;
 
+    /** Frames and commands sent and received. The bytes are in wsStats() */
+    karere::TrafficStats mTraffic;
+
+    /** Messages received while fetching history from server, and time spent by the chats
+     * of this connection in those fetches (from HIST/JOINRANGEHIST to HISTDONE) */
+    karere::Counter mHistoryMsgs;
+    karere::Counter mHistoryFetchUs;
+
     // ---- callbacks called from libwebsocketsIO ----
     virtual void wsConnectCb();
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
@@ -478,6 +502,8 @@ protected:
 // Destroys the buffer content
     bool sendBuf(Buffer&& buf);
     bool rejoinExistingChats();
+    void joinNextChats();
+    void onJoinFinished(karere::Id chatid);
     void resendPending();
     void join(karere::Id chatid);
     void hist(karere::Id chatid, long count);
@@ -505,6 +531,12 @@ public:
 
     promise::Promise<void> connect();
     promise::Promise<void> fetchUrl();
+
+    /** @brief Moves the chat to the front of the chats waiting to be joined, i.e. when the app opens it */
+    void prioritizeJoin(karere::Id chatid);
+
+    /** @brief Adds the traffic and history-fetch counters of the connection, labeled by shard */
+    void addMetrics(karere::Metrics& metrics) const;
 };
 
 enum ServerHistFetchState
@@ -606,6 +638,61 @@ protected:
     uint8_t mState = kNone;
 };
 
+/** @brief Messages ordered by idx in a contiguous buffer, the newest first, and indexed by msgid
+ *
+ * Messages are added at both ends. Lookups by idx and by msgid are O(1) and truncating only
+ * visits the removed messages, so large histories don't need a node per message.
+ */
+class NodeHistoryBuffer
+{
+public:
+    /** @brief Empties the buffer. The next message added as newest will have \c newestIdx + 1 */
+    void reset(Idx newestIdx);
+    bool empty() const { return mMsgs.empty(); }
+    size_t size() const { return mMsgs.size(); }
+    Idx newestIdx() const { return mNewestIdx; }
+    Idx oldestIdx() const { return mNewestIdx - static_cast<Idx>(mMsgs.size()) + 1; }
+    bool hasIdx(Idx idx) const { return idx <= mNewestIdx && idx >= oldestIdx(); }
+    Message* at(Idx idx) const { assert(hasIdx(idx)); return mMsgs[mNewestIdx - idx].get(); }
+    Message* newest() const { return mMsgs.front().get(); }
+    Message* oldest() const { return mMsgs.back().get(); }
+
+    /** @return The idx of the message, or CHATD_IDX_INVALID if it's not in the buffer */
+    Idx find(karere::Id msgid) const;
+    /** @return The message, or NULL if it's not in the buffer */
+    Message* get(karere::Id msgid) const;
+
+    /** @brief Adds a message newer than the ones in the buffer, taking its ownership
+     * @return The idx of the message */
+    Idx pushNewest(Message* msg);
+    /** @brief Adds a message older than the ones in the buffer, taking its ownership
+     * @return The idx of the message */
+    Idx pushOldest(Message* msg);
+    /** @brief Removes the messages older than \c idx */
+    void truncateBefore(Idx idx);
+
+    void addMemoryUsage(karere::MemoryReport& report) const;
+
+protected:
+    std::deque<std::unique_ptr<Message>> mMsgs;
+    std::unordered_map<karere::Id, Idx> mIdxById;
+    Idx mNewestIdx = -1;
+};
+
+/** @brief The chat a FilteredHistory belongs to, as seen by it: the source of the history
+ * not available in DB. Implemented by Chat */
+class NodeHistoryFetcher
+{
+public:
+    virtual ~NodeHistoryFetcher() {}
+    /** @brief True if history can be requested from server */
+    virtual bool isLoggedIn() const = 0;
+    /** @brief Oldest message in the history buffer of the chat, or NULL if empty */
+    virtual Message* oldest() const = 0;
+    /** @brief Fetch \c count node-attachment messages from server, starting at \c oldestMsgid */
+    virtual void requestNodeHistoryFromServer(karere::Id oldestMsgid, uint32_t count) = 0;
+};
+
 /**
  * @brief The generic class to manage history applying filters
  *
@@ -617,7 +704,7 @@ protected:
  * is truncated.
  *
  * Currently, this class is used exclusively to manage history of nodes/attachments.
- * In consequence, it uses the method Chat::requestNodeHistoryFromServer to fetch
+ * In consequence, it uses the method NodeHistoryFetcher::requestNodeHistoryFromServer to fetch
  * new nodes from chatd through NODEHIST. Note that node-messages are also added to
  * the filtered history if a received/retrieved message (NEWMSG/OLDMSG) is a node-message.
  *
@@ -633,7 +720,11 @@ protected:
 class FilteredHistory
 {
 public:
-    FilteredHistory(DbInterface &db, Chat &chat);
+    /** Messages loaded from DB at once. The ones not requested by the app are kept in RAM
+     * for the next requests */
+    enum { kDbFetchChunk = 256 };
+
+    FilteredHistory(DbInterface &db, NodeHistoryFetcher &chat);
 
     void addMessage(Message &msg, bool isNew, bool isLocal);
     void deleteMessage(const Message &msg);
@@ -649,17 +740,15 @@ public:
     void finishFetchingFromServer();
     Message *getMessage(karere::Id id);
     Idx getMessageIdx(karere::Id id);
+    void addMemoryUsage(karere::MemoryReport& report) const;
 
 protected:
     DbInterface *mDb;
-    Chat *mChat;
+    NodeHistoryFetcher *mChat;
     FilteredHistoryHandler *mListener;
 
     /** Contains the messages in the history-buffer */
-    std::list<std::unique_ptr<Message>> mBuffer;
-
-    /** Maps msgid's to their position in the history-buffer */
-    std::map<karere::Id, std::list<std::unique_ptr<Message>>::iterator> mIdToMsgMap;
+    NodeHistoryBuffer mBuffer;
 
     /** Index of the newest (most recent) message loaded in RAM */
     Idx mNewestIdx;
@@ -670,8 +759,9 @@ protected:
     /** Index of the oldest message available in DB */
     Idx mOldestIdxInDb;
 
-    /** Iterator pointing to the next message to be notified from buffer in memory */
-    std::list<std::unique_ptr<Message>>::iterator mNextMsgToNotify;
+    /** Index of the next message to be notified from buffer in memory. None if it's
+     * not in the buffer anymore */
+    Idx mNextIdxToNotify;
 
     /** True if we reached the beginning of the history */
     bool mHaveAllHistory = false;
@@ -680,6 +770,8 @@ protected:
     bool mFetchingFromServer = false;
 
     void init();
+    /** @brief Sets the type of a node-attachment message from its contents */
+    static void setMessageType(Message &msg);
 };
 
 struct ChatDbInfo;
@@ -689,7 +781,7 @@ struct ChatDbInfo;
  * The history buffer can grow in two directions and is always contiguous, i.e.
  * there are no "holes".
  */
-class Chat: public karere::DeleteTrackable
+class Chat: public karere::DeleteTrackable, public NodeHistoryFetcher
 {
 ///@cond PRIVATE
 public:
@@ -762,6 +854,12 @@ protected:
     Idx mLastSeenInFlightIdx = CHATD_IDX_INVALID;
     Idx mLastIdxReceivedFromServer = CHATD_IDX_INVALID;
     karere::Id mLastIdReceivedFromServer;
+    /// SEEN and RECEIVED to be sent in the next flush of pointers by the client
+    Idx mPendingSeenIdx = CHATD_IDX_INVALID;
+    karere::Id mPendingSeenId = karere::Id::inval();
+    karere::Id mPendingReceivedId = karere::Id::inval();
+    /// true if mLastSeenId/mLastReceivedId changed and have to be saved in db in the next flush
+    bool mPointersDirty = false;
     Listener* mListener;
     ChatState mOnlineState = kChatStateOffline;
     Priv mOwnPrivilege = PRIV_INVALID;
@@ -839,6 +937,22 @@ protected:
     bool mTruncateAttachment = false;
     /** Indicates the reaction sequence number for this chatroom */
     karere::Id mReactionSn = karere::Id::inval();
+
+    /// reactions received (i.e. in a burst during JOIN) and pending to be decrypted all together
+    struct PendingReaction
+    {
+        karere::Id msgId;
+        karere::Id userId;
+        bool isAdd;
+    };
+    std::vector<PendingReaction> mPendingReactions;
+    std::vector<EncryptedReaction> mPendingEncryptedReactions;
+    /// number of batches of reactions being decrypted right now
+    unsigned mReactionBatchesInFlight = 0;
+    /// when the app requested history of this chat for the last time, to evict the least recently viewed chats first
+    time_t mLastHistoryAccessTs = 0;
+    /// when the current history fetch from server was requested (in us, see LoopProfiler::now()), or 0
+    int64_t mHistFetchStartTs = 0;
     // ====
     std::map<karere::Id, Message*> mPendingEdits;
     std::map<BackRefId, Idx> mRefidToIdxMap;
@@ -863,6 +977,8 @@ protected:
     void onUserLeave(karere::Id userid);
     void onAddReaction(karere::Id msgId, karere::Id userId, std::string reaction);
     void onDelReaction(karere::Id msgId, karere::Id userId, std::string reaction);
+    void queueReaction(Message& message, karere::Id userId, std::string&& reaction, bool isAdd);
+    void decryptPendingReactions();
     void onReactionSn(karere::Id rsn);
     void onPreviewersUpdate(uint32_t numPrev);
     void onJoinComplete();
@@ -870,9 +986,12 @@ protected:
     void initialFetchHistory(karere::Id serverNewest);
     void requestHistoryFromServer(int32_t count);
     Idx getHistoryFromDb(unsigned count);
+    void prefetchHistoryFromDb(unsigned count);
     HistSource getHistoryFromDbOrServer(unsigned count);
     void onLastReceived(karere::Id msgid);
     void onLastSeen(karere::Id msgid);
+    void persistPointers();
+    void flushPendingPointers(bool sendSeen);
     void handleLastReceivedSeen(karere::Id msgid);
     bool msgSend(const Message& message);
     void setOnlineState(ChatState state);
@@ -927,6 +1046,23 @@ public:
      * @note Note that there may be more messages in history db, but not loaded
      * into memory*/
     Idx size() const { return mForwardList.size() + mBackwardList.size(); }
+    /** @brief When the app requested history of this chat for the last time (0 if never) */
+    time_t lastHistoryAccessTs() const { return mLastHistoryAccessTs; }
+    /**
+     * @brief Removes the oldest messages from the RAM history buffer, keeping the
+     * newest \c keep ones. Evicted messages are still in the db and are loaded again
+     * on demand by getHistory(), as it happens at startup.
+     *
+     * Nothing is evicted while the chat is opened by the app or history is being
+     * fetched or decrypted. Eviction also stops at the oldest message that has
+     * pending edits, reactions, rich-links or SEEN to be sent.
+     *
+     * @return The number of evicted messages
+     */
+    Idx evictHistory(Idx keep);
+    /** @brief Accounts the memory used by the history buffers, indexes, sending queue,
+     * node-history and crypto module of the chat */
+    void addMemoryUsage(karere::MemoryReport& report) const;
     /** @brief Whether we have any messages in the history buffer */
     bool empty() const { return mForwardList.empty() && mBackwardList.empty();}
     bool isDisabled() const { return mIsDisabled; }
@@ -964,7 +1100,7 @@ public:
     bool isJoining() const { return mOnlineState == kChatStateJoining; }
 
     /** @brief True if logged-in into chatd (HISTDONE received after JOIN/JOINRANGEHIST) */
-    bool isLoggedIn() const { return mOnlineState == kChatStateOnline; }
+    virtual bool isLoggedIn() const { return mOnlineState == kChatStateOnline; }
 
     /** @brief Get the seen/received status of a message. Both the message object
      * and its index in the history buffer must be provided */
@@ -1303,10 +1439,10 @@ public:
     void rejoin();
 
     /** Fetch \c count node-attachment messages from server, starting at \c oldestMsgid */
-    void requestNodeHistoryFromServer(karere::Id oldestMsgid, uint32_t count);
+    virtual void requestNodeHistoryFromServer(karere::Id oldestMsgid, uint32_t count);
 
     /** Returns oldest message in  the history buffer*/
-    Message* oldest() const;
+    virtual Message* oldest() const;
 
     /** Returns newest message in  the history buffer*/
     Message* newest() const;
@@ -1369,14 +1505,28 @@ protected:
     // maps userids to the timestamp of the most recent message received from the userid
     std::map<karere::Id, ::mega::m_time_t> mLastMsgTs;
 
-    // set of seen timers
-    std::set<megaHandle> mSeenTimers;
+    // chats with SEEN/RECEIVED pending to be sent, or pointers pending to be saved in db,
+    // all of them flushed together by a single timer
+    std::set<karere::Id> mChatsWithPendingPointers;
+    megaHandle mPointersFlushTimer = 0;
+    void schedulePointersFlush(karere::Id chatid);
+
+    // evicts history of chats not opened by the app when the limits of resident messages are exceeded
+    megaHandle mHistoryEvictionTimer = 0;
+    void evictHistory();
+
+    // time to decrypt/encrypt messages, including waiting for keys, by message type
+    karere::LatencyStats mDecryptStats[256];
+    karere::LatencyStats mEncryptStats[256];
 
     bool mMessageReceivedConfirmation = false;
 
     // value of richPreview's user-attribute
     uint8_t mRichLinkState = kRichLinkNotDefined;
 
+    // max number of joins in progress per shard after (re)connection
+    unsigned mMaxOutstandingJoins = kDefaultMaxOutstandingJoins;
+
     // to track changes in the richPreview's user-attribute
     karere::UserAttrCache::Handle mRichPrevAttrCbHandle;
 
@@ -1411,6 +1561,7 @@ public:
     ~Client();
 
     enum: uint8_t { kRichLinkNotDefined = 0,  kRichLinkEnabled = 1, kRichLinkDisabled = 2};
+    enum: unsigned { kDefaultMaxOutstandingJoins = 8 };
 
     MyMegaApi *mApi;
     karere::Client *mKarereClient;
@@ -1427,6 +1578,25 @@ public:
     uint8_t keepaliveType();
     void setKeepaliveType(bool isInBackground);
 
+    /** @brief Max number of chats per shard being joined at the same time after (re)connection.
+     * The next chat is joined when HISTDONE is received for one of them */
+    unsigned maxOutstandingJoins() const;
+    void setMaxOutstandingJoins(unsigned count);
+
+    /** @brief Number of messages in the RAM history buffer of all chats */
+    size_t residentMsgCount() const;
+
+    /** @brief Accounts the memory used by all chats */
+    void addMemoryUsage(karere::MemoryReport& report) const;
+
+    /** @brief Adds the traffic of each connection, the crypto latencies by message type
+     * and the depth of the sending queue of the chats that have messages pending to send */
+    void addMetrics(karere::Metrics& metrics) const;
+
+    /** @brief Checks the limits of resident messages (see karere::Client::setResidentHistoryLimits)
+     * after a while, and evicts history of chats not opened by the app to keep within them */
+    void scheduleHistoryEviction();
+
     /** @brief Joins the specifed chatroom on the specified shard, using the specified url, and
      * associates the specified Listener and ICrypto instances with the newly created Chat object.
      */
@@ -1438,6 +1608,10 @@ public:
 
     void disconnect();
     void retryPendingConnections(bool disconnect, bool refreshURL = false);
+
+    /** @brief Sends the pointers pending of all chats and saves them in db. If \c sendSeen
+     * is false, the SEEN pending to be sent are discarded */
+    void flushPendingPointers(bool sendSeen = true);
     void heartbeat();
 
     promise::Promise<void> notifyUserStatus();
@@ -1445,7 +1619,7 @@ public:
     /** Changes the Rtc handler, returning the old one */
     IRtcHandler* setRtcHandler(IRtcHandler* handler);
 
-    /** Clean the timers set */
+    /** Discards the SEEN pending to be sent, but sends the rest of pending pointers right away */
     void cancelSeenTimers();
 
     // True if clients send confirmation to chatd when they receive a new message
@@ -1501,6 +1675,19 @@ public:
     */
     virtual void fetchDbHistory(Idx startIdx, unsigned count, std::vector<Message*>& messages) = 0;
 
+    /**
+    * @brief Asks to load in background the page that a future \c fetchDbHistory(startIdx, count)
+    * would return, so it doesn't have to access the disk. Implementations may ignore it.
+    */
+    virtual void prefetchDbHistory(Idx startIdx, unsigned count) = 0;
+
+    /**
+    * @brief Returns the page previously requested by \c prefetchDbHistory, with the reactions of
+    * the messages already loaded, in the same form as \c fetchDbHistory does.
+    * @return false if the page is not loaded yet or it's outdated, so it has to be fetched from db
+    */
+    virtual bool takePrefetchedDbHistory(Idx startIdx, unsigned count, std::vector<Message*>& messages) = 0;
+
     /// adds a message to the history buffer at the specified \c idx
     virtual void addMsgToHistory(const Message& msg, Idx idx) = 0;
 
@@ -1563,6 +1750,8 @@ public:
 
     virtual void setLastSeen(karere::Id msgid) = 0;
     virtual void setLastReceived(karere::Id msgid) = 0;
+    /** @brief Persists both pointers with a single update */
+    virtual void setLastSeenAndReceived(karere::Id lastSeen, karere::Id lastReceived) = 0;
 
     virtual void setChatVar (const char *name, bool value) = 0;
     virtual bool chatVar (const char *name) = 0;
@@ -1587,6 +1776,10 @@ public:
     virtual void addReaction(karere::Id msgId, karere::Id userId, const char *reaction) = 0;
     virtual void delReaction(karere::Id msgId, karere::Id userId, const char *reaction) = 0;
     virtual void getMessageReactions(karere::Id msgId, ::mega::multimap<std::string, karere::Id>& reactions) = 0;
+
+    /** @brief Loads with a single query the reactions of the messages in the range of indexes,
+     * adding them to the corresponding \c messages (the ones already loaded from that range) */
+    virtual void getReactionsForRange(Idx minIdx, Idx maxIdx, const std::vector<Message*>& messages) = 0;
 };
 
 }
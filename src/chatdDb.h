@@ -1,10 +1,74 @@
 #ifndef CHATD_DB_H
 #define CHATD_DB_H
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include "db.h"
 #include "chatd.h"
 //extern sqlite3* db;
 
+/** @brief Loads pages of history in a background thread, through its own read-only
+ * connection to the db, so the page that the app will likely request next is
+ * already in memory (and with its reactions) when the app asks for it.
+ *
+ * There is one pending or loaded page per chat at most. A page is only handed
+ * over if it was requested for the same idx and history generation that the chat
+ * has when taking it, otherwise it is discarded.
+ * All methods but the background thread are called from the karere thread.
+ */
+class ChatdDbPrefetcher
+{
+public:
+    /** Time that both connections wait for the locks of the other one */
+    enum { kBusyTimeoutMs = 2000 };
+    explicit ChatdDbPrefetcher(SqliteDb& db): mDb(db) {}
+    ~ChatdDbPrefetcher() { stop(); }
+    /** @brief Requests to load \c count messages from \c idx backwards, replacing any previous page of the chat */
+    void request(karere::Id chatid, chatd::Idx idx, unsigned count, uint32_t generation);
+    /** @brief If the page of the chat is loaded and matches the request, moves its messages to \c messages and returns true */
+    bool take(karere::Id chatid, chatd::Idx idx, unsigned count, uint32_t generation, std::vector<chatd::Message*>& messages);
+    /** @brief Discards the page of the chat, if any */
+    void cancel(karere::Id chatid);
+    /** @brief Stops the background thread and closes its connection. Must be called before closing the main connection */
+    void stop();
+
+protected:
+    struct Page
+    {
+        uint64_t seq;
+        chatd::Idx idx;
+        unsigned count;
+        uint32_t generation;
+        bool ready = false;
+        std::vector<chatd::Message*> messages;
+        Page(uint64_t aSeq, chatd::Idx aIdx, unsigned aCount, uint32_t aGeneration)
+            : seq(aSeq), idx(aIdx), count(aCount), generation(aGeneration) {}
+        ~Page()
+        {
+            for (auto msg: messages)
+            {
+                delete msg;
+            }
+        }
+    };
+
+    SqliteDb& mDb;          // main connection, owned by karere::Client
+    SqliteDb mReader;       // used only by mThread
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    bool mStop = false;
+    bool mFailed = false;   // the read-only connection could not be opened, don't retry
+    uint64_t mNextSeq = 0;
+    std::deque<karere::Id> mQueue;
+    std::map<karere::Id, std::unique_ptr<Page>> mPages;
+    bool start();
+    void run();
+};
+
 class ChatdSqliteDb: public chatd::DbInterface
 {
 protected:
@@ -12,9 +76,28 @@ protected:
     chatd::Chat& mChat;
     std::string mSendingTblName;
     std::string mHistTblName;
+    ChatdDbPrefetcher* mPrefetcher;
+    // Incremented on every change to the history that a prefetched page may contain.
+    // Changes are only visible to the prefetcher once committed, so it's not used until then
+    uint32_t mHistGeneration = 0;
+    bool mHistUncommitted = false;
+    uint32_t mHistWriteCommit = 0;
+    void historyChanged()
+    {
+        mHistGeneration++;
+        mHistUncommitted = true;
+        mHistWriteCommit = mDb.commitCount();
+    }
 public:
-    ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
-        :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
+    ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, ChatdDbPrefetcher* prefetcher=nullptr, const std::string& sendingTblName="sending", const std::string& histTblName="history")
+        :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName), mPrefetcher(prefetcher){}
+    ~ChatdSqliteDb()
+    {
+        if (mPrefetcher)
+        {
+            mPrefetcher->cancel(mChat.chatId());
+        }
+    }
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
         SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
@@ -149,10 +232,15 @@ public:
     }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
+        if (idx <= mChat.lownum())
+        {
+            historyChanged();   // new messages are added at the other end
+        }
         addMessage(msg, idx, "history");
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
+        historyChanged();
         if (msg.type == chatd::Message::kMsgTruncate)
         {
             mDb.query("update history set type = ?, data = ?, ts = ?, userid = ?, keyid = ? where chatid = ? and msgid = ?",
@@ -248,6 +336,28 @@ public:
         loadMessages(count, idx, messages, "history");
     }
 
+    void prefetchDbHistory(chatd::Idx idx, unsigned count) override
+    {
+        if (!mPrefetcher)
+        {
+            return;
+        }
+        if (mHistUncommitted)
+        {
+            if (!mDb.commitEach() && mDb.commitCount() == mHistWriteCommit)
+            {
+                return; // the read-only connection wouldn't see the latest changes yet
+            }
+            mHistUncommitted = false;
+        }
+        mPrefetcher->request(mChat.chatId(), idx, count, mHistGeneration);
+    }
+
+    bool takePrefetchedDbHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages) override
+    {
+        return mPrefetcher && mPrefetcher->take(mChat.chatId(), idx, count, mHistGeneration, messages);
+    }
+
     virtual chatd::Idx getIdxOfMsgid(karere::Id msgid, const std::string &table)
     {
         std::string query = "select idx from " + table + " where chatid = ? and msgid = ?";
@@ -333,6 +443,7 @@ public:
     }
     virtual void truncateHistory(const chatd::Message& msg)
     {
+        historyChanged();
         auto idx = getIdxOfMsgidFromHistory(msg.id());
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
@@ -367,6 +478,12 @@ public:
         assertAffectedRowCount(1);
     }
 
+    void setLastSeenAndReceived(karere::Id lastSeen, karere::Id lastReceived) override
+    {
+        mDb.query("update chats set last_seen=?, last_recv=? where chatid=?", lastSeen, lastReceived, mChat.chatId());
+        assertAffectedRowCount(1);
+    }
+
     virtual void setHaveAllHistory(bool haveAllHistory)
     {
         mDb.query(
@@ -444,6 +561,7 @@ public:
 
     virtual void clearHistory()
     {
+        historyChanged();
         mDb.query("delete from history where chatid = ?", mChat.chatId());
         setHaveAllHistory(false);
     }
@@ -502,12 +620,18 @@ public:
     }
 
     void loadMessages(int count, chatd::Idx idx, std::vector<chatd::Message*>& messages, const std::string &table)
+    {
+        loadMessages(mDb, mChat.chatId(), count, idx, messages, table);
+    }
+
+    /** @brief Loads the messages from any connection, i.e. the one of the prefetcher */
+    static void loadMessages(SqliteDb& db, karere::Id chatid, int count, chatd::Idx idx, std::vector<chatd::Message*>& messages, const std::string &table)
     {
         std::string query = "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from " + table +
                             " where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
 
-        SqliteStmt stmt(mDb, query.c_str());
-        stmt << mChat.chatId() << idx << count;
+        SqliteStmt stmt(db, query.c_str());
+        stmt << chatid << idx << count;
         int i = 0;
         while(stmt.step())
         {
@@ -523,7 +647,7 @@ public:
             if(tableIdx != idx - (int)messages.size()) //we go backward in history, hence the -messages.size()
             {
                 CHATD_LOG_ERROR("chatid %s: loadMessages from table %s: History discontinuity detected: "
-                    "expected idx %d, retrieved from db:%d", mChat.chatId().toString().c_str(), table.c_str(),
+                    "expected idx %d, retrieved from db:%d", chatid.toString().c_str(), table.c_str(),
                     idx - (int)messages.size(), tableIdx);
                 assert(false);
             }
@@ -552,17 +676,20 @@ public:
 
     void cleanReactions(karere::Id msgId) override
     {
+        historyChanged();
         mDb.query("delete from chat_reactions where chatid = ? and msgId = ?", mChat.chatId(), msgId);
     }
 
     void addReaction(karere::Id msgId, karere::Id userId, const char *reaction) override
     {
+        historyChanged();
         mDb.query("insert into chat_reactions(chatid, msgid, userid, reaction)"
             "values(?,?,?,?)", mChat.chatId(), msgId, userId, reaction);
     }
 
     void delReaction(karere::Id msgId, karere::Id userId, const char *reaction) override
     {
+        historyChanged();
         mDb.query("delete from chat_reactions where chatid = ? and msgid = ? and userid = ? and reaction = ?",
             mChat.chatId(), msgId, userId, reaction);
     }
@@ -577,6 +704,197 @@ public:
             reactions.insert(std::pair<std::string, karere::Id>(stmt.stringCol(0), stmt.uint64Col(1)));
         }
     }
+
+    void getReactionsForRange(chatd::Idx minIdx, chatd::Idx maxIdx, const std::vector<chatd::Message*>& messages) override
+    {
+        loadReactions(mDb, mChat.chatId(), minIdx, maxIdx, messages);
+    }
+
+    static void loadReactions(SqliteDb& db, karere::Id chatid, chatd::Idx minIdx, chatd::Idx maxIdx, const std::vector<chatd::Message*>& messages)
+    {
+        if (messages.empty())
+        {
+            return;
+        }
+
+        karere::FlatMap<karere::Id, chatd::Message*> msgById;
+        msgById.reserve(messages.size());
+        for (auto msg: messages)
+        {
+            msgById[msg->id()] = msg;
+        }
+
+        SqliteStmt stmt(db, "select r.msgid, r.reaction, r.userid from chat_reactions r join history h"
+                            " on h.chatid = r.chatid and h.msgid = r.msgid"
+                            " where h.chatid = ?1 and h.idx >= ?2 and h.idx <= ?3 order by r.rowid");
+        stmt << chatid << minIdx << maxIdx;
+        while (stmt.step())
+        {
+            auto it = msgById.find(stmt.uint64Col(0));
+            if (it != msgById.end())
+            {
+                it->second->addReaction(stmt.stringCol(1), stmt.uint64Col(2));
+            }
+        }
+    }
 };
 
+inline bool ChatdDbPrefetcher::start()
+{
+    const char* path = mDb.isOpen() ? mDb.fileName() : nullptr;
+    if (!path || !*path || !mReader.openReadOnly(path))
+    {
+        CHATD_LOG_WARNING("History prefetch: can't open a read-only connection to the db, prefetch disabled");
+        mFailed = true;
+        return false;
+    }
+
+    // the db is in WAL mode (see SqliteDb::open), so reads don't block the commits of the
+    // main connection. The timeout only covers the short exclusive locks of a checkpoint
+    mDb.setBusyTimeout(kBusyTimeoutMs);
+    mReader.setBusyTimeout(kBusyTimeoutMs);
+    mStop = false;
+    mThread = std::thread([this]() { run(); });
+    return true;
+}
+
+inline void ChatdDbPrefetcher::stop()
+{
+    if (mThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCondVar.notify_one();
+        mThread.join();
+        mReader.close();
+    }
+    mQueue.clear();
+    mPages.clear();
+    mFailed = false;
+}
+
+inline void ChatdDbPrefetcher::request(karere::Id chatid, chatd::Idx idx, unsigned count, uint32_t generation)
+{
+    if (!mThread.joinable() && (mFailed || !start()))
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::unique_ptr<Page>& page = mPages[chatid];
+        if (page && page->idx == idx && page->count == count && page->generation == generation)
+        {
+            return; // already loaded or being loaded
+        }
+        page.reset(new Page(mNextSeq++, idx, count, generation));
+        mQueue.push_back(chatid);
+    }
+    mCondVar.notify_one();
+}
+
+inline bool ChatdDbPrefetcher::take(karere::Id chatid, chatd::Idx idx, unsigned count, uint32_t generation, std::vector<chatd::Message*>& messages)
+{
+    std::unique_ptr<Page> page;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mPages.find(chatid);
+        if (it == mPages.end() || !it->second->ready)
+        {
+            return false;
+        }
+        page = std::move(it->second);
+        mPages.erase(it);
+    }
+
+    // a page of more messages than requested is still valid, the rest are discarded
+    if (page->idx != idx || page->generation != generation || page->count < count)
+    {
+        CHATD_LOG_DEBUG("History prefetch: discarding outdated page of chat %s", chatid.toString().c_str());
+        return false;
+    }
+
+    size_t taken = std::min<size_t>(count, page->messages.size());
+    messages.assign(page->messages.begin(), page->messages.begin() + taken);
+    page->messages.erase(page->messages.begin(), page->messages.begin() + taken);
+    return true;
+}
+
+inline void ChatdDbPrefetcher::cancel(karere::Id chatid)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPages.erase(chatid);
+}
+
+inline void ChatdDbPrefetcher::run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true)
+    {
+        mCondVar.wait(lock, [this]() { return mStop || !mQueue.empty(); });
+        if (mStop)
+        {
+            return;
+        }
+
+        karere::Id chatid = mQueue.front();
+        mQueue.pop_front();
+        auto it = mPages.find(chatid);
+        if (it == mPages.end() || it->second->ready)
+        {
+            continue;   // cancelled, or queued more than once
+        }
+
+        uint64_t seq = it->second->seq;
+        chatd::Idx idx = it->second->idx;
+        unsigned count = it->second->count;
+        lock.unlock();
+
+        std::vector<chatd::Message*> messages;
+        bool ok = true;
+        try
+        {
+            // a single read transaction, so messages and reactions are consistent
+            mReader.simpleQuery("BEGIN");
+            ChatdSqliteDb::loadMessages(mReader, chatid, count, idx, messages, "history");
+            if (!messages.empty())
+            {
+                ChatdSqliteDb::loadReactions(mReader, chatid, idx - static_cast<chatd::Idx>(messages.size()) + 1, idx, messages);
+            }
+            mReader.simpleQuery("COMMIT");
+        }
+        catch (std::exception& e)
+        {
+            CHATD_LOG_WARNING("History prefetch: error loading history of chat %s: %s", chatid.toString().c_str(), e.what());
+            if (!sqlite3_get_autocommit(mReader))
+            {
+                sqlite3_exec(mReader, "ROLLBACK", nullptr, nullptr, nullptr);
+            }
+            ok = false;
+        }
+
+        lock.lock();
+        it = mPages.find(chatid);
+        if (it != mPages.end() && it->second->seq == seq)
+        {
+            if (ok)
+            {
+                it->second->messages.swap(messages);
+                it->second->ready = true;
+            }
+            else
+            {
+                mPages.erase(it);   // the chat will load the page by itself
+            }
+        }
+
+        for (auto msg: messages)    // the page was replaced or cancelled meanwhile
+        {
+            delete msg;
+        }
+    }
+}
+
 #endif
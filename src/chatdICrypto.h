@@ -166,11 +166,16 @@ public:
     virtual promise::Promise<std::shared_ptr<Buffer>> reactionEncrypt(const Message &msg, const std::string &reaction) = 0;
 
     /**
-     * @brief Decrypts a reaction with xxtea.
-     * @param msg The message associated to the reaction.
-     * @param reaction The encrypted reaction.
+     * @brief Decrypts a batch of reactions, i.e. the ones received in a burst, fetching
+     * every key only once.
+     * @param reactions The encrypted reactions.
+     * @return The decrypted reactions, in the same order, or null for the ones that could
+     * not be decrypted.
      */
-    virtual promise::Promise<std::shared_ptr<Buffer>> reactionDecrypt(const Message &msg,const std::string &reaction) = 0;
+    virtual promise::Promise<std::vector<std::shared_ptr<Buffer>>> reactionDecrypt(const std::vector<EncryptedReaction>& reactions) = 0;
+
+    /** @brief Accounts the memory used by the keys and caches of the crypto module */
+    virtual void addMemoryUsage(karere::MemoryReport& /*report*/) const {}
 
     /**
      * @brief The crypto module is destroyed when that chatid is left or the client is destroyed
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <algorithm>
 #include <buffer.h>
 #include <memory>
 #include "karereId.h"
@@ -535,35 +536,156 @@ public:
         Priv privilege = PRIV_INVALID;
     };
 
-    /** @brief Contains a UTF-8 string that represents the reaction
-     * and a vector of userid's associated to that reaction. */
-    struct Reaction
+    /** @brief Reactions to a message, in a compact form
+     *
+     * The UTF-8 strings of the reactions are stored back to back in a single buffer,
+     * NUL-separated, and every (reaction, userid) pair is an entry of a single vector
+     * that refers to the reaction by its position. Both keep the order in which the
+     * reactions and users were added.
+     */
+    class Reactions
     {
-        std::string mReaction;
-        std::vector<karere::Id> mUsers;
-
-        Reaction(std::string reaction)
+    public:
+        bool empty() const { return mUsers.empty(); }
+        void clear()
         {
-            mReaction = reaction;
+            mNames.clear();
+            mUsers.clear();
         }
 
-         /** @brief Returns the userId index in case that exists. Otherwise returns -1 **/
-        int userIndex(karere::Id userId) const
+        /** @brief Returns the position of the reaction in case that exists. Otherwise returns -1 **/
+        int indexOf(const std::string &reaction) const
         {
             int i = 0;
-            for (auto &it : mUsers)
+            size_t pos = 0;
+            while (pos < mNames.size())
             {
-                if (it == userId)
+                size_t end = mNames.find('\0', pos);
+                if (mNames.compare(pos, end - pos, reaction) == 0)
                 {
                     return i;
                 }
+                pos = end + 1;
                 i++;
             }
             return -1;
         }
-        bool hasReacted(karere::Id userId) const
+
+        std::vector<std::string> names() const
+        {
+            std::vector<std::string> names;
+            size_t pos = 0;
+            while (pos < mNames.size())
+            {
+                size_t end = mNames.find('\0', pos);
+                names.emplace_back(mNames, pos, end - pos);
+                pos = end + 1;
+            }
+            return names;
+        }
+
+        std::vector<karere::Id> users(const std::string &reaction) const
+        {
+            std::vector<karere::Id> users;
+            int index = indexOf(reaction);
+            for (auto &entry: mUsers)
+            {
+                if (entry.first == index)
+                {
+                    users.push_back(entry.second);
+                }
+            }
+            return users;
+        }
+
+        int count(const std::string &reaction) const
+        {
+            int index = indexOf(reaction);
+            int count = 0;
+            for (auto &entry: mUsers)
+            {
+                if (entry.first == index)
+                {
+                    count++;
+                }
+            }
+            return count;
+        }
+
+        bool hasReacted(const std::string &reaction, karere::Id userId) const
+        {
+            int index = indexOf(reaction);
+            return index >= 0 && find(index, userId) != mUsers.end();
+        }
+
+        void add(const std::string &reaction, karere::Id userId)
         {
-            return userIndex(userId) != -1;
+            int index = indexOf(reaction);
+            if (index < 0)
+            {
+                index = static_cast<int>(std::count(mNames.begin(), mNames.end(), '\0'));
+                mNames.append(reaction).push_back('\0');
+            }
+            else if (find(index, userId) != mUsers.end())
+            {
+                return;
+            }
+            mUsers.emplace_back(index, userId);
+        }
+
+        void del(const std::string &reaction, karere::Id userId)
+        {
+            int index = indexOf(reaction);
+            if (index < 0)
+            {
+                return;
+            }
+
+            auto it = find(index, userId);
+            if (it == mUsers.end())
+            {
+                return;
+            }
+            mUsers.erase(it);
+
+            for (auto &entry: mUsers)
+            {
+                if (entry.first == index)
+                {
+                    return; // other users keep the reaction
+                }
+            }
+
+            // nobody else reacted with it: remove the name and renumber the ones after it
+            size_t pos = 0;
+            for (int i = 0; i < index; i++)
+            {
+                pos = mNames.find('\0', pos) + 1;
+            }
+            mNames.erase(pos, mNames.find('\0', pos) + 1 - pos);
+            for (auto &entry: mUsers)
+            {
+                if (entry.first > index)
+                {
+                    entry.first--;
+                }
+            }
+        }
+
+        /** @brief Size in bytes of the heap buffers used by the reactions */
+        size_t heapSize() const
+        {
+            return mNames.capacity() + mUsers.capacity() * sizeof(UserList::value_type);
+        }
+
+    private:
+        typedef std::vector<std::pair<int, karere::Id>> UserList;
+        std::string mNames;
+        UserList mUsers;
+
+        UserList::const_iterator find(int index, karere::Id userId) const
+        {
+            return std::find(mUsers.begin(), mUsers.end(), std::make_pair(index, userId));
         }
     };
 
@@ -624,9 +746,8 @@ private:
     karere::Id mId;
     bool mIdIsXid = false;
 
-    /* Reactions must be ordered in the same order as they were added,
-    so we need a sequence container */
-    std::vector<Reaction> mReactions;
+    /* Reactions must be ordered in the same order as they were added */
+    Reactions mReactions;
 
 protected:
     uint8_t mIsEncrypted = kNotEncrypted;
@@ -786,66 +907,31 @@ public:
     /** @brief Returns a vector with all the reactions of the message **/
     std::vector<std::string> getReactions() const
     {
-        std::vector<std::string> reactions;
-        for (auto &it : mReactions)
-        {
-            reactions.push_back(it.mReaction);
-        }
-        return reactions;
+        return mReactions.names();
     }
 
     /** @brief Returns true if the user has reacted to this message with the specified reaction **/
-    bool hasReacted(std::string reaction, karere::Id uh) const
+    bool hasReacted(const std::string &reaction, karere::Id uh) const
     {
-        for (auto &it : mReactions)
-        {
-            if (it.mReaction == reaction)
-            {
-                return it.hasReacted(uh);
-            }
-        }
-        return false;
+        return mReactions.hasReacted(reaction, uh);
     }
 
     /** @brief Returns a vector with the userid's associated to an specific reaction **/
-    const std::vector<karere::Id>* getReactionUsers(std::string reaction) const
+    std::vector<karere::Id> getReactionUsers(const std::string &reaction) const
     {
-        for (auto &it : mReactions)
-        {
-            if (it.mReaction == reaction)
-            {
-                return &(it.mUsers);
-            }
-        }
-        return nullptr;
+        return mReactions.users(reaction);
     }
 
     /** @brief Returns the number of users for an specific reaction **/
     int getReactionCount(const std::string &reaction) const
     {
-        for (auto const &it : mReactions)
-        {
-            if (it.mReaction == reaction)
-            {
-                return static_cast<int>(it.mUsers.size());
-            }
-        }
-        return 0;
+        return mReactions.count(reaction);
     }
 
     /** @brief Returns the reaction index in case that exists. Otherwise returns -1 **/
     int getReactionIndex(const std::string &reaction) const
     {
-        int i = 0;
-        for (auto &it : mReactions)
-        {
-            if (it.mReaction == reaction)
-            {
-                return i;
-            }
-            i++;
-        }
-        return -1;
+        return mReactions.indexOf(reaction);
     }
 
     /** @brief Clean reactions */
@@ -858,45 +944,22 @@ public:
         return !mReactions.empty();
     }
 
+    /** @brief Approximate size in bytes of the message, including its heap buffers */
+    size_t memoryUsage() const
+    {
+        return sizeof(Message) + bufSize() + backRefs.capacity() * sizeof(BackRefId) + mReactions.heapSize();
+    }
+
     /** @brief Add a reaction for an specific userid **/
     void addReaction(const std::string &reaction, karere::Id userId)
     {
-        Reaction *r = NULL;
-        int reactIndex = getReactionIndex(reaction);
-        if (reactIndex >= 0)
-        {
-            r =  &mReactions.at(reactIndex);
-        }
-        else    // not found, add
-        {
-            mReactions.emplace_back(reaction);
-            r = &mReactions.back();
-        }
-
-        if (!r->hasReacted(userId))
-        {
-            r->mUsers.emplace_back(userId);
-        }
+        mReactions.add(reaction, userId);
     }
 
     /** @brief Delete a reaction for an specific userid **/
     void delReaction(const std::string &reaction, karere::Id userId)
     {
-        int reactIndex = getReactionIndex(reaction);
-        if (reactIndex >= 0)
-        {
-            Reaction &r = mReactions.at(reactIndex);
-
-            int userIndex = r.userIndex(userId);
-            if (userIndex >= 0)
-            {
-                r.mUsers.erase(r.mUsers.begin() + userIndex);
-                if (r.mUsers.empty())
-                {
-                    mReactions.erase(mReactions.begin() + reactIndex);
-                }
-            }
-        }
+        mReactions.del(reaction, userId);
     }
 
     /** @brief Throws an exception if this is not a management message. */
@@ -25,6 +25,7 @@ protected:
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    uint32_t mCommitCount = 0;
     inline int step(SqliteStmt& stmt);
     void beginTransaction()
     {
@@ -39,6 +40,7 @@ protected:
         simpleQuery("COMMIT TRANSACTION");
         mHasOpenTransaction = false;
         mLastCommitTs = time(NULL);
+        mCommitCount++;
         return true;
     }
 public:
@@ -65,6 +67,11 @@ public:
             return false;
         }
 
+        // in WAL mode readers on other connections (i.e. the history prefetcher) never block
+        // the commits of this connection, nor the other way around. Not supported by every
+        // kind of database (i.e. in-memory ones), in which case the default journal is kept
+        sqlite3_exec(mDb, "PRAGMA journal_mode = WAL", nullptr, nullptr, nullptr);
+
         mCommitEach = commitEach;
         if (!mCommitEach)
         {
@@ -73,6 +80,22 @@ public:
         }
         return true;
     }
+    /** @brief Opens a read-only connection, i.e. for reading from a different thread
+     * than the one that writes through the main connection */
+    bool openReadOnly(const char* fname)
+    {
+        assert(!mDb);
+        int ret = sqlite3_open_v2(fname, &mDb, SQLITE_OPEN_READONLY, nullptr);
+        if (!mDb)
+            return false;
+        if (ret != SQLITE_OK)
+        {
+            sqlite3_close(mDb);
+            mDb = nullptr;
+            return false;
+        }
+        return true;
+    }
     void close()
     {
         if (!mDb)
@@ -100,6 +123,12 @@ public:
         }
     }
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
+    bool commitEach() const { return mCommitEach; }
+    /** @brief Number of transactions committed so far. In commit-each mode, every write is committed right away */
+    uint32_t commitCount() const { return mCommitCount; }
+    /** @brief Time to wait for the locks held by other connections before failing with SQLITE_BUSY */
+    void setBusyTimeout(int ms) { sqlite3_busy_timeout(mDb, ms); }
+    const char* fileName() { return sqlite3_db_filename(mDb, "main"); }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
@@ -0,0 +1,215 @@
+#ifndef _FLATSET_H_INCLUDED_
+#define _FLATSET_H_INCLUDED_
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <utility>
+
+namespace karere
+{
+/** @brief Sorted-vector replacement for std::set
+ *
+ * Elements are kept ordered and unique in a single contiguous buffer, so
+ * lookups are a binary search, iteration is cache-friendly and copying the
+ * whole set is one allocation instead of one per node. Insertions and removals
+ * are O(n), which is cheap for the membership-sized sets it is intended for.
+ *
+ * @note Unlike std::set, inserting or erasing invalidates all iterators.
+ */
+template <class T, class Compare = std::less<T>>
+class FlatSet
+{
+protected:
+    typedef std::vector<T> Container;
+    Container mItems;
+
+    bool equivalent(const T& a, const T& b) const { return !Compare()(a, b) && !Compare()(b, a); }
+    void normalize()
+    {
+        if (!std::is_sorted(mItems.begin(), mItems.end(), Compare()))
+        {
+            std::sort(mItems.begin(), mItems.end(), Compare());
+        }
+        mItems.erase(std::unique(mItems.begin(), mItems.end(),
+            [this](const T& a, const T& b) { return equivalent(a, b); }), mItems.end());
+    }
+
+public:
+    typedef T key_type;
+    typedef T value_type;
+    typedef typename Container::size_type size_type;
+    // as with std::set, elements are not modifiable through iterators
+    typedef typename Container::const_iterator iterator;
+    typedef typename Container::const_iterator const_iterator;
+
+    FlatSet() {}
+    FlatSet(std::initializer_list<T> init): mItems(init) { normalize(); }
+    template <class It>
+    FlatSet(It first, It last): mItems(first, last) { normalize(); }
+
+    const_iterator begin() const { return mItems.begin(); }
+    const_iterator end() const { return mItems.end(); }
+    size_type size() const { return mItems.size(); }
+    bool empty() const { return mItems.empty(); }
+    void clear() { mItems.clear(); }
+    void reserve(size_type count) { mItems.reserve(count); }
+    void swap(FlatSet& other) { mItems.swap(other.mItems); }
+    /** The underlying sorted vector, i.e. to pass it to algorithms that need contiguous storage */
+    const Container& items() const { return mItems; }
+
+    const_iterator lower_bound(const T& val) const
+    {
+        return std::lower_bound(mItems.begin(), mItems.end(), val, Compare());
+    }
+    const_iterator find(const T& val) const
+    {
+        auto it = lower_bound(val);
+        return (it != mItems.end() && !Compare()(val, *it)) ? it : mItems.end();
+    }
+    size_type count(const T& val) const { return (find(val) != end()) ? 1 : 0; }
+    bool has(const T& val) const { return find(val) != end(); }
+
+    std::pair<iterator, bool> insert(const T& val)
+    {
+        auto it = lower_bound(val);
+        if (it != mItems.end() && !Compare()(val, *it))
+        {
+            return std::make_pair(it, false);
+        }
+        auto pos = mItems.begin() + (it - mItems.cbegin());
+        return std::make_pair(iterator(mItems.insert(pos, val)), true);
+    }
+    template <class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args)
+    {
+        return insert(T(std::forward<Args>(args)...));
+    }
+    template <class It>
+    void insert(It first, It last)
+    {
+        mItems.insert(mItems.end(), first, last);
+        normalize();
+    }
+    iterator erase(const_iterator pos)
+    {
+        return mItems.erase(mItems.begin() + (pos - mItems.cbegin()));
+    }
+    size_type erase(const T& val)
+    {
+        auto it = find(val);
+        if (it == end())
+        {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+    bool operator==(const FlatSet& other) const { return mItems == other.mItems; }
+    bool operator!=(const FlatSet& other) const { return mItems != other.mItems; }
+
+    /** Stores in \c result the elements of \c a that are not in \c b. Linear in a.size() + b.size() */
+    static void difference(const FlatSet& a, const FlatSet& b, FlatSet& result)
+    {
+        result.mItems.clear();
+        std::set_difference(a.mItems.begin(), a.mItems.end(), b.mItems.begin(), b.mItems.end(),
+                            std::back_inserter(result.mItems), Compare());
+    }
+    /** Stores in \c result the elements present in both \c a and \c b */
+    static void intersection(const FlatSet& a, const FlatSet& b, FlatSet& result)
+    {
+        result.mItems.clear();
+        std::set_intersection(a.mItems.begin(), a.mItems.end(), b.mItems.begin(), b.mItems.end(),
+                              std::back_inserter(result.mItems), Compare());
+    }
+};
+
+/** @brief Sorted-vector replacement for std::map, with the same tradeoffs as FlatSet
+ *
+ * @note Keys must not be modified through iterators, and inserting or erasing
+ * invalidates all iterators.
+ */
+template <class K, class V, class Compare = std::less<K>>
+class FlatMap
+{
+protected:
+    typedef std::vector<std::pair<K, V>> Container;
+    Container mItems;
+
+    struct KeyLess
+    {
+        bool operator()(const std::pair<K, V>& item, const K& key) const { return Compare()(item.first, key); }
+    };
+
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<K, V> value_type;
+    typedef typename Container::size_type size_type;
+    typedef typename Container::iterator iterator;
+    typedef typename Container::const_iterator const_iterator;
+
+    iterator begin() { return mItems.begin(); }
+    iterator end() { return mItems.end(); }
+    const_iterator begin() const { return mItems.begin(); }
+    const_iterator end() const { return mItems.end(); }
+    size_type size() const { return mItems.size(); }
+    bool empty() const { return mItems.empty(); }
+    void clear() { mItems.clear(); }
+    void reserve(size_type count) { mItems.reserve(count); }
+
+    iterator lower_bound(const K& key)
+    {
+        return std::lower_bound(mItems.begin(), mItems.end(), key, KeyLess());
+    }
+    const_iterator lower_bound(const K& key) const
+    {
+        return std::lower_bound(mItems.begin(), mItems.end(), key, KeyLess());
+    }
+    iterator find(const K& key)
+    {
+        auto it = lower_bound(key);
+        return (it != mItems.end() && !Compare()(key, it->first)) ? it : mItems.end();
+    }
+    const_iterator find(const K& key) const
+    {
+        auto it = lower_bound(key);
+        return (it != mItems.end() && !Compare()(key, it->first)) ? it : mItems.end();
+    }
+    size_type count(const K& key) const { return (find(key) != end()) ? 1 : 0; }
+
+    std::pair<iterator, bool> emplace(const K& key, V val)
+    {
+        auto it = lower_bound(key);
+        if (it != mItems.end() && !Compare()(key, it->first))
+        {
+            return std::make_pair(it, false);
+        }
+        return std::make_pair(mItems.emplace(it, key, std::move(val)), true);
+    }
+    std::pair<iterator, bool> insert(const value_type& item)
+    {
+        return emplace(item.first, item.second);
+    }
+    V& operator[](const K& key)
+    {
+        return emplace(key, V()).first->second;
+    }
+    iterator erase(iterator pos) { return mItems.erase(pos); }
+    size_type erase(const K& key)
+    {
+        auto it = find(key);
+        if (it == end())
+        {
+            return 0;
+        }
+        mItems.erase(it);
+        return 1;
+    }
+};
+}
+
+#endif
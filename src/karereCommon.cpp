@@ -3,6 +3,11 @@
 #include "base/timers.hpp"
 #include "megachatapi_impl.h"
 #include "waiter/libuvWaiter.h"
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <chrono>
+#include <algorithm>
+#include <vector>
 
 #ifndef KARERE_DISABLE_WEBRTC
 namespace rtcModule {void globalCleanup(); }
@@ -28,6 +33,397 @@ const char* gDbSchemaVersionSuffix = "9";
 
 bool gCatchException = true;
 
+MemoryReport::Usage MemoryReport::total() const
+{
+    Usage total;
+    for (auto& it: mUsages)
+    {
+        total.bytes += it.second.bytes;
+        total.count += it.second.count;
+    }
+    return total;
+}
+
+std::string MemoryReport::toJson() const
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    auto writeUsage = [&writer](const Usage& usage)
+    {
+        writer.StartObject();
+        writer.Key("bytes");
+        writer.Uint64(usage.bytes);
+        writer.Key("count");
+        writer.Uint64(usage.count);
+        writer.EndObject();
+    };
+
+    writer.StartObject();
+    writer.Key("total");
+    writeUsage(total());
+    writer.Key("tags");
+    writer.StartObject();
+    for (auto& it: mUsages)
+    {
+        writer.Key(it.first.c_str(), static_cast<rapidjson::SizeType>(it.first.size()));
+        writeUsage(it.second);
+    }
+    writer.EndObject();
+    writer.EndObject();
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+LoopProfiler gLoopProfiler;
+
+void LoopProfiler::Histogram::add(int64_t us)
+{
+    count++;
+    totalUs += us;
+    if (us > maxUs)
+    {
+        maxUs = us;
+    }
+
+    unsigned bucket = 0;
+    while (us > 0 && bucket < kNumBuckets - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    buckets[bucket]++;
+}
+
+int64_t LoopProfiler::Histogram::percentile(unsigned pct) const
+{
+    uint64_t target = (count * pct + 99) / 100;
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < kNumBuckets; i++)
+    {
+        sum += buckets[i];
+        if (sum >= target && sum)
+        {
+            return (i == kNumBuckets - 1) ? maxUs : (1LL << i);
+        }
+    }
+    return 0;
+}
+
+LoopProfiler::Scope::Scope(const char* category, const char* name, int64_t postTs)
+    : mCategory(category), mName(name), mPostTs(postTs),
+      mStart((name && gLoopProfiler.isEnabled()) ? LoopProfiler::now() : 0)
+{
+}
+
+LoopProfiler::Scope::~Scope()
+{
+    if (!mStart)
+    {
+        return;
+    }
+    int64_t end = LoopProfiler::now();
+    gLoopProfiler.record(mCategory, mName, mPostTs ? (mStart - mPostTs) : -1, end - mStart);
+}
+
+int64_t LoopProfiler::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string LoopProfiler::callSiteName(const char* signature)
+{
+    // GCC/Clang: "... [with F = <type>]" or "... [F = <type>]", or several
+    // template arguments separated by ';' or ','. Keep only the callback type
+    std::string sig(signature);
+    size_t pos = sig.find("F = ");
+    if (pos == std::string::npos)
+    {
+        pos = sig.find("CB = ");
+        if (pos == std::string::npos)
+        {
+            return sig;
+        }
+        pos++;
+    }
+    pos += 4;
+
+    int depth = 0;
+    size_t end = pos;
+    for (; end < sig.size(); end++)
+    {
+        char c = sig[end];
+        if (c == '(' || c == '<' || c == '[' || c == '{')
+        {
+            depth++;
+        }
+        else if (c == ')' || c == '>' || c == '}' || (c == ']' && depth))
+        {
+            depth--;
+        }
+        else if (!depth && (c == ']' || c == ';' || c == ','))
+        {
+            break;
+        }
+    }
+    return sig.substr(pos, end - pos);
+}
+
+void LoopProfiler::setEnabled(bool enabled, int64_t slowThresholdUs, int64_t dumpIntervalSec)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (enabled)
+    {
+        mEntries.clear();
+        mSlowThresholdUs = slowThresholdUs;
+        mDumpIntervalUs = dumpIntervalSec * 1000000;
+        mLastDumpTs = now();
+    }
+    mEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+void LoopProfiler::record(const char* category, const char* name, int64_t queueUs, int64_t execUs)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!isEnabled())
+    {
+        return; // disabled meanwhile
+    }
+
+    auto key = std::make_pair(category, name);
+    auto it = mEntries.find(key);
+    if (it == mEntries.end())
+    {
+        Entry entry;
+        entry.category = category;
+        entry.name = callSiteName(name);
+        it = mEntries.emplace(key, std::move(entry)).first;
+    }
+    Entry& entry = it->second;
+    if (queueUs >= 0)
+    {
+        entry.queue.add(queueUs);
+    }
+    entry.exec.add(execUs);
+
+    if (mSlowThresholdUs && execUs >= mSlowThresholdUs)
+    {
+        KR_LOG_WARNING("Slow %s callback %s: took %lld us (queued for %lld us)", category,
+                       entry.name.c_str(), (long long)execUs, (long long)queueUs);
+    }
+
+    int64_t ts = now();
+    if (mDumpIntervalUs && (ts - mLastDumpTs) >= mDumpIntervalUs)
+    {
+        mLastDumpTs = ts;
+        dump();
+    }
+}
+
+void LoopProfiler::dump() const
+{
+    // the callbacks that took more time in total, which are the ones to look at first
+    std::vector<const Entry*> entries;
+    entries.reserve(mEntries.size());
+    for (auto& it: mEntries)
+    {
+        entries.push_back(&it.second);
+    }
+    size_t count = std::min<size_t>(entries.size(), 20);
+    std::partial_sort(entries.begin(), entries.begin() + count, entries.end(), [](const Entry* a, const Entry* b)
+    {
+        return a->exec.totalUs > b->exec.totalUs;
+    });
+
+    KR_LOG_INFO("Event loop profile, %zu callbacks (top %zu by total execution time):", entries.size(), count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const Entry& entry = *entries[i];
+        KR_LOG_INFO("  %s %s: n=%llu total=%lldus p50=%lldus p99=%lldus max=%lldus queue-p99=%lldus",
+                    entry.category, entry.name.c_str(), (unsigned long long)entry.exec.count,
+                    (long long)entry.exec.totalUs, (long long)entry.exec.percentile(50),
+                    (long long)entry.exec.percentile(99), (long long)entry.exec.maxUs,
+                    (long long)entry.queue.percentile(99));
+    }
+}
+
+std::string LoopProfiler::toJson() const
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    auto writeHistogram = [&writer](const Histogram& histogram)
+    {
+        writer.StartObject();
+        writer.Key("count");
+        writer.Uint64(histogram.count);
+        writer.Key("totalUs");
+        writer.Int64(histogram.totalUs);
+        writer.Key("maxUs");
+        writer.Int64(histogram.maxUs);
+        writer.Key("p50Us");
+        writer.Int64(histogram.percentile(50));
+        writer.Key("p99Us");
+        writer.Int64(histogram.percentile(99));
+        writer.Key("buckets");
+        writer.StartArray();
+        for (unsigned i = 0; i < kNumBuckets; i++)
+        {
+            writer.Uint64(histogram.buckets[i]);
+        }
+        writer.EndArray();
+        writer.EndObject();
+    };
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    writer.StartObject();
+    writer.Key("enabled");
+    writer.Bool(isEnabled());
+    writer.Key("slowThresholdUs");
+    writer.Int64(mSlowThresholdUs);
+    writer.Key("entries");
+    writer.StartArray();
+    for (auto& it: mEntries)
+    {
+        const Entry& entry = it.second;
+        writer.StartObject();
+        writer.Key("category");
+        writer.String(entry.category);
+        writer.Key("name");
+        writer.String(entry.name.c_str(), static_cast<rapidjson::SizeType>(entry.name.size()));
+        writer.Key("queue");
+        writeHistogram(entry.queue);
+        writer.Key("exec");
+        writeHistogram(entry.exec);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+void Metrics::add(const std::string& name, Type type, const char* help, const Labels& labels, uint64_t value)
+{
+    auto it = mFamilies.find(name);
+    if (it == mFamilies.end())
+    {
+        Family family;
+        family.type = type;
+        family.help = help;
+        it = mFamilies.emplace(name, std::move(family)).first;
+    }
+    assert(it->second.type == type);
+    it->second.samples.push_back(Sample{labels, value});
+}
+
+std::string Metrics::toJson() const
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    for (auto& it: mFamilies)
+    {
+        const Family& family = it.second;
+        writer.Key(it.first.c_str(), static_cast<rapidjson::SizeType>(it.first.size()));
+        writer.StartObject();
+        writer.Key("type");
+        writer.String((family.type == kCounter) ? "counter" : "gauge");
+        writer.Key("help");
+        writer.String(family.help.c_str(), static_cast<rapidjson::SizeType>(family.help.size()));
+        writer.Key("samples");
+        writer.StartArray();
+        for (auto& sample: family.samples)
+        {
+            writer.StartObject();
+            writer.Key("labels");
+            writer.StartObject();
+            for (auto& label: sample.labels)
+            {
+                writer.Key(label.first.c_str(), static_cast<rapidjson::SizeType>(label.first.size()));
+                writer.String(label.second.c_str(), static_cast<rapidjson::SizeType>(label.second.size()));
+            }
+            writer.EndObject();
+            writer.Key("value");
+            writer.Uint64(sample.value);
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndObject();
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+std::string Metrics::toPrometheus() const
+{
+    std::string out;
+    for (auto& it: mFamilies)
+    {
+        const Family& family = it.second;
+        out.append("# HELP ").append(it.first).append(" ").append(family.help).append("\n");
+        out.append("# TYPE ").append(it.first).append((family.type == kCounter) ? " counter\n" : " gauge\n");
+        for (auto& sample: family.samples)
+        {
+            out.append(it.first);
+            if (!sample.labels.empty())
+            {
+                out.append("{");
+                for (size_t i = 0; i < sample.labels.size(); i++)
+                {
+                    if (i)
+                    {
+                        out.append(",");
+                    }
+                    out.append(sample.labels[i].first).append("=\"");
+                    for (char c: sample.labels[i].second)
+                    {
+                        switch (c)
+                        {
+                            case '\\': out.append("\\\\"); break;
+                            case '"': out.append("\\\""); break;
+                            case '\n': out.append("\\n"); break;
+                            default: out.push_back(c); break;
+                        }
+                    }
+                    out.append("\"");
+                }
+                out.append("}");
+            }
+            out.append(" ").append(std::to_string(sample.value)).append("\n");
+        }
+    }
+    return out;
+}
+
+void TrafficStats::addMetrics(Metrics& metrics, const std::string& prefix, const Metrics::Labels& labels,
+                              const WebsocketsStats& ws, const char* (*opcodeToStr)(uint8_t)) const
+{
+    metrics.add(prefix + "_received_bytes_total", Metrics::kCounter, "Payload bytes received", labels, ws.payloadBytesReceived);
+    metrics.add(prefix + "_sent_bytes_total", Metrics::kCounter, "Payload bytes sent", labels, ws.payloadBytesSent);
+    metrics.add(prefix + "_wire_received_bytes_total", Metrics::kCounter, "Bytes received through the socket, after compression and TLS", labels, ws.wireBytesReceived);
+    metrics.add(prefix + "_wire_sent_bytes_total", Metrics::kCounter, "Bytes sent through the socket, after compression and TLS", labels, ws.wireBytesSent);
+    metrics.add(prefix + "_recv_buffer_bytes", Metrics::kGauge, "Memory held to reassemble received messages", labels, ws.recvBufferBytes);
+    metrics.add(prefix + "_received_frames_total", Metrics::kCounter, "Websocket frames received", labels, framesIn.get());
+    metrics.add(prefix + "_parse_errors_total", Metrics::kCounter, "Received frames that could not be parsed", labels, parseErrors.get());
+    for (unsigned opcode = 0; opcode < kNumOpcodes; opcode++)
+    {
+        uint64_t in = commandsIn[opcode].get();
+        uint64_t out = framesOut[opcode].get();
+        if (!in && !out)
+        {
+            continue;
+        }
+        Metrics::Labels opcodeLabels(labels);
+        opcodeLabels.emplace_back("opcode", opcodeToStr(static_cast<uint8_t>(opcode)));
+        if (in)
+        {
+            metrics.add(prefix + "_received_commands_total", Metrics::kCounter, "Commands received, by opcode", opcodeLabels, in);
+        }
+        if (out)
+        {
+            metrics.add(prefix + "_sent_frames_total", Metrics::kCounter, "Websocket frames sent, by the opcode of their first command", opcodeLabels, out);
+        }
+    }
+}
+
 void globalInit(void(*postFunc)(void*, void*), uint32_t options, const char* logPath, size_t logSize)
 {
     if (logPath)
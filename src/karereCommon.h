@@ -2,6 +2,10 @@
 #define KARERECOMMON_H
 
 #include <string>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <mutex>
 #include <logger.h>
 #include <cservices.h> //needed for timestampMs()
 #include <string.h>
@@ -81,6 +85,8 @@ static inline string to_string(const T& t)
 
 /** @endcond PRIVATE */
 
+struct WebsocketsStats;
+
 namespace karere
 {
 class Client;
@@ -172,6 +178,226 @@ extern bool gCatchException;
 
 static inline int64_t timestampMs() { return services_get_time_ms(); }
 
+/** @brief Memory used by the different subsystems of karere, by tag (i.e. "chatd.history")
+ *
+ * It is filled on demand by walking the containers of each subsystem, so it has no
+ * cost unless a report is requested. Sizes are estimations: they include the elements
+ * and their heap buffers, plus a fixed overhead per node of node-based containers, but
+ * not the overhead of the allocator itself.
+ */
+class MemoryReport
+{
+public:
+    struct Usage
+    {
+        size_t bytes = 0;
+        size_t count = 0;
+    };
+    /** Approximate size of the node of a std::map, std::set or std::list, besides the element */
+    enum: size_t { kNodeOverhead = 4 * sizeof(void*) };
+
+    void add(const std::string& tag, size_t bytes, size_t count)
+    {
+        Usage& usage = mUsages[tag];
+        usage.bytes += bytes;
+        usage.count += count;
+    }
+    /** Accounts the nodes of a std::map, std::set or their unordered versions, whose elements have no heap buffers */
+    template <class C>
+    void addNodes(const std::string& tag, const C& container)
+    {
+        add(tag, container.size() * (sizeof(typename C::value_type) + kNodeOverhead), container.size());
+    }
+    const std::map<std::string, Usage>& usages() const { return mUsages; }
+    Usage total() const;
+    /** Returns a JSON object like {"total":{"bytes":N,"count":N},"tags":{"<tag>":{"bytes":N,"count":N},...}} */
+    std::string toJson() const;
+
+protected:
+    std::map<std::string, Usage> mUsages;
+};
+
+/** @brief Optional profiler of the work done by the karere thread
+ *
+ * When enabled, it records the queueing delay (since the call was posted) and the
+ * execution time of marshalled calls and timers, by call site, and the execution
+ * time of commands received from chatd and presenced, by opcode. Durations are kept
+ * in histograms of power-of-two buckets of microseconds. Callbacks slower than a
+ * threshold are logged right away, and a summary is logged periodically.
+ * When disabled, it only costs an atomic load per callback.
+ */
+class LoopProfiler
+{
+public:
+    /** Bucket 0 counts durations below 1us and bucket i, durations in [2^(i-1), 2^i) us.
+     * The last bucket also counts any longer duration */
+    enum { kNumBuckets = 26 };
+    enum: int64_t { kDefaultSlowThresholdUs = 50000, kDefaultDumpIntervalSec = 300 };
+
+    struct Histogram
+    {
+        uint64_t count = 0;
+        int64_t totalUs = 0;
+        int64_t maxUs = 0;
+        uint64_t buckets[kNumBuckets] = {};
+        void add(int64_t us);
+        /** Upper bound of the bucket where the percentile \c pct (0-100) falls */
+        int64_t percentile(unsigned pct) const;
+    };
+
+    /** @brief Records the execution time of a block, from construction to destruction */
+    class Scope
+    {
+    public:
+        /** @param name Must outlive the profiler (i.e. a literal). Nothing is recorded if it is NULL
+         * @param postTs When the callback was posted (as returned by now()), or 0 if unknown */
+        Scope(const char* category, const char* name, int64_t postTs = 0);
+        ~Scope();
+    protected:
+        const char* mCategory;
+        const char* mName;
+        int64_t mPostTs;
+        int64_t mStart;
+    };
+
+    /** Monotonic time in microseconds */
+    static int64_t now();
+    /** Call sites of marshalled calls and timers are identified by the signature of a
+     * function instantiated for each callback type (the compiler's pretty-function) */
+    static std::string callSiteName(const char* signature);
+
+    bool isEnabled() const { return mEnabled.load(std::memory_order_relaxed); }
+    /** Enables or disables the profiler. Enabling it clears the stats recorded so far.
+     * A \c slowThresholdUs or \c dumpIntervalSec of 0 disables the respective log */
+    void setEnabled(bool enabled, int64_t slowThresholdUs = kDefaultSlowThresholdUs,
+                    int64_t dumpIntervalSec = kDefaultDumpIntervalSec);
+    /** @param queueUs Time since the callback was posted, or -1 if unknown */
+    void record(const char* category, const char* name, int64_t queueUs, int64_t execUs);
+    std::string toJson() const;
+
+protected:
+    struct Entry
+    {
+        const char* category;
+        std::string name;
+        Histogram queue;
+        Histogram exec;
+    };
+    std::atomic<bool> mEnabled{false};
+    mutable std::mutex mMutex;
+    // keyed by category and name pointers: names are string literals or pretty-functions
+    std::map<std::pair<const char*, const char*>, Entry> mEntries;
+    int64_t mSlowThresholdUs = kDefaultSlowThresholdUs;
+    int64_t mDumpIntervalUs = kDefaultDumpIntervalSec * 1000000;
+    int64_t mLastDumpTs = 0;
+    void dump() const;
+};
+
+extern LoopProfiler gLoopProfiler;
+
+#if defined(_MSC_VER)
+    #define KR_FUNCTION_SIGNATURE __FUNCSIG__
+#else
+    #define KR_FUNCTION_SIGNATURE __PRETTY_FUNCTION__
+#endif
+
+/** @brief Snapshot of the metrics of the subsystems, as families of samples that share
+ * a name, like the metrics exposed to Prometheus
+ */
+class Metrics
+{
+public:
+    enum Type { kCounter, kGauge };
+    typedef std::vector<std::pair<std::string, std::string>> Labels;
+    struct Sample
+    {
+        Labels labels;
+        uint64_t value;
+    };
+    struct Family
+    {
+        Type type;
+        std::string help;
+        std::vector<Sample> samples;
+    };
+
+    /** Adds a sample to the family \c name, which is created by the first sample */
+    void add(const std::string& name, Type type, const char* help, const Labels& labels, uint64_t value);
+    const std::map<std::string, Family>& families() const { return mFamilies; }
+    /** {"<name>":{"type":"counter","help":"...","samples":[{"labels":{...},"value":N},...]},...} */
+    std::string toJson() const;
+    /** Prometheus text exposition format */
+    std::string toPrometheus() const;
+
+protected:
+    std::map<std::string, Family> mFamilies;
+};
+
+/** @brief Counter written only by the karere thread and readable from any thread.
+ * Having a single writer, it doesn't need an atomic read-modify-write */
+class Counter
+{
+public:
+    void add(uint64_t value = 1)
+    {
+        mValue.store(mValue.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    void setMax(uint64_t value)
+    {
+        if (value > get())
+        {
+            mValue.store(value, std::memory_order_relaxed);
+        }
+    }
+    uint64_t get() const { return mValue.load(std::memory_order_relaxed); }
+
+protected:
+    std::atomic<uint64_t> mValue{0};
+};
+
+/** @brief Count, total and max of the durations of an operation, in microseconds */
+struct LatencyStats
+{
+    Counter count;
+    Counter totalUs;
+    Counter maxUs;
+    void add(int64_t us)
+    {
+        count.add();
+        totalUs.add(us);
+        maxUs.setMax(us);
+    }
+};
+
+/** @brief Commands and frames of a connection to chatd or presenced. The bytes are
+ * counted by the websockets layer (see WebsocketsStats) */
+struct TrafficStats
+{
+    enum { kNumOpcodes = 256 };
+    Counter framesIn;
+    Counter parseErrors;
+    Counter commandsIn[kNumOpcodes];
+    /** Outgoing frames by the opcode of their first command. Frames may carry several
+     * commands, but only the receiving side parses them */
+    Counter framesOut[kNumOpcodes];
+
+    void frameIn()
+    {
+        framesIn.add();
+    }
+    void frameOut(const char* data, size_t len)
+    {
+        if (len)
+        {
+            framesOut[static_cast<uint8_t>(data[0])].add();
+        }
+    }
+    /** Adds the counters and the websocket stats of the connection to \c metrics, as
+     * families \c <prefix>_xxx */
+    void addMetrics(Metrics& metrics, const std::string& prefix, const Metrics::Labels& labels,
+                    const WebsocketsStats& ws, const char* (*opcodeToStr)(uint8_t)) const;
+};
+
 //logging stuff
 
 #define KR_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_default, fmtString, ##__VA_ARGS__)
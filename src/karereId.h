@@ -6,6 +6,7 @@
 #include <set>
 #include "base64url.h"
 #include <buffer.h>
+#include "flatSet.h"
 
 namespace karere
 {
@@ -18,20 +19,41 @@ public:
     };
 
     uint64_t val;
-    std::string toString(size_t len = sizeof(uint64_t)) const { return base64urlencode(&val, len); }
+    /** Encoded in a stack buffer, and short enough for the small-string optimization of std::string */
+    std::string toString(size_t len = sizeof(uint64_t)) const
+    {
+        assert(len <= sizeof(uint64_t));
+        char buf[base64urlEncodedSize(sizeof(uint64_t))];
+        size_t encodedLen = (len == sizeof(uint64_t)) ? base64urlencodeFixed<sizeof(uint64_t)>(&val, buf)
+                          : (len == CHATLINKHANDLE) ? base64urlencodeFixed<CHATLINKHANDLE>(&val, buf)
+                          : base64urlencode(&val, len, buf);
+        return std::string(buf, encodedLen);
+    }
     bool isValid() const { return val != inval(); }
     bool isNull() const { return val == null(); }
-    Id(const uint64_t& from=0): val(from){}
-    explicit Id(const char* b64, size_t b64len=0) { base64urldecode(b64, b64len ? b64len : strlen(b64), &val, sizeof(val)); }
+    constexpr Id(const uint64_t& from=0): val(from){}
+    explicit Id(const char* b64, size_t b64len=0): val(0)
+    {
+        if (!b64len)
+        {
+            b64len = strlen(b64);
+        }
+        // the generic decoder handles other sizes and reports invalid chars
+        if (b64len != base64urlEncodedSize(sizeof(val)) || !base64urldecodeFixed<sizeof(uint64_t)>(b64, &val))
+        {
+            base64urldecode(b64, b64len, &val, sizeof(val));
+        }
+    }
     bool operator==(const Id& other) const { return val == other.val; }
     bool operator==(const uint64_t& aVal) const { return val == aVal; }
     Id& operator=(const Id& other) { val = other.val; return *this; }
     Id& operator=(const uint64_t& aVal) { val = aVal; return *this; }
     operator const uint64_t&() const { return val; }
     bool operator<(const Id& other) const { return val < other.val; }
-    static const Id null() { return static_cast<uint64_t>(0); }
-    static const Id inval() { return ~((uint64_t)0); }
-    static const Id COMMANDER() { return Id("gTxFhlOd_LQ"); }
+    static constexpr Id null() { return Id(static_cast<uint64_t>(0)); }
+    static constexpr Id inval() { return Id(~((uint64_t)0)); }
+    /** Decoded at compile time from "gTxFhlOd_LQ" */
+    static constexpr Id COMMANDER() { return Id(base64urlConstId("gTxFhlOd_LQ")); }
     /** Comparison at byte level, necessary to compatibility with the webClient (javascript)*/
     static bool greaterThanForJs(const Id &first, const Id &second)
     {
@@ -53,29 +75,40 @@ static inline std::string& operator+(std::string&& str, const Id& id)
     return str;
 }
 
-struct SetOfIds: public std::set<karere::Id>
+struct SetOfIds: public FlatSet<karere::Id>
 {
-    typedef std::set<karere::Id> Base;
+    typedef FlatSet<karere::Id> Base;
     template <class T>
     SetOfIds(const T& src) { load(src); }
     SetOfIds(){}
+    SetOfIds(std::initializer_list<karere::Id> init): Base(init) {}
     SetOfIds(Base&& other): Base(std::move(other)){}
-    void save(Buffer& buf)
+    void save(Buffer& buf) const
     {
-        for (auto id: *this)
-            buf.append(id.val);
+        if (!empty())
+        {
+            buf.append(mItems.data(), mItems.size() * sizeof(uint64_t));
+        }
     }
     void load(const Buffer& buf)
     {
         assert(buf.dataSize() % 8 == 0);
         clear();
+        reserve(buf.dataSize() / sizeof(uint64_t));
         const char* last = buf.buf() + buf.dataSize();
         for (const char* pos = buf.buf(); pos < last; pos += sizeof(uint64_t))
         {
-            emplace(Buffer::alignSafeRead<uint64_t>(pos));
+            mItems.emplace_back(Buffer::alignSafeRead<uint64_t>(pos));
         }
+        normalize(); // saved sets are already sorted, so this is usually a linear check
+    }
+    /** Returns the ids in \c a that are not in \c b */
+    static SetOfIds difference(const SetOfIds& a, const SetOfIds& b)
+    {
+        SetOfIds result;
+        Base::difference(a, b, result);
+        return result;
     }
-    bool has(Id id) { return find(id) != end(); }
 };
 }
 
@@ -272,6 +272,11 @@ void MegaChatApi::setLogToConsole(bool enable)
     MegaChatApiImpl::setLogToConsole(enable);
 }
 
+void MegaChatApi::setWebsocketsCompression(bool enable)
+{
+    MegaChatApiImpl::setWebsocketsCompression(enable);
+}
+
 int MegaChatApi::init(const char *sid)
 {
     return pImpl->init(sid);
@@ -497,6 +502,16 @@ int MegaChatApi::getUnreadChats()
     return pImpl->getUnreadChats();
 }
 
+int64_t MegaChatApi::getChatListVersion()
+{
+    return pImpl->getChatListVersion();
+}
+
+MegaChatListItemList *MegaChatApi::getChatListItemsSince(int64_t version)
+{
+    return pImpl->getChatListItemsSince(version);
+}
+
 MegaChatListItemList *MegaChatApi::getActiveChatListItems()
 {
     return pImpl->getActiveChatListItems();
@@ -642,6 +657,41 @@ bool MegaChatApi::isFullHistoryLoaded(MegaChatHandle chatid)
     return pImpl->isFullHistoryLoaded(chatid);
 }
 
+void MegaChatApi::setResidentHistoryLimits(unsigned int maxPerChat, unsigned int maxTotal)
+{
+    pImpl->setResidentHistoryLimits(maxPerChat, maxTotal);
+}
+
+int MegaChatApi::getResidentMessageCount(MegaChatHandle chatid)
+{
+    return pImpl->getResidentMessageCount(chatid);
+}
+
+int MegaChatApi::getTotalResidentMessageCount()
+{
+    return pImpl->getTotalResidentMessageCount();
+}
+
+char *MegaChatApi::getMemoryReport()
+{
+    return pImpl->getMemoryReport();
+}
+
+void MegaChatApi::setLoopProfilerEnabled(bool enable, int slowThresholdMs, int dumpIntervalSec)
+{
+    pImpl->setLoopProfilerEnabled(enable, slowThresholdMs, dumpIntervalSec);
+}
+
+char *MegaChatApi::getLoopProfile()
+{
+    return pImpl->getLoopProfile();
+}
+
+char *MegaChatApi::getNetworkMetrics(int format)
+{
+    return pImpl->getNetworkMetrics(format);
+}
+
 MegaChatMessage *MegaChatApi::getMessage(MegaChatHandle chatid, MegaChatHandle msgid)
 {
     return pImpl->getMessage(chatid, msgid);
@@ -929,6 +979,16 @@ void MegaChatApi::removeChatRemoteVideoListener(MegaChatHandle chatid, MegaChatH
     pImpl->removeChatVideoListener(chatid, peerid, clientid, listener);
 }
 
+bool MegaChatApi::retainVideoBuffer(char *buffer)
+{
+    return pImpl->retainVideoBuffer(buffer);
+}
+
+void MegaChatApi::releaseVideoBuffer(char *buffer)
+{
+    pImpl->releaseVideoBuffer(buffer);
+}
+
 #endif
 
 void MegaChatApi::setCatchException(bool enable)
@@ -1364,6 +1424,18 @@ void MegaChatVideoListener::onChatVideoData(MegaChatApi * /*api*/, MegaChatHandl
 
 }
 
+int MegaChatVideoListener::getVideoFormat()
+{
+    return VIDEO_FORMAT_ARGB;
+}
+
+void MegaChatVideoListener::onChatVideoDataI420(MegaChatApi * /*api*/, MegaChatHandle /*chatid*/, int /*width*/, int /*height*/,
+                                                const char * /*dataY*/, int /*strideY*/, const char * /*dataU*/, int /*strideU*/,
+                                                const char * /*dataV*/, int /*strideV*/)
+{
+
+}
+
 
 void MegaChatCallListener::onChatCallUpdate(MegaChatApi * /*api*/, MegaChatCall * /*call*/)
 {
@@ -611,6 +611,12 @@ public:
 class MegaChatVideoListener
 {
 public:
+    enum
+    {
+        VIDEO_FORMAT_ARGB = 0,  /// Frames are received at MegaChatVideoListener::onChatVideoData
+        VIDEO_FORMAT_I420 = 1   /// Frames are received at MegaChatVideoListener::onChatVideoDataI420
+    };
+
     virtual ~MegaChatVideoListener() {}
 
     /**
@@ -623,9 +629,46 @@ public:
      * @param buffer Data buffer in format ARGB: 4 bytes per pixel (total size: width * height * 4)
      * @param size Buffer size in bytes
      *
-     *  The MegaChatVideoListener retains the ownership of the buffer.
+     *  The MegaChatVideoListener retains the ownership of the buffer, which is only valid
+     *  until this function returns (see MegaChatApi::retainVideoBuffer).
      */
     virtual void onChatVideoData(MegaChatApi *api, MegaChatHandle chatid, int width, int height, char *buffer, size_t size);
+
+    /**
+     * @brief Returns the format in which this listener wants to receive the frames
+     *
+     * Frames are decoded in I420 (planar YUV 4:2:0). Listeners that can render that format
+     * directly (ie. uploading YUV textures to the GPU) should return VIDEO_FORMAT_I420,
+     * which avoids the conversion to ARGB of every frame.
+     *
+     * The frames of a stream are only delivered in I420 if all its listeners accept it.
+     * Otherwise, all of them receive ARGB frames at MegaChatVideoListener::onChatVideoData.
+     *
+     * @return VIDEO_FORMAT_ARGB (default) or VIDEO_FORMAT_I420
+     */
+    virtual int getVideoFormat();
+
+    /**
+     * @brief This function is called when a new image is available, if all the listeners
+     * of the stream return VIDEO_FORMAT_I420 at MegaChatVideoListener::getVideoFormat
+     *
+     * The U and V planes have (width + 1) / 2 columns and (height + 1) / 2 rows.
+     * The SDK retains the ownership of the planes, which are only valid until this function returns.
+     *
+     * @param api MegaChatApi connected to the account
+     * @param chatid MegaChatHandle that provides the video
+     * @param width Size in pixels
+     * @param height Size in pixels
+     * @param dataY Luma plane
+     * @param strideY Size in bytes of a row of the luma plane
+     * @param dataU Chroma-blue plane
+     * @param strideU Size in bytes of a row of the chroma-blue plane
+     * @param dataV Chroma-red plane
+     * @param strideV Size in bytes of a row of the chroma-red plane
+     */
+    virtual void onChatVideoDataI420(MegaChatApi *api, MegaChatHandle chatid, int width, int height,
+                                     const char *dataY, int strideY, const char *dataU, int strideU,
+                                     const char *dataV, int strideV);
 };
 
 /**
@@ -2103,6 +2146,12 @@ public:
         CHAT_CONNECTION_ONLINE      = 3     /// Connection with chatd is ready and logged in
     };
 
+    enum
+    {
+        METRICS_FORMAT_JSON         = 0,    /// JSON object with one entry per metric
+        METRICS_FORMAT_PROMETHEUS   = 1     /// Prometheus text exposition format
+    };
+
 
     // chat will reuse an existent megaApi instance (ie. the one for cloud storage)
     /**
@@ -2170,6 +2219,21 @@ public:
      */
     static void setLogToConsole(bool enable);
 
+    /**
+     * @brief Enable the compression of the connections to chatd and presenced
+     *
+     * When enabled, the connections offer the permessage-deflate extension to the servers,
+     * which reduces the traffic, mainly when loading history, at the cost of some memory
+     * and CPU for each connection.
+     *
+     * By default, compression is enabled.
+     *
+     * @note It only applies to the instances of MegaChatApi created after this call
+     *
+     * @param enable True to enable it, false to disable.
+     */
+    static void setWebsocketsCompression(bool enable);
+
     /**
      * @brief Initializes karere
      *
@@ -2923,6 +2987,32 @@ public:
      */
     int getUnreadChats();
 
+    /**
+     * @brief Return the current version of the list of chatrooms
+     *
+     * The version is increased every time any chatroom in the list changes (or
+     * chatrooms are added or removed). Apps can keep the value returned by this
+     * function and later call MegaChatApi::getChatListItemsSince to get only the
+     * chatrooms that changed in the meantime, instead of reloading the whole list.
+     *
+     * @return The current version of the list of chatrooms
+     */
+    int64_t getChatListVersion();
+
+    /**
+     * @brief Return the chatrooms that have changed after the specified version
+     *
+     * Chatrooms removed from the list after \c version are not included. Use
+     * MegaChatApi::getChatListItems to get the full list. Archived chatrooms are
+     * included, so apps can check MegaChatListItem::isArchived.
+     *
+     * You take the ownership of the returned value
+     *
+     * @param version Version previously returned by MegaChatApi::getChatListVersion
+     * @return List of MegaChatListItem objects updated after \c version
+     */
+    MegaChatListItemList *getChatListItemsSince(int64_t version);
+
     /**
      * @brief Return the chatrooms that are currently active
      *
@@ -3583,12 +3673,136 @@ public:
      */
     bool isFullHistoryLoaded(MegaChatHandle chatid);
 
+    /**
+     * @brief Sets the limits of messages kept in memory
+     *
+     * In long-running sessions, the history loaded by MegaChatApi::loadMessages and the
+     * messages received for every chatroom are kept in memory. When any of these limits
+     * is exceeded, the oldest messages of the chatrooms that are not opened are removed
+     * from memory, starting by the chatrooms that were opened longer ago. They are still
+     * in the local cache and are loaded again by MegaChatApi::loadMessages.
+     *
+     * Messages of opened chatrooms are never removed, so the total may exceed the limit.
+     * By default there is no limit. Note that MegaChatApi::getMessage returns NULL for
+     * the messages removed from memory until they are loaded again.
+     *
+     * @note This function has no effect if called before MegaChatApi::init
+     *
+     * @param maxPerChat Max number of messages kept in memory for each chatroom, or 0 for no limit
+     * @param maxTotal Max number of messages kept in memory for all the chatrooms, or 0 for no limit
+     */
+    void setResidentHistoryLimits(unsigned int maxPerChat, unsigned int maxTotal);
+
+    /**
+     * @brief Returns the number of messages of a chatroom currently kept in memory
+     *
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @return The number of messages in memory, or -1 if the chatroom is not found
+     */
+    int getResidentMessageCount(MegaChatHandle chatid);
+
+    /**
+     * @brief Returns the number of messages of all the chatrooms currently kept in memory
+     *
+     * @return The number of messages in memory
+     */
+    int getTotalResidentMessageCount();
+
+    /**
+     * @brief Returns a report of the memory used by MEGAchat, by subsystem
+     *
+     * The report is a JSON object with the total and one entry per tag. Tags identify
+     * the containers of each subsystem, like "chatd.history" (messages in memory of all
+     * the chatrooms), "chatd.sending", "strongvelope.keys", "userAttrCache.items" or
+     * "presenced.peers". The buffers that reassemble the messages received through the
+     * connections are "chatd.recvBuffers" and "presenced.recvBuffer". For example:
+     *  {"total":{"bytes":1096,"count":12},"tags":{"chatd.history":{"bytes":1000,"count":10},...}}
+     *
+     * Sizes are estimations of the memory used by the elements of each container and
+     * their buffers. The report is generated on demand, walking the containers, so
+     * calling this function has some cost when there are many chatrooms.
+     *
+     * You take the ownership of the returned value
+     *
+     * @return The memory report, or NULL if MegaChatApi::init has not been called
+     */
+    char *getMemoryReport();
+
+    /**
+     * @brief Enables or disables the profiler of the MEGAchat thread
+     *
+     * When enabled, the profiler measures the time each callback waits in the queue of the
+     * MEGAchat thread and the time it takes to execute. Callbacks are grouped by call site:
+     * marshalled calls and timers (identified by the type of their callback), and the
+     * commands received from chatd and presenced (by opcode).
+     *
+     * Callbacks that take longer than \c slowThresholdMs are logged as warnings, and a summary
+     * of the callbacks that took longer in total is logged every \c dumpIntervalSec seconds.
+     *
+     * Enabling the profiler resets the stats collected so far. It is disabled by default.
+     *
+     * @param enable True to enable the profiler, false to disable it
+     * @param slowThresholdMs Callbacks taking at least this time are logged, or 0 to not log them
+     * @param dumpIntervalSec Seconds between summaries in the log, or 0 to not log them
+     */
+    void setLoopProfilerEnabled(bool enable, int slowThresholdMs = 50, int dumpIntervalSec = 300);
+
+    /**
+     * @brief Returns the stats collected by the profiler of the MEGAchat thread
+     *
+     * The stats are a JSON object with one entry per call site. Each entry has its category
+     * ("marshall", "timer", "chatd", "presenced", "request" or "loop"), its name and the
+     * histograms of its queueing delay and its execution time, in microseconds. For example:
+     *  {"enabled":true,"slowThresholdUs":50000,"entries":[{"category":"chatd","name":"NEWMSG",
+     *   "queue":{"count":0,...},"exec":{"count":3,"totalUs":1200,"maxUs":600,"p50Us":512,
+     *   "p99Us":1024,"buckets":[...]}},...]}
+     *
+     * Bucket 0 counts durations below 1 us and bucket i, durations from 2^(i-1) to 2^i us.
+     * The queueing delay is only known for marshalled calls and timers.
+     *
+     * You take the ownership of the returned value
+     *
+     * @return The stats collected since the profiler was enabled
+     * @see MegaChatApi::setLoopProfilerEnabled
+     */
+    char *getLoopProfile();
+
+    /**
+     * @brief Returns the traffic and processing metrics of the connections to chatd and presenced
+     *
+     * The metrics are counters kept since MegaChatApi::init, cheap enough to be always updated:
+     *  - Bytes sent and received (before compression and on the wire), memory held to reassemble
+     *  received messages, websocket frames received, commands received (by opcode), frames
+     *  sent (by the opcode of their first command) and frames that could not be parsed, for each
+     *  chatd shard and for presenced.
+     *  - Messages received while fetching history from chatd and the time spent in those
+     *  fetches, for each chatd shard, and the resulting messages per second.
+     *  - Messages decrypted and encrypted by message type, and their total and max time,
+     *  including the time waiting for keys.
+     *  - Number of messages in the sending queue of each chatroom that has messages pending to send.
+     *  - Events posted to and processed by the karere thread, the wakeups and batches needed
+     *  to process them, the depth of the queue and the time events waited in it.
+     *
+     * In JSON format, the metrics are an object with one entry per metric. For example:
+     *  {"chatd_received_bytes_total":{"type":"counter","help":"Payload bytes received",
+     *   "samples":[{"labels":{"shard":"0"},"value":1024},...]},...}
+     *
+     * In Prometheus format, the metrics can be served as is to a Prometheus server.
+     *
+     * You take the ownership of the returned value
+     *
+     * @param format Format of the metrics, MegaChatApi::METRICS_FORMAT_JSON or MegaChatApi::METRICS_FORMAT_PROMETHEUS
+     * @return The metrics, or NULL if MegaChatApi::init has not been called or the format is not valid
+     */
+    char *getNetworkMetrics(int format = METRICS_FORMAT_JSON);
+
     /**
      * @brief Returns the MegaChatMessage specified from the chat room.
      *
      * This function allows to retrieve only those messages that are been loaded, received and/or
      * sent (confirmed and not yet confirmed). For any other message, this function
-     * will return NULL.
+     * will return NULL. This includes the messages removed from memory when limits are
+     * set by MegaChatApi::setResidentHistoryLimits.
      *
      * You take the ownership of the returned value.
      *
@@ -4715,6 +4929,31 @@ public:
      * @param listener Object that is unregistered
      */
     void removeChatRemoteVideoListener(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, MegaChatVideoListener *listener);
+
+    /**
+     * @brief Takes the ownership of a video buffer, avoiding to copy it
+     *
+     * By default, the buffer received at MegaChatVideoListener::onChatVideoData is reused
+     * for upcoming frames once the callback returns. This function allows to keep it
+     * (ie. to render it from another thread) until MegaChatApi::releaseVideoBuffer is called.
+     *
+     * It can only be called from MegaChatVideoListener::onChatVideoData, for the buffer
+     * being notified. Every successful call must be balanced by a call to
+     * MegaChatApi::releaseVideoBuffer, or the buffer will be leaked.
+     *
+     * @param buffer Buffer received at MegaChatVideoListener::onChatVideoData
+     * @return True if the buffer has been retained
+     */
+    bool retainVideoBuffer(char *buffer);
+
+    /**
+     * @brief Returns a video buffer retained by MegaChatApi::retainVideoBuffer
+     *
+     * The buffer must not be used after this call.
+     *
+     * @param buffer Buffer previously retained
+     */
+    void releaseVideoBuffer(char *buffer);
 #endif
 
     static void setCatchException(bool enable);
@@ -66,6 +66,7 @@ using namespace karere;
 using namespace chatd;
 
 LoggerHandler *MegaChatApiImpl::loggerHandler = NULL;
+bool MegaChatApiImpl::websocketsCompression = true;
 
 MegaChatApiImpl::MegaChatApiImpl(MegaChatApi *chatApi, MegaApi *megaApi)
 {
@@ -110,8 +111,13 @@ void MegaChatApiImpl::init(MegaChatApi *chatApi, MegaApi *megaApi)
     this->mClient = NULL;
     this->terminating = false;
     this->waiter = new MegaChatWaiter();
-    this->websocketsIO = new MegaWebsocketsIO(sdkMutex, waiter, megaApi, this);
+    MegaWebsocketsIO::DeflateOptions deflate;
+    deflate.enabled = websocketsCompression;
+    this->websocketsIO = new MegaWebsocketsIO(sdkMutex, waiter, megaApi, this, deflate);
     this->reqtag = 0;
+    this->mChatListSnapshot = std::make_shared<ChatListSnapshot>();
+    this->mChatListSnapshotStale = false;
+    this->mChatListFullRefresh = false;
 
     //Start blocking thread
     threadExit = 0;
@@ -140,14 +146,22 @@ void MegaChatApiImpl::loop()
     {
         sdkMutex.unlock();
 
+        if (!eventQueue.prepareWait())
+        {
+            // events were posted after the last drain, without notification
+            waiter->notify();
+        }
+
         waiter->init(NEVER);
         waiter->wakeupby(websocketsIO, ::mega::Waiter::NEEDEXEC);
         waiter->wait();
+        eventQueue.setAwake();
 
         sdkMutex.lock();
 
         sendPendingEvents();
         sendPendingRequests();
+        publishChatListSnapshot();
 
         if (threadExit)
         {
@@ -184,8 +198,10 @@ void MegaChatApiImpl::megaApiPostMessage(void* msg, void* ctx)
 
 void MegaChatApiImpl::postMessage(void *msg)
 {
-    eventQueue.push(msg);
-    waiter->notify();
+    if (eventQueue.push(msg))
+    {
+        waiter->notify();
+    }
 }
 
 void MegaChatApiImpl::sendPendingRequests()
@@ -196,6 +212,7 @@ void MegaChatApiImpl::sendPendingRequests()
 
     while((request = requestQueue.pop()))
     {
+        LoopProfiler::Scope profile("request", request->getRequestString());
         nextTag = ++reqtag;
         request->setTag(nextTag);
         requestMap[nextTag]=request;
@@ -345,6 +362,7 @@ void MegaChatApiImpl::sendPendingRequests()
             cleanChatHandlers();
 #endif
             terminating = true;
+            invalidateChatListSnapshot(MEGACHAT_INVALID_HANDLE);
             mClient->terminate(deleteDb);
 
             API_LOG_INFO("Chat engine is logged out!");
@@ -372,6 +390,7 @@ void MegaChatApiImpl::sendPendingRequests()
 
                 delete mClient;
                 mClient = NULL;
+                invalidateChatListSnapshot(MEGACHAT_INVALID_HANDLE);
             }
 
             threadExit = 1;
@@ -1764,11 +1783,9 @@ void MegaChatApiImpl::sendPendingRequests()
 
 void MegaChatApiImpl::sendPendingEvents()
 {
-    void *msg;
-    while ((msg = eventQueue.pop()))
-    {
-        megaProcessMessage(msg);
-    }
+    LoopProfiler::Scope profile("loop", "sendPendingEvents");
+    // events posted while a batch is being processed are taken by the next drain
+    while (eventQueue.drain(megaProcessMessage)) {}
 }
 
 void MegaChatApiImpl::setLogLevel(int logLevel)
@@ -1796,6 +1813,11 @@ void MegaChatApiImpl::setLogToConsole(bool enable)
     }
 }
 
+void MegaChatApiImpl::setWebsocketsCompression(bool enable)
+{
+    websocketsCompression = enable;
+}
+
 void MegaChatApiImpl::setLoggerClass(MegaChatLogger *megaLogger)
 {
     if (!megaLogger)   // removing logger
@@ -1868,6 +1890,7 @@ void MegaChatApiImpl::createKarereClient()
 #endif
         mClient = new karere::Client(*megaApi, websocketsIO, *this, megaApi->getBasePath(), caps, this);
         terminating = false;
+        invalidateChatListSnapshot(MEGACHAT_INVALID_HANDLE);
     }
 }
 
@@ -1942,10 +1965,11 @@ karere::ChatRoom *MegaChatApiImpl::findChatRoomByUser(MegaChatHandle userhandle)
 
     if (mClient && !terminating)
     {
-        ContactList::iterator it = mClient->contactList->find(userhandle);
-        if (it != mClient->contactList->end())
+        // only the 1on1 chatrooms of users in the contact list (including ex-contacts), as
+        // when the chatroom was taken from the contact
+        if (mClient->contactList->contactFromUserId(userhandle))
         {
-            chatroom = it->second->chatRoom();
+            chatroom = mClient->chats->findPeerChatRoom(userhandle);
         }
     }
 
@@ -2255,21 +2279,25 @@ void MegaChatApiImpl::fireOnChatCallUpdate(MegaChatCallPrivate *call)
     call->removeChanges();
 }
 
-void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, int width, int height, char *buffer)
+// frame being notified to the video listeners by the current thread, which can be retained by the app
+static thread_local MegaChatVideoFrame *currentVideoFrame = nullptr;
+
+void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, const MegaChatVideoListenerSlot::ListenerList &listeners, MegaChatVideoFrame *frame)
 {
-    std::map<MegaChatHandle, MegaChatPeerVideoListener_map>::iterator it = videoListeners.find(chatid);
-    if (it != videoListeners.end())
+    currentVideoFrame = frame;
+    for (MegaChatVideoListener *listener: listeners)
     {
-        MegaChatPeerVideoListener_map::iterator peerVideoIterator = it->second.find(EndpointId(peerid, clientid));
-        if (peerVideoIterator != it->second.end())
-        {
-            for( MegaChatVideoListener_set::iterator videoListenerIterator = peerVideoIterator->second.begin();
-                 videoListenerIterator != peerVideoIterator->second.end();
-                 videoListenerIterator++)
-            {
-                (*videoListenerIterator)->onChatVideoData(chatApi, chatid, width, height, buffer, width * height * 4);
-            }
-        }
+        listener->onChatVideoData(chatApi, chatid, frame->width, frame->height, (char *)frame->buffer, frame->size);
+    }
+    currentVideoFrame = nullptr;
+}
+
+void MegaChatApiImpl::fireOnChatVideoDataI420(MegaChatHandle chatid, const MegaChatVideoListenerSlot::ListenerList &listeners, int width, int height,
+                                              const char *dataY, int strideY, const char *dataU, int strideU, const char *dataV, int strideV)
+{
+    for (MegaChatVideoListener *listener: listeners)
+    {
+        listener->onChatVideoDataI420(chatApi, chatid, width, height, dataY, strideY, dataU, strideU, dataV, strideV);
     }
 }
 
@@ -2277,6 +2305,8 @@ void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle
 
 void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
 {
+    invalidateChatListSnapshot(item->getChatId());
+
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
     {
         (*it)->onChatListItemUpdate(chatApi, item);
@@ -2285,8 +2315,83 @@ void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
     delete item;
 }
 
+void MegaChatApiImpl::invalidateChatListSnapshot(MegaChatHandle chatid)
+{
+    if (chatid == MEGACHAT_INVALID_HANDLE)
+    {
+        mChatListFullRefresh = true;
+    }
+    else
+    {
+        mChatListDirtyChats.insert(chatid);
+    }
+    mChatListSnapshotStale = true;
+}
+
+void MegaChatApiImpl::publishChatListSnapshot()
+{
+    SdkMutexGuard g(sdkMutex);
+    if (!mChatListSnapshotStale)
+    {
+        return;
+    }
+
+    std::shared_ptr<const ChatListSnapshot> current = std::atomic_load(&mChatListSnapshot);
+    uint64_t version = current->version() + 1;
+    std::shared_ptr<const ChatListSnapshot> snapshot;
+    if (!mClient || terminating)
+    {
+        snapshot = std::make_shared<ChatListSnapshot>(version);
+    }
+    else if (mChatListFullRefresh)
+    {
+        snapshot = std::make_shared<ChatListSnapshot>(version, *mClient->chats);
+    }
+    else
+    {
+        // unchanged chatrooms are shared with the previous snapshot
+        snapshot = std::make_shared<ChatListSnapshot>(*current, version, *mClient->chats, mChatListDirtyChats);
+    }
+
+    std::atomic_store(&mChatListSnapshot, snapshot);
+    mChatListDirtyChats.clear();
+    mChatListFullRefresh = false;
+    mChatListSnapshotStale = false;
+}
+
+std::shared_ptr<const ChatListSnapshot> MegaChatApiImpl::getChatListSnapshot()
+{
+    // only the karere thread publishes snapshots, at the end of each batch of events
+    return std::atomic_load(&mChatListSnapshot);
+}
+
+void MegaChatApiImpl::forEachChatListItem(const std::function<void (const MegaChatListItemPrivate &)> &f)
+{
+    if (!mChatListSnapshotStale)
+    {
+        getChatListSnapshot()->forEach([&f](const ChatListSnapshot::Entry &entry)
+        {
+            f(entry.item);
+        });
+        return;
+    }
+
+    SdkMutexGuard g(sdkMutex);
+
+    if (mClient && !terminating)
+    {
+        for (auto& it: *mClient->chats)
+        {
+            f(MegaChatListItemPrivate(*it.second));
+        }
+    }
+}
+
 void MegaChatApiImpl::fireOnChatInitStateUpdate(int newState)
 {
+    // chatrooms are loaded from cache or fetched without individual notifications
+    invalidateChatListSnapshot(MEGACHAT_INVALID_HANDLE);
+
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
     {
         (*it)->onChatInitStateUpdate(chatApi, newState);
@@ -2689,24 +2794,37 @@ MegaChatRoomList *MegaChatApiImpl::getChatRooms()
 {
     MegaChatRoomListPrivate *chats = new MegaChatRoomListPrivate();
 
-    sdkMutex.lock();
+    if (!mChatListSnapshotStale)
+    {
+        getChatListSnapshot()->forEach([chats](const ChatListSnapshot::Entry &entry)
+        {
+            chats->addChatRoom(entry.room.copy());
+        });
+        return chats;
+    }
+
+    SdkMutexGuard g(sdkMutex);
 
     if (mClient && !terminating)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        for (auto& it: *mClient->chats)
         {
-            chats->addChatRoom(new MegaChatRoomPrivate(*it->second));
+            chats->addChatRoom(new MegaChatRoomPrivate(*it.second));
         }
     }
 
-    sdkMutex.unlock();
-
     return chats;
 }
 
 MegaChatRoom *MegaChatApiImpl::getChatRoom(MegaChatHandle chatid)
 {
+    if (!mChatListSnapshotStale)
+    {
+        std::shared_ptr<const ChatListSnapshot> snapshot = std::atomic_load(&mChatListSnapshot);
+        const ChatListSnapshot::Entry *entry = snapshot->find(chatid);
+        return entry ? entry->room.copy() : NULL;
+    }
+
     MegaChatRoomPrivate *chat = NULL;
 
     sdkMutex.lock();
@@ -2743,21 +2861,13 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    forEachChatListItem([items](const MegaChatListItemPrivate &item)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        if (!item.isArchived())
         {
-            if (!it->second->isArchived())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(item.copy());
         }
-    }
-
-    sdkMutex.unlock();
+    });
 
     return items;
 }
@@ -2766,61 +2876,39 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItemsByPeers(MegaChatPeerList
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
+    SetOfIds userids;
+    userids.reserve(peers->size());
+    for (int i = 0; i < peers->size(); i++)
+    {
+        userids.insert(peers->getPeerHandle(i));
+    }
+
+    SdkMutexGuard g(sdkMutex);
 
     if (mClient && !terminating)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        std::shared_ptr<const ChatListSnapshot> snapshot = getChatListSnapshot();
+        std::vector<ChatRoom *> chatrooms = mClient->chats->findRoomsByMembers(userids);
+        for (ChatRoom *chatroom: chatrooms)
         {
-            bool sameParticipants = true;
-            if (it->second->isGroup())
-            {
-                GroupChatRoom *chatroom = (GroupChatRoom*) it->second;
-                if ((int)chatroom->peers().size() != peers->size())
-                {
-                    continue;
-                }
-
-                for (int i = 0; i < peers->size(); i++)
-                {
-                    // if the peer in the list is part of the members in the chatroom...
-                    MegaChatHandle uh = peers->getPeerHandle(i);
-                    if (chatroom->peers().find(uh) == chatroom->peers().end())
-                    {
-                        sameParticipants = false;
-                        break;
-                    }
-                }
-                if (sameParticipants == true)
-                {
-                    items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-                }
-
-            }
-            else    // 1on1
-            {
-                if (peers->size() != 1)
-                {
-                    continue;
-                }
-
-                PeerChatRoom *chatroom = (PeerChatRoom*) it->second;
-                if (chatroom->peer() == peers->getPeerHandle(0))
-                {
-                    items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-                }
-            }
+            // changes not published yet are taken from the chatroom, as the other getters do
+            const ChatListSnapshot::Entry *entry = mChatListSnapshotStale ? NULL : snapshot->find(chatroom->chatid());
+            items->addChatListItem(entry ? entry->item.copy() : new MegaChatListItemPrivate(*chatroom));
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
 MegaChatListItem *MegaChatApiImpl::getChatListItem(MegaChatHandle chatid)
 {
+    if (!mChatListSnapshotStale)
+    {
+        std::shared_ptr<const ChatListSnapshot> snapshot = std::atomic_load(&mChatListSnapshot);
+        const ChatListSnapshot::Entry *entry = snapshot->find(chatid);
+        return entry ? entry->item.copy() : NULL;
+    }
+
     MegaChatListItemPrivate *item = NULL;
 
     sdkMutex.lock();
@@ -2840,45 +2928,77 @@ int MegaChatApiImpl::getUnreadChats()
 {
     int count = 0;
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    forEachChatListItem([&count](const MegaChatListItemPrivate &item)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        if (!item.isArchived() && !item.isPreview() && item.getUnreadCount())
         {
-            ChatRoom *room = it->second;
-            if (!room->isArchived() && !room->previewMode() && room->chat().unreadMsgCount())
-            {
-                count++;
-            }
+            count++;
         }
-    }
-
-    sdkMutex.unlock();
+    });
 
     return count;
 }
 
-MegaChatListItemList *MegaChatApiImpl::getActiveChatListItems()
+int64_t MegaChatApiImpl::getChatListVersion()
+{
+    if (!mChatListSnapshotStale)
+    {
+        return getChatListSnapshot()->version();
+    }
+
+    // the changes not published yet will get the next version
+    SdkMutexGuard g(sdkMutex);
+    return getChatListSnapshot()->version() + (mChatListSnapshotStale ? 1 : 0);
+}
+
+MegaChatListItemList *MegaChatApiImpl::getChatListItemsSince(int64_t version)
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
+    if (!mChatListSnapshotStale)
+    {
+        getChatListSnapshot()->forEach([items, version](const ChatListSnapshot::Entry &entry)
+        {
+            if ((int64_t)entry.version > version)
+            {
+                items->addChatListItem(entry.item.copy());
+            }
+        });
+        return items;
+    }
+
+    SdkMutexGuard g(sdkMutex);
 
     if (mClient && !terminating)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        // the chatrooms changed since the last snapshot will get the next version
+        std::shared_ptr<const ChatListSnapshot> snapshot = getChatListSnapshot();
+        int64_t nextVersion = snapshot->version() + 1;
+        for (auto& it: *mClient->chats)
         {
-            if (!it->second->isArchived() && it->second->isActive())
+            const ChatListSnapshot::Entry *entry = snapshot->find(it.first);
+            bool changed = !entry || mChatListFullRefresh || mChatListDirtyChats.count(it.first);
+            if ((changed ? nextVersion : (int64_t)entry->version) > version)
             {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
+                items->addChatListItem(new MegaChatListItemPrivate(*it.second));
             }
         }
     }
 
-    sdkMutex.unlock();
+    return items;
+}
+
+MegaChatListItemList *MegaChatApiImpl::getActiveChatListItems()
+{
+    MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
+
+    forEachChatListItem([items](const MegaChatListItemPrivate &item)
+    {
+        if (!item.isArchived() && item.isActive())
+        {
+            items->addChatListItem(item.copy());
+        }
+    });
 
     return items;
 }
@@ -2887,21 +3007,13 @@ MegaChatListItemList *MegaChatApiImpl::getInactiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    forEachChatListItem([items](const MegaChatListItemPrivate &item)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        if (!item.isArchived() && !item.isActive())
         {
-            if (!it->second->isArchived() && !it->second->isActive())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(item.copy());
         }
-    }
-
-    sdkMutex.unlock();
+    });
 
     return items;
 }
@@ -2910,21 +3022,13 @@ MegaChatListItemList *MegaChatApiImpl::getArchivedChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    forEachChatListItem([items](const MegaChatListItemPrivate &item)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        if (item.isArchived())
         {
-            if (it->second->isArchived())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(item.copy());
         }
-    }
-
-    sdkMutex.unlock();
+    });
 
     return items;
 }
@@ -2933,22 +3037,13 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    forEachChatListItem([items](const MegaChatListItemPrivate &item)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        if (!item.isArchived() && item.getUnreadCount())
         {
-            ChatRoom *room = it->second;
-            if (!room->isArchived() && room->chat().unreadMsgCount())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(item.copy());
         }
-    }
-
-    sdkMutex.unlock();
+    });
 
     return items;
 }
@@ -3201,6 +3296,96 @@ bool MegaChatApiImpl::isFullHistoryLoaded(MegaChatHandle chatid)
     return ret;
 }
 
+void MegaChatApiImpl::setResidentHistoryLimits(unsigned int maxPerChat, unsigned int maxTotal)
+{
+    sdkMutex.lock();
+
+    if (mClient && !terminating)
+    {
+        mClient->setResidentHistoryLimits(maxPerChat, maxTotal);
+    }
+
+    sdkMutex.unlock();
+}
+
+int MegaChatApiImpl::getResidentMessageCount(MegaChatHandle chatid)
+{
+    int ret = -1;
+    sdkMutex.lock();
+
+    ChatRoom *chatroom = findChatRoom(chatid);
+    if (chatroom)
+    {
+        ret = chatroom->chat().size();
+    }
+
+    sdkMutex.unlock();
+    return ret;
+}
+
+int MegaChatApiImpl::getTotalResidentMessageCount()
+{
+    int ret = 0;
+    sdkMutex.lock();
+
+    if (mClient && mClient->mChatdClient && !terminating)
+    {
+        ret = static_cast<int>(mClient->mChatdClient->residentMsgCount());
+    }
+
+    sdkMutex.unlock();
+    return ret;
+}
+
+char *MegaChatApiImpl::getMemoryReport()
+{
+    char *ret = NULL;
+    sdkMutex.lock();
+
+    if (mClient && !terminating)
+    {
+        std::string json = mClient->getMemoryReport().toJson();
+        ret = MegaApi::strdup(json.c_str());
+    }
+
+    sdkMutex.unlock();
+    return ret;
+}
+
+void MegaChatApiImpl::setLoopProfilerEnabled(bool enable, int slowThresholdMs, int dumpIntervalSec)
+{
+    // the profiler has its own lock, it's also fed by the threads posting to the queue
+    gLoopProfiler.setEnabled(enable, std::max(slowThresholdMs, 0) * 1000LL, std::max(dumpIntervalSec, 0));
+}
+
+char *MegaChatApiImpl::getLoopProfile()
+{
+    std::string json = gLoopProfiler.toJson();
+    return MegaApi::strdup(json.c_str());
+}
+
+char *MegaChatApiImpl::getNetworkMetrics(int format)
+{
+    if (format != MegaChatApi::METRICS_FORMAT_JSON && format != MegaChatApi::METRICS_FORMAT_PROMETHEUS)
+    {
+        return NULL;
+    }
+
+    char *ret = NULL;
+    sdkMutex.lock();
+
+    if (mClient && !terminating)
+    {
+        Metrics metrics = mClient->getMetrics();
+        eventQueue.addMetrics(metrics);
+        std::string text = (format == MegaChatApi::METRICS_FORMAT_JSON) ? metrics.toJson() : metrics.toPrometheus();
+        ret = MegaApi::strdup(text.c_str());
+    }
+
+    sdkMutex.unlock();
+    return ret;
+}
+
 MegaChatMessage *MegaChatApiImpl::getMessage(MegaChatHandle chatid, MegaChatHandle msgid)
 {
     MegaChatMessagePrivate *megaMsg = NULL;
@@ -4096,7 +4281,7 @@ void MegaChatApiImpl::addChatVideoListener(MegaChatHandle chatid, MegaChatHandle
     }
 
     videoMutex.lock();
-    videoListeners[chatid][EndpointId(peerid, clientid)].insert(listener);
+    getVideoListenerSlot(chatid, peerid, clientid)->add(listener);
     videoMutex.unlock();
 }
 
@@ -4107,23 +4292,132 @@ void MegaChatApiImpl::removeChatVideoListener(MegaChatHandle chatid, MegaChatHan
         return;
     }
 
+    std::shared_ptr<MegaChatVideoListenerSlot> slot;
     videoMutex.lock();
-    videoListeners[chatid][EndpointId(peerid, clientid)].erase(listener);
-
-    if (videoListeners[chatid][EndpointId(peerid, clientid)].empty())
+    auto it = videoListeners.find(chatid);
+    if (it != videoListeners.end())
     {
-        videoListeners[chatid].erase(EndpointId(peerid, clientid));
+        auto slotIt = it->second.find(EndpointId(peerid, clientid));
+        if (slotIt != it->second.end())
+        {
+            slot = slotIt->second;
+            slot->remove(listener);
+
+            // keep the slot while a receiver is using it, listeners may be added again
+            if (slot->unused())
+            {
+                it->second.erase(slotIt);
+            }
+        }
+
+        if (it->second.empty())
+        {
+            videoListeners.erase(it);
+        }
     }
+    videoMutex.unlock();
 
-    if (videoListeners[chatid].empty())
+    if (slot)
     {
-        videoListeners.erase(chatid);
+        // a frame may be being delivered to the listener with the previous list of listeners
+        slot->waitForDelivery();
     }
-
-    videoMutex.unlock();
 }
 
-#endif  // webrtc
+std::shared_ptr<MegaChatVideoListenerSlot> MegaChatApiImpl::getVideoListenerSlot(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid)
+{
+    std::lock_guard<std::recursive_mutex> lock(videoMutex);
+    std::shared_ptr<MegaChatVideoListenerSlot> &slot = videoListeners[chatid][EndpointId(peerid, clientid)];
+    if (!slot)
+    {
+        slot = std::make_shared<MegaChatVideoListenerSlot>();
+    }
+    return slot;
+}
+
+std::shared_ptr<MegaChatVideoListenerSlot> MegaChatApiImpl::acquireVideoListenerSlot(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid)
+{
+    std::lock_guard<std::recursive_mutex> lock(videoMutex);
+    std::shared_ptr<MegaChatVideoListenerSlot> slot = getVideoListenerSlot(chatid, peerid, clientid);
+    slot->addReceiver();
+    return slot;
+}
+
+void MegaChatApiImpl::releaseVideoListenerSlot(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, std::shared_ptr<MegaChatVideoListenerSlot> &slot)
+{
+    std::lock_guard<std::recursive_mutex> lock(videoMutex);
+    slot->removeReceiver();
+    slot.reset();
+
+    auto it = videoListeners.find(chatid);
+    if (it == videoListeners.end())
+    {
+        return;
+    }
+
+    auto slotIt = it->second.find(EndpointId(peerid, clientid));
+    if (slotIt != it->second.end() && slotIt->second->unused())
+    {
+        it->second.erase(slotIt);
+        if (it->second.empty())
+        {
+            videoListeners.erase(it);
+        }
+    }
+}
+
+bool MegaChatApiImpl::retainVideoBuffer(char *buffer)
+{
+    MegaChatVideoFrame *frame = currentVideoFrame;
+    if (!buffer || !frame || (char *)frame->buffer != buffer)
+    {
+        API_LOG_WARNING("retainVideoBuffer: the buffer is not being notified by onChatVideoData");
+        return false;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(videoMutex);
+    frame->refCount++;
+    frame->appRetains++;
+    mRetainedVideoFrames[buffer] = frame;
+    return true;
+}
+
+void MegaChatApiImpl::releaseVideoBuffer(char *buffer)
+{
+    MegaChatVideoFrame *frame = nullptr;
+    {
+        std::lock_guard<std::recursive_mutex> lock(videoMutex);
+        auto it = mRetainedVideoFrames.find(buffer);
+        if (it == mRetainedVideoFrames.end())
+        {
+            API_LOG_WARNING("releaseVideoBuffer: unknown buffer");
+            return;
+        }
+
+        frame = it->second;
+        if (--frame->appRetains == 0)
+        {
+            mRetainedVideoFrames.erase(it);
+        }
+    }
+
+    if (--frame->refCount > 0)
+    {
+        return; // still retained, or being notified (the receiver will return it to the pool)
+    }
+
+    std::shared_ptr<MegaChatVideoFramePool> pool = frame->pool.lock();
+    if (pool)
+    {
+        pool->release(frame);
+    }
+    else
+    {
+        delete frame;
+    }
+}
+
+#endif  // webrtc
 
 void MegaChatApiImpl::removeChatListener(MegaChatListener *listener)
 {
@@ -4313,13 +4607,9 @@ MegaHandleList* MegaChatApiImpl::getReactionUsers(MegaChatHandle chatid, MegaCha
         Message *msg = findMessage(chatid, msgid);
         if (msg)
         {
-            const std::vector<karere::Id> *users = msg->getReactionUsers(reaction);
-            if (users)
+            for (auto &userid : msg->getReactionUsers(reaction))
             {
-                for (auto &userid : *users)
-                {
-                    userList->addMegaHandle(userid);
-                }
+                userList->addMegaHandle(userid);
             }
         }
         else
@@ -4563,6 +4853,9 @@ IApp::IPeerChatListItem *MegaChatApiImpl::addPeerChatItem(PeerChatRoom &chat)
 
 void MegaChatApiImpl::removeGroupChatItem(IGroupChatListItem &item)
 {
+    // the chatroom is being destroyed: rebuild the snapshot once it's gone
+    invalidateChatListSnapshot(MEGACHAT_INVALID_HANDLE);
+
     set<MegaChatGroupListItemHandler *>::iterator it = chatGroupListItemHandler.begin();
     while (it != chatGroupListItemHandler.end())
     {
@@ -4580,6 +4873,9 @@ void MegaChatApiImpl::removeGroupChatItem(IGroupChatListItem &item)
 
 void MegaChatApiImpl::removePeerChatItem(IPeerChatListItem &item)
 {
+    // the chatroom is being destroyed: rebuild the snapshot once it's gone
+    invalidateChatListSnapshot(MEGACHAT_INVALID_HANDLE);
+
     set<MegaChatPeerListItemHandler *>::iterator it = chatPeerListItemHandler.begin();
     while (it != chatPeerListItemHandler.end())
     {
@@ -4663,54 +4959,265 @@ void ChatRequestQueue::removeListener(MegaChatRequestListener *listener)
     mutex.unlock();
 }
 
-void EventQueue::push(void *transfer)
+EventQueue::EventQueue()
+    : mHead(nullptr), mConsumerAwake(true), mDepth(0), mMaxDepth(0), mPosted(0), mProcessed(0),
+      mWakeups(0), mBatches(0), mTotalLatencyUs(0), mMaxLatencyUs(0)
 {
-    mutex.lock();
-    events.push_back(transfer);
-    mutex.unlock();
 }
 
-void EventQueue::push_front(void *event)
+EventQueue::~EventQueue()
 {
-    mutex.lock();
-    events.push_front(event);
-    mutex.unlock();
+    Node* node = mHead.exchange(nullptr);
+    while (node)
+    {
+        Node* next = node->next;
+        delete node;
+        node = next;
+    }
 }
 
-void* EventQueue::pop()
+int64_t EventQueue::nowUs()
 {
-    mutex.lock();
-    if(events.empty())
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool EventQueue::push(void *event)
+{
+    Node* node = new Node;
+    node->event = event;
+    node->postTs = nowUs();
+
+    // account for the event before publishing it, so the consumer never sees a negative depth
+    mPosted.fetch_add(1, std::memory_order_relaxed);
+    size_t depth = mDepth.fetch_add(1, std::memory_order_relaxed) + 1;
+    size_t maxDepth = mMaxDepth.load(std::memory_order_relaxed);
+    while (depth > maxDepth && !mMaxDepth.compare_exchange_weak(maxDepth, depth, std::memory_order_relaxed));
+
+    node->next = mHead.load(std::memory_order_relaxed);
+    while (!mHead.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+
+    // only the first producer after the consumer went to sleep needs to wake it up
+    if (mConsumerAwake.exchange(true))
     {
-        mutex.unlock();
-        return NULL;
+        return false;
     }
-    void* event = events.front();
-    events.pop_front();
-    mutex.unlock();
-    return event;
+    mWakeups.fetch_add(1, std::memory_order_relaxed);
+    return true;
 }
 
-bool EventQueue::isEmpty()
+size_t EventQueue::drain(void (*process)(void *))
 {
-    bool ret;
+    Node* node = mHead.exchange(nullptr, std::memory_order_acquire);
+    if (!node)
+    {
+        return 0;
+    }
 
-    mutex.lock();
-    ret = events.empty();
-    mutex.unlock();
+    // the stack holds the newest event first, reverse it to preserve the posting order
+    Node* fifo = nullptr;
+    while (node)
+    {
+        Node* next = node->next;
+        node->next = fifo;
+        fifo = node;
+        node = next;
+    }
 
-    return ret;
+    int64_t now = nowUs();
+    size_t count = 0;
+    uint64_t totalLatency = 0;
+    uint64_t maxLatency = mMaxLatencyUs.load(std::memory_order_relaxed);
+    for (node = fifo; node; count++)
+    {
+        uint64_t latency = (now > node->postTs) ? (uint64_t)(now - node->postTs) : 0;
+        totalLatency += latency;
+        if (latency > maxLatency)
+        {
+            maxLatency = latency;
+        }
+        Node* next = node->next;
+        void* event = node->event;
+        delete node;
+        node = next;
+        mDepth.fetch_sub(1, std::memory_order_relaxed);
+        process(event);
+    }
+
+    mProcessed.fetch_add(count, std::memory_order_relaxed);
+    mBatches.fetch_add(1, std::memory_order_relaxed);
+    mTotalLatencyUs.fetch_add(totalLatency, std::memory_order_relaxed);
+    mMaxLatencyUs.store(maxLatency, std::memory_order_relaxed);
+    return count;
 }
 
-size_t EventQueue::size()
+bool EventQueue::prepareWait()
 {
-    size_t ret;
+    mConsumerAwake.store(false);
+    return mHead.load() == nullptr;
+}
 
-    mutex.lock();
-    ret = events.size();
-    mutex.unlock();
+void EventQueue::setAwake()
+{
+    mConsumerAwake.store(true);
+}
 
-    return ret;
+bool EventQueue::isEmpty() const
+{
+    return mHead.load(std::memory_order_acquire) == nullptr;
+}
+
+size_t EventQueue::size() const
+{
+    return mDepth.load(std::memory_order_relaxed);
+}
+
+EventQueue::Stats EventQueue::getStats() const
+{
+    Stats stats;
+    stats.posted = mPosted.load(std::memory_order_relaxed);
+    stats.processed = mProcessed.load(std::memory_order_relaxed);
+    stats.wakeups = mWakeups.load(std::memory_order_relaxed);
+    stats.batches = mBatches.load(std::memory_order_relaxed);
+    stats.depth = mDepth.load(std::memory_order_relaxed);
+    stats.maxDepth = mMaxDepth.load(std::memory_order_relaxed);
+    stats.totalLatencyUs = mTotalLatencyUs.load(std::memory_order_relaxed);
+    stats.maxLatencyUs = mMaxLatencyUs.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void EventQueue::addMetrics(Metrics &metrics) const
+{
+    Stats stats = getStats();
+    metrics.add("karere_events_posted_total", Metrics::kCounter, "Events posted to the karere thread", {}, stats.posted);
+    metrics.add("karere_events_processed_total", Metrics::kCounter, "Events processed by the karere thread", {}, stats.processed);
+    metrics.add("karere_events_wakeups_total", Metrics::kCounter, "Posted events that had to wake up the karere thread", {}, stats.wakeups);
+    metrics.add("karere_events_batches_total", Metrics::kCounter, "Times the karere thread drained the queue of events", {}, stats.batches);
+    metrics.add("karere_events_queue_depth", Metrics::kGauge, "Events waiting to be processed", {}, stats.depth);
+    metrics.add("karere_events_queue_max_depth", Metrics::kGauge, "Highest number of events waiting at once", {}, stats.maxDepth);
+    metrics.add("karere_events_latency_us_total", Metrics::kCounter, "Time spent by events in the queue, in microseconds", {}, stats.totalLatencyUs);
+    metrics.add("karere_events_latency_us_max", Metrics::kGauge, "Longest time spent by an event in the queue, in microseconds", {}, stats.maxLatencyUs);
+}
+
+ChatListSnapshot::Entry::Entry(ChatRoom &chatroom, uint64_t aVersion)
+    : room(chatroom), item(chatroom), version(aVersion)
+{
+}
+
+static bool chatListEntryBefore(const std::shared_ptr<const ChatListSnapshot::Entry> &entry, MegaChatHandle chatid)
+{
+    return entry->room.getChatId() < chatid;
+}
+
+ChatListSnapshot::ChatListSnapshot(uint64_t version, ChatRoomList &chats)
+    : mVersion(version)
+{
+    Chunk chunk;
+    for (auto& it: chats)
+    {
+        chunk.push_back(std::make_shared<Entry>(*it.second, version));
+        if (chunk.size() == kChunkSize)
+        {
+            addChunk(std::move(chunk));
+            chunk.clear();
+        }
+    }
+    addChunk(std::move(chunk));
+}
+
+ChatListSnapshot::ChatListSnapshot(const ChatListSnapshot &previous, uint64_t version, ChatRoomList &chats,
+                                   const std::set<MegaChatHandle> &changed)
+    : mVersion(version)
+{
+    mChunks.reserve(previous.mChunks.size() + 1);
+    std::set<MegaChatHandle>::const_iterator changedIt = changed.begin();
+    for (size_t i = 0; i < previous.mChunks.size(); i++)
+    {
+        // every chunk takes the changes up to the first chatid of the next one
+        bool last = (i + 1 == previous.mChunks.size());
+        MegaChatHandle nextChatid = last ? 0 : previous.mChunks[i + 1]->front()->room.getChatId();
+        if (changedIt == changed.end() || (!last && *changedIt >= nextChatid))
+        {
+            mChunks.push_back(previous.mChunks[i]);
+            continue;
+        }
+
+        Chunk chunk(*previous.mChunks[i]);
+        while (changedIt != changed.end() && (last || *changedIt < nextChatid))
+        {
+            updateEntry(chunk, *changedIt++, chats, version);
+        }
+        addChunk(std::move(chunk));
+    }
+
+    if (previous.mChunks.empty())
+    {
+        Chunk chunk;
+        for (; changedIt != changed.end(); changedIt++)
+        {
+            updateEntry(chunk, *changedIt, chats, version);
+        }
+        addChunk(std::move(chunk));
+    }
+}
+
+const ChatListSnapshot::Entry *ChatListSnapshot::find(MegaChatHandle chatid) const
+{
+    // the chunk of the chatid is the last one starting before it
+    auto chunkIt = std::upper_bound(mChunks.begin(), mChunks.end(), chatid,
+                                    [](MegaChatHandle id, const std::shared_ptr<const Chunk> &chunk)
+    {
+        return id < chunk->front()->room.getChatId();
+    });
+    if (chunkIt == mChunks.begin())
+    {
+        return NULL;
+    }
+
+    const Chunk &chunk = **(--chunkIt);
+    Chunk::const_iterator it = std::lower_bound(chunk.begin(), chunk.end(), chatid, chatListEntryBefore);
+    return (it != chunk.end() && (*it)->room.getChatId() == chatid) ? it->get() : NULL;
+}
+
+void ChatListSnapshot::addChunk(Chunk &&chunk)
+{
+    if (chunk.empty())
+    {
+        return;
+    }
+
+    if (chunk.size() < 2 * kChunkSize)
+    {
+        mChunks.push_back(std::make_shared<Chunk>(std::move(chunk)));
+        return;
+    }
+
+    for (size_t i = 0; i < chunk.size(); i += kChunkSize)
+    {
+        size_t end = std::min<size_t>(i + kChunkSize, chunk.size());
+        mChunks.push_back(std::make_shared<Chunk>(chunk.begin() + i, chunk.begin() + end));
+    }
+}
+
+void ChatListSnapshot::updateEntry(Chunk &chunk, MegaChatHandle chatid, ChatRoomList &chats, uint64_t version)
+{
+    Chunk::iterator it = std::lower_bound(chunk.begin(), chunk.end(), chatid, chatListEntryBefore);
+    bool found = (it != chunk.end() && (*it)->room.getChatId() == chatid);
+    ChatRoomList::iterator room = chats.find(chatid);
+    if (room == chats.end())
+    {
+        if (found)
+        {
+            chunk.erase(it);
+        }
+    }
+    else if (found)
+    {
+        *it = std::make_shared<Entry>(*room->second, version);
+    }
+    else
+    {
+        chunk.insert(it, std::make_shared<Entry>(*room->second, version));
+    }
 }
 
 MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener *listener)
@@ -5711,36 +6218,204 @@ void MegaChatCallPrivate::setCaller(Id caller)
     this->callerId = caller;
 }
 
+MegaChatVideoFrame::MegaChatVideoFrame(int width, int height)
+    : width(width), height(height),
+      size(static_cast<size_t>(width) * height * 4), // in format ARGB: 4 bytes per pixel
+      refCount(0)
+{
+    buffer = new ::mega::byte[size];
+}
+
+MegaChatVideoFrame::~MegaChatVideoFrame()
+{
+    delete [] buffer;
+}
+
+MegaChatVideoFramePool::~MegaChatVideoFramePool()
+{
+    clear();
+}
+
+MegaChatVideoFrame *MegaChatVideoFramePool::acquire(int width, int height)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (width != mWidth || height != mHeight)
+    {
+        // buffers of the previous resolution won't be used anymore
+        clear();
+        mWidth = width;
+        mHeight = height;
+    }
+
+    if (mFreeFrames.empty())
+    {
+        return new MegaChatVideoFrame(width, height);
+    }
+
+    MegaChatVideoFrame *frame = mFreeFrames.back();
+    mFreeFrames.pop_back();
+    return frame;
+}
+
+void MegaChatVideoFramePool::release(MegaChatVideoFrame *frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (frame->width == mWidth && frame->height == mHeight && mFreeFrames.size() < kMaxFreeFrames)
+        {
+            mFreeFrames.push_back(frame);
+            return;
+        }
+    }
+
+    delete frame;
+}
+
+void MegaChatVideoFramePool::clear()
+{
+    for (auto frame: mFreeFrames)
+    {
+        delete frame;
+    }
+    mFreeFrames.clear();
+}
+
+thread_local MegaChatVideoListenerSlot *MegaChatVideoListenerSlot::sDeliveringSlot = nullptr;
+
+MegaChatVideoListenerSlot::MegaChatVideoListenerSlot()
+    : mListeners(std::make_shared<ListenerList>()), mReceivers(0)
+{
+}
+
+void MegaChatVideoListenerSlot::add(MegaChatVideoListener *listener)
+{
+    if (mListenerSet.insert(listener).second)
+    {
+        publish();
+    }
+}
+
+void MegaChatVideoListenerSlot::remove(MegaChatVideoListener *listener)
+{
+    if (!mListenerSet.erase(listener))
+    {
+        return;
+    }
+
+    publish();
+}
+
+void MegaChatVideoListenerSlot::waitForDelivery()
+{
+    // not needed (and a deadlock) if called from the listener's callback
+    if (sDeliveringSlot != this)
+    {
+        std::lock_guard<std::mutex> lock(mDeliveryMutex);
+    }
+}
+
+bool MegaChatVideoListenerSlot::empty() const
+{
+    return mListenerSet.empty();
+}
+
+void MegaChatVideoListenerSlot::addReceiver()
+{
+    mReceivers++;
+}
+
+void MegaChatVideoListenerSlot::removeReceiver()
+{
+    assert(mReceivers > 0);
+    mReceivers--;
+}
+
+bool MegaChatVideoListenerSlot::unused() const
+{
+    return mListenerSet.empty() && !mReceivers;
+}
+
+bool MegaChatVideoListenerSlot::acceptsI420()
+{
+    // listeners are queried under the delivery lock, so a removed listener can't be destroyed meanwhile
+    bool accepted = false;
+    deliver([&accepted](const ListenerList &listeners)
+    {
+        accepted = !listeners.empty();
+        for (MegaChatVideoListener *listener: listeners)
+        {
+            if (listener->getVideoFormat() != MegaChatVideoListener::VIDEO_FORMAT_I420)
+            {
+                accepted = false;
+                break;
+            }
+        }
+    });
+    return accepted;
+}
+
+void MegaChatVideoListenerSlot::publish()
+{
+    std::shared_ptr<const ListenerList> listeners = std::make_shared<ListenerList>(mListenerSet.begin(), mListenerSet.end());
+    std::atomic_store(&mListeners, listeners);
+}
+
 MegaChatVideoReceiver::MegaChatVideoReceiver(MegaChatApiImpl *chatApi, rtcModule::ICall *call, MegaChatHandle peerid, uint32_t clientid)
+    : mFramePool(std::make_shared<MegaChatVideoFramePool>())
 {
     this->chatApi = chatApi;
     chatid = call->chat().chatId();
     this->peerid = peerid;
     this->clientid = clientid;
+    mListenerSlot = chatApi->acquireVideoListenerSlot(chatid, peerid, clientid);
 }
 
 MegaChatVideoReceiver::~MegaChatVideoReceiver()
 {
+    chatApi->releaseVideoListenerSlot(chatid, peerid, clientid, mListenerSlot);
 }
 
 void* MegaChatVideoReceiver::getImageBuffer(unsigned short width, unsigned short height, void*& userData)
 {
-    MegaChatVideoFrame *frame = new MegaChatVideoFrame;
-    frame->width = width;
-    frame->height = height;
-    frame->buffer = new ::mega::byte[width * height * 4];  // in format ARGB: 4 bytes per pixel
+    MegaChatVideoFrame *frame = mFramePool->acquire(width, height);
+    frame->pool = mFramePool;
+    frame->refCount = 1;
     userData = frame;
     return frame->buffer;
 }
 
 void MegaChatVideoReceiver::frameComplete(void *userData)
 {
-    chatApi->videoMutex.lock();
     MegaChatVideoFrame *frame = (MegaChatVideoFrame *)userData;
-    chatApi->fireOnChatVideoData(chatid, peerid, clientid, frame->width, frame->height, (char *)frame->buffer);
-    chatApi->videoMutex.unlock();
-    delete [] frame->buffer;
-    delete frame;
+    mListenerSlot->deliver([this, frame](const MegaChatVideoListenerSlot::ListenerList &listeners)
+    {
+        chatApi->fireOnChatVideoData(chatid, listeners, frame);
+    });
+
+    if (--frame->refCount == 0)
+    {
+        // not retained by the app, the buffer will be reused for the next frame
+        mFramePool->release(frame);
+    }
+}
+
+int MegaChatVideoReceiver::videoFormat()
+{
+    return mListenerSlot->acceptsI420()
+            ? rtcModule::IVideoRenderer::kVideoFormatI420
+            : rtcModule::IVideoRenderer::kVideoFormatARGB;
+}
+
+void MegaChatVideoReceiver::frameI420(unsigned short width, unsigned short height,
+                                      const unsigned char *dataY, int strideY,
+                                      const unsigned char *dataU, int strideU,
+                                      const unsigned char *dataV, int strideV)
+{
+    mListenerSlot->deliver([&](const MegaChatVideoListenerSlot::ListenerList &listeners)
+    {
+        chatApi->fireOnChatVideoDataI420(chatid, listeners, width, height,
+                                         (const char *)dataY, strideY, (const char *)dataU, strideU, (const char *)dataV, strideV);
+    });
 }
 
 void MegaChatVideoReceiver::onVideoAttach()
@@ -5844,6 +6519,13 @@ void MegaChatRoomHandler::fireOnHistoryReloaded(MegaChatRoom *chat)
     delete chat;
 }
 
+MegaChatRoomPrivate *MegaChatRoomHandler::getUpdatedChatRoom()
+{
+    // the entry must be invalidated first, so the room is built from the live chatroom
+    chatApiImpl->invalidateChatListSnapshot(chatid);
+    return (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+}
+
 void MegaChatRoomHandler::onUserTyping(karere::Id user)
 {
     MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
@@ -5885,7 +6567,7 @@ void MegaChatRoomHandler::onLastMessageTsUpdated(uint32_t ts)
 
 void MegaChatRoomHandler::onHistoryReloaded()
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = getUpdatedChatRoom();
     fireOnHistoryReloaded(chat);
 }
 
@@ -5979,7 +6661,7 @@ std::set<MegaChatHandle> *MegaChatRoomHandler::handleNewMessage(MegaChatMessage
 
 void MegaChatRoomHandler::onMemberNameChanged(uint64_t /*userid*/, const std::string &/*newName*/)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = getUpdatedChatRoom();
     chat->setMembersUpdated();
 
     fireOnChatRoomUpdate(chat);
@@ -5987,7 +6669,7 @@ void MegaChatRoomHandler::onMemberNameChanged(uint64_t /*userid*/, const std::st
 
 void MegaChatRoomHandler::onChatArchived(bool archived)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = getUpdatedChatRoom();
     chat->setArchived(archived);
 
     fireOnChatRoomUpdate(chat);
@@ -5995,7 +6677,7 @@ void MegaChatRoomHandler::onChatArchived(bool archived)
 
 void MegaChatRoomHandler::onTitleChanged(const string &title)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = getUpdatedChatRoom();
     chat->setTitle(title);
 
     fireOnChatRoomUpdate(chat);
@@ -6003,7 +6685,7 @@ void MegaChatRoomHandler::onTitleChanged(const string &title)
 
 void MegaChatRoomHandler::onChatModeChanged(bool mode)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = getUpdatedChatRoom();
     chat->setChatMode(mode);
 
     fireOnChatRoomUpdate(chat);
@@ -6011,7 +6693,7 @@ void MegaChatRoomHandler::onChatModeChanged(bool mode)
 
 void MegaChatRoomHandler::onUnreadCountChanged(int count)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = getUpdatedChatRoom();
     chat->setUnreadCount(count);
 
     fireOnChatRoomUpdate(chat);
@@ -6019,7 +6701,7 @@ void MegaChatRoomHandler::onUnreadCountChanged(int count)
 
 void MegaChatRoomHandler::onPreviewersCountUpdate(uint32_t numPrev)
 {
-    MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
+    MegaChatRoomPrivate *chat = getUpdatedChatRoom();
     chat->setNumPreviewers(numPrev);
 
     fireOnChatRoomUpdate(chat);
@@ -6202,6 +6884,7 @@ void MegaChatRoomHandler::onUserJoin(Id userid, Priv privilege)
         // forward the event to the chatroom, so chatlist items also receive the notification
         mRoom->onUserJoin(userid, privilege);
 
+        chatApiImpl->invalidateChatListSnapshot(chatid);
         MegaChatRoomPrivate *chatroom = new MegaChatRoomPrivate(*mRoom);
         if (userid.val == chatApiImpl->getMyUserHandle())
         {
@@ -6222,6 +6905,7 @@ void MegaChatRoomHandler::onUserLeave(Id userid)
         // forward the event to the chatroom, so chatlist items also receive the notification
         mRoom->onUserLeave(userid);
 
+        chatApiImpl->invalidateChatListSnapshot(chatid);
         MegaChatRoomPrivate *chatroom = new MegaChatRoomPrivate(*mRoom);
         chatroom->setMembersUpdated();
         fireOnChatRoomUpdate(chatroom);
@@ -6232,6 +6916,7 @@ void MegaChatRoomHandler::onRejoinedChat()
 {
     if (mRoom)
     {
+        chatApiImpl->invalidateChatListSnapshot(chatid);
         MegaChatRoomPrivate *chatroom = new MegaChatRoomPrivate(*mRoom);
         fireOnChatRoomUpdate(chatroom);
     }
@@ -6241,6 +6926,7 @@ void MegaChatRoomHandler::onExcludedFromChat()
 {
     if (mRoom)
     {
+        chatApiImpl->invalidateChatListSnapshot(chatid);
         MegaChatRoomPrivate *chatroom = new MegaChatRoomPrivate(*mRoom);
         chatroom->setClosed();
         fireOnChatRoomUpdate(chatroom);
@@ -6256,6 +6942,7 @@ void MegaChatRoomHandler::onUnreadChanged()
 
         if (mChat)
         {
+            chatApiImpl->invalidateChatListSnapshot(chatid);
             MegaChatRoomPrivate *chatroom = new MegaChatRoomPrivate(*mRoom);
             chatroom->setUnreadCount(mChat->unreadMsgCount());
             fireOnChatRoomUpdate(chatroom);
@@ -6441,9 +7128,9 @@ MegaChatRoomPrivate::MegaChatRoomPrivate(const ChatRoom &chat)
     if (group)
     {
         GroupChatRoom &groupchat = (GroupChatRoom&) chat;
-        GroupChatRoom::MemberMap peers = groupchat.peers();
+        const GroupChatRoom::MemberMap& peers = groupchat.peers();
 
-        GroupChatRoom::MemberMap::iterator it;
+        GroupChatRoom::MemberMap::const_iterator it;
         for (it = peers.begin(); it != peers.end(); it++)
         {
             this->peers.push_back(userpriv_pair(it->first, (privilege_t) it->second->priv()));
@@ -7256,6 +7943,12 @@ void MegaChatGroupListItemHandler::onUserJoin(uint64_t userid, Priv priv)
     chatApi.fireOnChatListItemUpdate(item);
 }
 
+void MegaChatGroupListItemHandler::onMemberNameChanged(uint64_t /*userid*/, const std::string &/*newName*/)
+{
+    // names are not notified as a chat-list item change, but they are part of the snapshot
+    chatApi.invalidateChatListSnapshot(mRoom.chatid());
+}
+
 void MegaChatGroupListItemHandler::onUserLeave(uint64_t )
 {
     MegaChatListItemPrivate *item = new MegaChatListItemPrivate(mRoom);
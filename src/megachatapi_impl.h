@@ -43,6 +43,8 @@
 #include <karereCommon.h>
 #include <logger.h>
 #include <stdint.h>
+#include <atomic>
+#include <chrono>
 #include "net/libwebsocketsIO.h"
 #include "waiter/libuvWaiter.h"
 
@@ -65,7 +67,8 @@ namespace megachat
 {
     
 typedef std::set<MegaChatVideoListener *> MegaChatVideoListener_set;
-typedef std::map<chatd::EndpointId, MegaChatVideoListener_set> MegaChatPeerVideoListener_map;
+class MegaChatVideoListenerSlot;
+typedef std::map<chatd::EndpointId, std::shared_ptr<MegaChatVideoListenerSlot>> MegaChatPeerVideoListener_map;
 
 class MegaChatRequestPrivate : public MegaChatRequest
 {
@@ -283,12 +286,110 @@ protected:
     bool mIsCaller;
 };
 
+class MegaChatVideoFramePool;
+
 class MegaChatVideoFrame
 {
 public:
+    MegaChatVideoFrame(int width, int height);
+    ~MegaChatVideoFrame();
+
     unsigned char *buffer;
     int width;
     int height;
+    size_t size;
+
+    // references held by the receiver (while notifying the frame) and by the app
+    std::atomic<int> refCount;
+
+    // number of times the app has retained the buffer (see MegaChatApi::retainVideoBuffer).
+    // Protected by MegaChatApiImpl::videoMutex
+    int appRetains = 0;
+
+    // pool the frame is returned to when it's released by the app. If the receiver has been
+    // destroyed in the meantime, the frame is just deleted
+    std::weak_ptr<MegaChatVideoFramePool> pool;
+};
+
+/**
+ * @brief Pool of frame buffers for a given video stream
+ *
+ * Decoded frames are written to buffers taken from the pool and returned to it once the
+ * listeners are done with them, instead of allocating and freeing a buffer per frame.
+ * Only buffers of the current resolution are kept: upon a resolution change, the free
+ * buffers are discarded, and at most kMaxFreeFrames buffers are kept at any time.
+ *
+ * Frames may be returned from any thread.
+ */
+class MegaChatVideoFramePool
+{
+public:
+    ~MegaChatVideoFramePool();
+    MegaChatVideoFrame *acquire(int width, int height);
+    void release(MegaChatVideoFrame *frame);
+
+protected:
+    static const size_t kMaxFreeFrames = 3;
+
+    std::mutex mMutex;
+    int mWidth = 0;
+    int mHeight = 0;
+    std::vector<MegaChatVideoFrame *> mFreeFrames;
+    void clear();
+};
+
+/**
+ * @brief Video listeners of a stream (chatid + peer + client)
+ *
+ * The receiver of the stream keeps a reference to its slot, so frames are delivered
+ * without looking up MegaChatApiImpl::videoListeners. The list of listeners is never
+ * modified, but replaced by a new one upon add/remove, so frames of different streams
+ * are delivered concurrently without holding videoMutex.
+ */
+class MegaChatVideoListenerSlot
+{
+public:
+    typedef std::vector<MegaChatVideoListener *> ListenerList;
+
+    MegaChatVideoListenerSlot();
+
+    // must be called with videoMutex locked
+    void add(MegaChatVideoListener *listener);
+    // must be called with videoMutex locked
+    void remove(MegaChatVideoListener *listener);
+    bool empty() const;
+
+    // a receiver of the stream starts/stops using the slot. Must be called with videoMutex locked
+    void addReceiver();
+    void removeReceiver();
+    // true if there are no listeners and no receiver, so it can be removed. Must be called with videoMutex locked
+    bool unused() const;
+
+    // returns once the frame being delivered (if any) has been notified to all its listeners.
+    // Must be called without videoMutex locked, since listeners may need it
+    void waitForDelivery();
+
+    // true if all the listeners accept frames in I420, serialized with remove()
+    bool acceptsI420();
+
+    // calls f with the current list of listeners, serialized with remove()
+    template <class F>
+    void deliver(F&& f)
+    {
+        std::lock_guard<std::mutex> lock(mDeliveryMutex);
+        sDeliveringSlot = this;
+        std::shared_ptr<const ListenerList> listeners = std::atomic_load(&mListeners);
+        f(*listeners);
+        sDeliveringSlot = nullptr;
+    }
+
+protected:
+    MegaChatVideoListener_set mListenerSet;
+    std::shared_ptr<const ListenerList> mListeners;
+    int mReceivers;
+    std::mutex mDeliveryMutex;
+    static thread_local MegaChatVideoListenerSlot *sDeliveringSlot;
+    void publish();
 };
 
 class MegaChatVideoReceiver : public rtcModule::IVideoRenderer
@@ -304,6 +405,11 @@ public:
     // rtcModule::IVideoRenderer implementation
     virtual void* getImageBuffer(unsigned short width, unsigned short height, void*& userData);
     virtual void frameComplete(void* userData);
+    virtual int videoFormat();
+    virtual void frameI420(unsigned short width, unsigned short height,
+                           const unsigned char *dataY, int strideY,
+                           const unsigned char *dataU, int strideU,
+                           const unsigned char *dataV, int strideV);
     virtual void onVideoAttach();
     virtual void onVideoDetach();
     virtual void clearViewport();
@@ -315,6 +421,8 @@ protected:
     MegaChatHandle chatid;
     MegaChatHandle peerid;
     uint32_t clientid;
+    std::shared_ptr<MegaChatVideoFramePool> mFramePool;
+    std::shared_ptr<MegaChatVideoListenerSlot> mListenerSlot;
 };
 
 #endif
@@ -432,6 +540,7 @@ public:
     // karere::IApp::IListItem::IGroupChatListItem implementation
     virtual void onUserJoin(uint64_t userid, chatd::Priv priv);
     virtual void onUserLeave(uint64_t userid);
+    virtual void onMemberNameChanged(uint64_t userid, const std::string &newName);
 };
 
 class MegaChatPeerListItemHandler :
@@ -509,6 +618,8 @@ public:
     std::set<MegaChatHandle> *handleNewMessage(MegaChatMessage *msg);
 
 protected:
+    // returns a copy of the live chatroom, after invalidating it in the chat-list snapshot
+    MegaChatRoomPrivate *getUpdatedChatRoom();
 
 private:
     MegaChatApiImpl *chatApiImpl;
@@ -883,19 +994,117 @@ class ChatRequestQueue
         void removeListener(MegaChatRequestListener *listener);
 };
 
-//Thread safe transfer queue
+//Thread safe event queue, lock-free for many producers and a single consumer (the karere thread)
 class EventQueue
 {
+public:
+    struct Stats
+    {
+        uint64_t posted = 0;            // events pushed since creation
+        uint64_t processed = 0;         // events taken by the consumer since creation
+        uint64_t wakeups = 0;           // pushes that had to wake up the consumer
+        uint64_t batches = 0;           // number of times the consumer drained the queue
+        size_t depth = 0;               // events currently waiting
+        size_t maxDepth = 0;            // highest number of events waiting at once
+        uint64_t totalLatencyUs = 0;    // sum of the time events spent in the queue
+        uint64_t maxLatencyUs = 0;      // longest time an event spent in the queue
+    };
+
+    EventQueue();
+    ~EventQueue();
+
+    /** Adds an event. Returns true if the consumer may be blocked and must be notified */
+    bool push(void* event);
+
+    /** Takes all pending events in a single operation and passes them to \c process in
+     * the order they were pushed. Returns the number of events processed */
+    size_t drain(void (*process)(void*));
+
+    /** Called by the consumer before blocking. From now on, producers will request
+     * a notification. Returns false if events were pushed since the last drain */
+    bool prepareWait();
+
+    /** Called by the consumer after waking up, to suppress notifications again */
+    void setAwake();
+
+    bool isEmpty() const;
+    size_t size() const;
+    Stats getStats() const;
+    /** Adds the stats to \c metrics, as karere_events_* counters and gauges */
+    void addMetrics(karere::Metrics& metrics) const;
+
 protected:
-    std::deque<void *> events;
-    std::mutex mutex;
+    struct Node
+    {
+        void* event;
+        Node* next;
+        int64_t postTs;     // microseconds, to measure the queueing delay
+    };
+
+    // pushed nodes form a stack; the consumer takes it at once and reverses it
+    std::atomic<Node*> mHead;
+    std::atomic<bool> mConsumerAwake;
+
+    std::atomic<size_t> mDepth;
+    std::atomic<size_t> mMaxDepth;
+    std::atomic<uint64_t> mPosted;
+    std::atomic<uint64_t> mProcessed;
+    std::atomic<uint64_t> mWakeups;
+    std::atomic<uint64_t> mBatches;
+    std::atomic<uint64_t> mTotalLatencyUs;
+    std::atomic<uint64_t> mMaxLatencyUs;
+
+    static int64_t nowUs();
+};
 
+/** @brief Immutable copy of the chat list
+ *
+ * The karere thread publishes a new snapshot after each batch of events that changed
+ * any chatroom, so that apps can query the chat list without waiting for sdkMutex.
+ * The entries, sorted by chatid, are kept in chunks shared between consecutive snapshots
+ * (copy-on-write): a new snapshot only copies the chunks of the changed chatrooms and
+ * the list of chunks.
+ */
+class ChatListSnapshot
+{
 public:
-    void push(void* event);
-    void push_front(void *event);
-    void* pop();
-    bool isEmpty();
-    size_t size();
+    struct Entry
+    {
+        Entry(karere::ChatRoom& chatroom, uint64_t aVersion);
+        MegaChatRoomPrivate room;
+        MegaChatListItemPrivate item;
+        uint64_t version;   // version of the snapshot where this entry was last updated
+    };
+    typedef std::vector<std::shared_ptr<const Entry>> Chunk;    // sorted by chatid, never empty
+    enum { kChunkSize = 64 };   // entries per chunk. Chunks are split when twice as large
+
+    explicit ChatListSnapshot(uint64_t version = 0): mVersion(version) {}
+    // Builds a snapshot of all the chatrooms
+    ChatListSnapshot(uint64_t version, karere::ChatRoomList& chats);
+    // Builds the next snapshot of \c previous, updating the entries of the chatrooms in \c changed
+    // (or removing them, if they are not in \c chats anymore)
+    ChatListSnapshot(const ChatListSnapshot& previous, uint64_t version, karere::ChatRoomList& chats,
+                     const std::set<MegaChatHandle>& changed);
+    uint64_t version() const { return mVersion; }
+    const Entry* find(MegaChatHandle chatid) const;
+    template <class F>
+    void forEach(F f) const
+    {
+        for (auto& chunk: mChunks)
+        {
+            for (auto& entry: *chunk)
+            {
+                f(*entry);
+            }
+        }
+    }
+
+protected:
+    uint64_t mVersion;
+    std::vector<std::shared_ptr<const Chunk>> mChunks;  // sorted by chatid
+
+    void addChunk(Chunk&& chunk);
+    static void updateEntry(Chunk& chunk, MegaChatHandle chatid, karere::ChatRoomList& chats, uint64_t version);
 };
 
 class MegaChatApiImpl :
@@ -926,6 +1135,7 @@ private:
     void init(MegaChatApi *chatApi, mega::MegaApi *megaApi);
 
     static LoggerHandler *loggerHandler;
+    static bool websocketsCompression;
 
     ChatRequestQueue requestQueue;
     EventQueue eventQueue;
@@ -946,6 +1156,9 @@ private:
     std::set<MegaChatCallListener *> callListeners;
     std::map<MegaChatHandle, MegaChatPeerVideoListener_map> videoListeners;
 
+    // frames retained by the app, indexed by their buffer. Protected by videoMutex
+    std::map<char *, MegaChatVideoFrame *> mRetainedVideoFrames;
+
     mega::MegaStringList *getChatInDevices(const std::set<std::string> &devices);
     void cleanCallHandlerMap();
 #endif
@@ -954,6 +1167,21 @@ private:
 
     static int convertInitState(int state);
 
+    // Chat-list snapshot, read without sdkMutex through std::atomic_load/atomic_store
+    std::shared_ptr<const ChatListSnapshot> mChatListSnapshot;
+    // True while the karere thread has changes not yet published to the snapshot
+    std::atomic<bool> mChatListSnapshotStale;
+    // Chatrooms changed since the last snapshot. Protected by sdkMutex
+    std::set<MegaChatHandle> mChatListDirtyChats;
+    bool mChatListFullRefresh;
+
+    void publishChatListSnapshot();
+    // Returns the last published snapshot, without locking sdkMutex
+    std::shared_ptr<const ChatListSnapshot> getChatListSnapshot();
+    // Calls \c f for every item of the chat list. If the snapshot is stale (i.e. while the changes
+    // are notified to the app) they are taken from the chatrooms instead, under sdkMutex
+    void forEachChatListItem(const std::function<void(const MegaChatListItemPrivate&)>& f);
+
 public:
     static void megaApiPostMessage(void* msg, void* ctx);
     void postMessage(void *msg);
@@ -965,6 +1193,7 @@ public:
     static void setLoggerClass(MegaChatLogger *megaLogger);
     static void setLogWithColors(bool useColors);
     static void setLogToConsole(bool enable);
+    static void setWebsocketsCompression(bool enable);
 
     int init(const char *sid);
     int initAnonymous();
@@ -1012,6 +1241,8 @@ public:
     void removeChatCallListener(MegaChatCallListener *listener);
     void addChatVideoListener(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, MegaChatVideoListener *listener);
     void removeChatVideoListener(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, MegaChatVideoListener *listener);
+    bool retainVideoBuffer(char *buffer);
+    void releaseVideoBuffer(char *buffer);
 #endif
 
     // MegaChatRequestListener callbacks
@@ -1025,11 +1256,22 @@ public:
     void fireOnChatCallUpdate(MegaChatCallPrivate *call);
 
     // MegaChatVideoListener callbacks
-    void fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, int width, int height, char*buffer);
+    void fireOnChatVideoData(MegaChatHandle chatid, const MegaChatVideoListenerSlot::ListenerList &listeners, MegaChatVideoFrame *frame);
+    void fireOnChatVideoDataI420(MegaChatHandle chatid, const MegaChatVideoListenerSlot::ListenerList &listeners, int width, int height,
+                                 const char *dataY, int strideY, const char *dataU, int strideU, const char *dataV, int strideV);
+
+    // returns the listeners of a stream, creating an empty slot if there are none yet
+    std::shared_ptr<MegaChatVideoListenerSlot> getVideoListenerSlot(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid);
+    // called by a receiver of the stream, to get its slot and keep it while in use
+    std::shared_ptr<MegaChatVideoListenerSlot> acquireVideoListenerSlot(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid);
+    // called by a receiver that doesn't need the slot anymore, to remove it if it's empty and unused
+    void releaseVideoListenerSlot(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, std::shared_ptr<MegaChatVideoListenerSlot> &slot);
 #endif
 
     // MegaChatListener callbacks (specific ones)
     void fireOnChatListItemUpdate(MegaChatListItem *item);
+    // Marks the chatroom to be refreshed in the next chat-list snapshot
+    void invalidateChatListSnapshot(MegaChatHandle chatid);
     void fireOnChatInitStateUpdate(int newState);
     void fireOnChatOnlineStatusUpdate(MegaChatHandle userhandle, int status, bool inProgress);
     void fireOnChatPresenceConfigUpdate(MegaChatPresenceConfig *config);
@@ -1087,6 +1329,8 @@ public:
     MegaChatListItemList *getChatListItemsByPeers(MegaChatPeerList *peers);
     MegaChatListItem *getChatListItem(MegaChatHandle chatid);
     int getUnreadChats();
+    int64_t getChatListVersion();
+    MegaChatListItemList *getChatListItemsSince(int64_t version);
     MegaChatListItemList *getActiveChatListItems();
     MegaChatListItemList *getInactiveChatListItems();
     MegaChatListItemList *getArchivedChatListItems();
@@ -1117,6 +1361,13 @@ public:
 
     int loadMessages(MegaChatHandle chatid, int count);
     bool isFullHistoryLoaded(MegaChatHandle chatid);
+    void setResidentHistoryLimits(unsigned int maxPerChat, unsigned int maxTotal);
+    int getResidentMessageCount(MegaChatHandle chatid);
+    int getTotalResidentMessageCount();
+    char *getMemoryReport();
+    void setLoopProfilerEnabled(bool enable, int slowThresholdMs, int dumpIntervalSec);
+    char *getLoopProfile();
+    char *getNetworkMetrics(int format);
     MegaChatErrorPrivate *addReaction(MegaChatHandle chatid, MegaChatHandle msgid, const char *reaction);
     MegaChatErrorPrivate *delReaction(MegaChatHandle chatid, MegaChatHandle msgid, const char *reaction);
     MegaChatMessage *getMessage(MegaChatHandle chatid, MegaChatHandle msgid);
@@ -17,15 +17,29 @@ static struct lws_protocols protocols[] =
     { NULL, NULL, 0, 0 } /* terminator */
 };
 
-LibwebsocketsIO::LibwebsocketsIO(Mutex &mutex, ::mega::Waiter* waiter, ::mega::MegaApi *api, void *ctx) : WebsocketsIO(mutex, api, ctx)
+LibwebsocketsIO::LibwebsocketsIO(Mutex &mutex, ::mega::Waiter* waiter, ::mega::MegaApi *api, void *ctx, const DeflateOptions &deflate)
+    : WebsocketsIO(mutex, api, ctx), mDeflate(deflate)
 {
     struct lws_context_creation_info info;
     memset( &info, 0, sizeof(info) );
+
+    memset(mExtensions, 0, sizeof(mExtensions));
+    if (mDeflate.enabled)
+    {
+        // history pages repeat the same ids in every message, so they compress very well
+        mDeflateOffer = "permessage-deflate; client_max_window_bits=" + std::to_string(mDeflate.windowBits)
+                + "; server_max_window_bits=" + std::to_string(mDeflate.windowBits);
+        mExtensions[0].name = "permessage-deflate";
+        mExtensions[0].callback = lws_extension_callback_pm_deflate;
+        mExtensions[0].client_offer = mDeflateOffer.c_str();
+        info.extensions = mExtensions;
+    }
     
     info.port = CONTEXT_PORT_NO_LISTEN;
     info.protocols = protocols;
     info.gid = -1;
     info.uid = -1;
+    info.user = this;   // to be retrieved when the client SSL_CTX is created
     info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
     info.options |= LWS_SERVER_OPTION_DISABLE_OS_CA_CERTS;
     info.options |= LWS_SERVER_OPTION_LIBUV;
@@ -48,6 +62,101 @@ LibwebsocketsIO::LibwebsocketsIO(Mutex &mutex, ::mega::Waiter* waiter, ::mega::M
 LibwebsocketsIO::~LibwebsocketsIO()
 {
     lws_context_destroy(wscontext);
+
+    for (auto &it: mTlsSessions)
+    {
+        SSL_SESSION_free(it.second);
+    }
+}
+
+static int sslCtxDataIndex()
+{
+    static int index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    return index;
+}
+
+LibwebsocketsIO *LibwebsocketsIO::fromSsl(const SSL *ssl)
+{
+    return static_cast<LibwebsocketsIO *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), sslCtxDataIndex()));
+}
+
+void LibwebsocketsIO::initSslCtx(SSL_CTX *sslCtx)
+{
+    // OpenSSL doesn't reuse client sessions by itself: keep them here, keyed by hostname (SNI)
+    SSL_CTX_set_ex_data(sslCtx, sslCtxDataIndex(), this);
+    SSL_CTX_set_session_cache_mode(sslCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(sslCtx, sslNewSessionCallback);
+    SSL_CTX_set_info_callback(sslCtx, sslInfoCallback);
+}
+
+int LibwebsocketsIO::sslNewSessionCallback(SSL *ssl, SSL_SESSION *session)
+{
+    LibwebsocketsIO *self = fromSsl(ssl);
+    const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!self || !host)
+    {
+        return 0;
+    }
+
+    SSL_SESSION *&cached = self->mTlsSessions[host];
+    if (cached)
+    {
+        SSL_SESSION_free(cached);
+    }
+    cached = session;
+    return 1;   // we keep the reference
+}
+
+void LibwebsocketsIO::sslInfoCallback(const SSL *ssl, int where, int /*ret*/)
+{
+    // the ClientHello is not built yet: last chance to offer the cached session
+    if (!(where & SSL_CB_HANDSHAKE_START) || !SSL_in_before(ssl))
+    {
+        return;
+    }
+
+    LibwebsocketsIO *self = fromSsl(ssl);
+    const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!self || !host)
+    {
+        return;
+    }
+
+    auto it = self->mTlsSessions.find(host);
+    if (it != self->mTlsSessions.end())
+    {
+        SSL_set_session(const_cast<SSL *>(ssl), it->second);
+    }
+}
+
+void LibwebsocketsIO::onConnectionEstablished(struct lws *wsi)
+{
+    onHandshakeDone(lws_get_ssl(wsi));
+
+    if (mDeflate.enabled)
+    {
+        // the memory level is a local setting, not negotiated with the server. It has no effect
+        // if the server didn't accept the extension
+        lws_set_extension_option(wsi, "permessage-deflate", "mem_level", std::to_string(mDeflate.memLevel).c_str());
+    }
+}
+
+void LibwebsocketsIO::onHandshakeDone(SSL *ssl)
+{
+    if (!ssl)
+    {
+        return; // not a TLS connection
+    }
+
+    if (SSL_session_reused(ssl))
+    {
+        mTlsStats.resumedHandshakes++;
+        WEBSOCKETS_LOG_DEBUG("TLS session resumed");
+    }
+    else
+    {
+        mTlsStats.fullHandshakes++;
+    }
 }
 
 void LibwebsocketsIO::addevents(::mega::Waiter* waiter, int)
@@ -151,13 +260,16 @@ LibwebsocketsClient::LibwebsocketsClient(WebsocketsIO::Mutex &mutex, WebsocketsC
 LibwebsocketsClient::~LibwebsocketsClient()
 {
     wsDisconnect(true);
+    wsRecvBufferCb(0);
 }
 
 void LibwebsocketsClient::appendMessageFragment(char *data, size_t len, size_t remaining)
 {
-    if (!recbuffer.size() && remaining)
+    size_t required = recbuffer.size() + len + remaining;
+    if (required > recbuffer.capacity())
     {
-        recbuffer.reserve(len + remaining);
+        recbuffer.reserve(required);
+        wsRecvBufferCb(recbuffer.capacity());
     }
     recbuffer.append(data, len);
 }
@@ -179,7 +291,34 @@ size_t LibwebsocketsClient::getMessageLength()
 
 void LibwebsocketsClient::resetMessage()
 {
-    recbuffer.clear();
+    // messages delivered straight from the libwebsockets buffer don't need the reassembly buffer,
+    // but they count for the period too, so the memory of a past burst is released anyway
+    if (recbuffer.size() > mRecvHighWater)
+    {
+        mRecvHighWater = recbuffer.size();
+    }
+    recbuffer.clear();  // keeps the capacity for the next message
+
+    if (++mRecvMessages < kRecvShrinkPeriod)
+    {
+        return;
+    }
+
+    // a burst of large messages is over: release the memory not needed by the recent ones
+    size_t keep = 2 * mRecvHighWater;
+    if (keep < kRecvBufferMinKeep)
+    {
+        keep = kRecvBufferMinKeep;
+    }
+    if (recbuffer.capacity() > keep)
+    {
+        std::string buffer;
+        buffer.reserve(mRecvHighWater);
+        recbuffer.swap(buffer);
+        wsRecvBufferCb(recbuffer.capacity());
+    }
+    mRecvHighWater = 0;
+    mRecvMessages = 0;
 }
 
 bool LibwebsocketsClient::wsSendMessage(char *msg, size_t len)
@@ -254,6 +393,26 @@ bool LibwebsocketsClient::wsIsConnected()
     return wsi != NULL;
 }
 
+void LibwebsocketsClient::updateWireStats()
+{
+    SSL *ssl = wsi ? lws_get_ssl(wsi) : NULL;
+    if (!ssl)
+    {
+        return;
+    }
+
+    // counters of the BIOs below TLS: bytes actually transferred through the socket
+    uint64_t bytesRead = BIO_number_read(SSL_get_rbio(ssl));
+    uint64_t bytesWritten = BIO_number_written(SSL_get_wbio(ssl));
+    if (bytesRead < mWireBytesRead || bytesWritten < mWireBytesWritten)
+    {
+        return;
+    }
+    wsWireBytesCb(bytesWritten - mWireBytesWritten, bytesRead - mWireBytesRead);
+    mWireBytesRead = bytesRead;
+    mWireBytesWritten = bytesWritten;
+}
+
 const char *LibwebsocketsClient::getOutputBuffer()
 {
     return sendbuffer.size() ? sendbuffer.data() + LWS_PRE : NULL;
@@ -343,6 +502,15 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
 
     switch (reason)
     {
+        case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_CLIENT_VERIFY_CERTS:
+        {
+            LibwebsocketsIO *io = static_cast<LibwebsocketsIO *>(lws_context_user(lws_get_context(wsi)));
+            if (io && user)
+            {
+                io->initSslCtx((SSL_CTX *)user);
+            }
+            break;
+        }
         case LWS_CALLBACK_OPENSSL_PERFORM_SERVER_CERT_VERIFICATION:
         {
             if (check_public_key((X509_STORE_CTX*)user))
@@ -358,7 +526,13 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
             {
                 return -1;
             }
-            
+
+            LibwebsocketsIO *io = static_cast<LibwebsocketsIO *>(lws_context_user(lws_get_context(wsi)));
+            if (io)
+            {
+                io->onConnectionEstablished(wsi);
+            }
+            client->updateWireStats();
             client->wsConnectCb();
             break;
         }
@@ -387,6 +561,7 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 WEBSOCKETS_LOG_DEBUG("Diagnostic: %s", buf.c_str());
             }
 
+            client->updateWireStats();
             if (client->wsIsConnected())
             {
                 struct lws *dwsi = client->wsi;
@@ -405,9 +580,11 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 return -1;
             }
             
+            client->updateWireStats();
             const size_t remaining = lws_remaining_packet_payload(wsi);
             if (!remaining && lws_is_final_fragment(wsi))
             {
+                // unfragmented messages are delivered from the libwebsockets buffer, without copies
                 if (client->hasFragments())
                 {
                     WEBSOCKETS_LOG_DEBUG("Fragmented data completed");
@@ -446,6 +623,7 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
             if (len && data)
             {
                 lws_write(wsi, (unsigned char *)data, len, LWS_WRITE_BINARY);
+                client->updateWireStats();
                 client->wsSendMsgCb((const char *)data, len);
                 client->resetOutputBuffer();
             }
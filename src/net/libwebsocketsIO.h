@@ -5,6 +5,7 @@
 #include <openssl/ssl.h>
 #include <iostream>
 #include <functional>
+#include <map>
 
 #include "net/websocketsIO.h"
 
@@ -12,15 +13,40 @@
 class LibwebsocketsIO : public WebsocketsIO
 {
 public:
+    // Options for the permessage-deflate extension (RFC 7692)
+    struct DeflateOptions
+    {
+        bool enabled = true;
+        int windowBits = 15;    // LZ77 window (9..15) for both directions. Smaller values use less memory
+        int memLevel = 8;       // zlib memory level for compression (1..9)
+    };
+
     struct lws_context *wscontext;
     uv_loop_t* eventloop;
 
-    LibwebsocketsIO(Mutex &mutex, ::mega::Waiter* waiter, ::mega::MegaApi *api, void *ctx);
+    LibwebsocketsIO(Mutex &mutex, ::mega::Waiter* waiter, ::mega::MegaApi *api, void *ctx,
+                    const DeflateOptions &deflate = DeflateOptions());
     virtual ~LibwebsocketsIO();
     
     virtual void addevents(::mega::Waiter*, int);
-    
+
+    // TLS session cache, so reconnections to the same host resume the previous session
+    // instead of doing a full handshake
+    void initSslCtx(SSL_CTX *sslCtx);
+    void onHandshakeDone(SSL *ssl);
+    void onConnectionEstablished(struct lws *wsi);
+
 protected:
+    DeflateOptions mDeflate;
+    std::string mDeflateOffer;
+    struct lws_extension mExtensions[2];
+
+    std::map<std::string, SSL_SESSION *> mTlsSessions;   // maps hostname to its last session
+
+    static void sslInfoCallback(const SSL *ssl, int where, int ret);
+    static int sslNewSessionCallback(SSL *ssl, SSL_SESSION *session);
+    static LibwebsocketsIO *fromSsl(const SSL *ssl);
+
     virtual bool wsResolveDNS(const char *hostname, std::function<void(int, std::vector<std::string>&, std::vector<std::string>&)> f);
     virtual WebsocketsClientImpl *wsConnect(const char *ip, const char *host,
                                            int port, const char *path, bool ssl,
@@ -35,8 +61,18 @@ public:
     virtual ~LibwebsocketsClient();
     
 protected:
+    // Reassembly buffer for fragmented messages. Its capacity is kept between messages, and
+    // only shrunk when the recent messages need much less than what it holds
     std::string recbuffer;
+    size_t mRecvHighWater = 0;      // largest message reassembled in the current period
+    unsigned int mRecvMessages = 0; // messages received in the current period, fragmented or not
+    static const unsigned int kRecvShrinkPeriod = 64;
+    static const size_t kRecvBufferMinKeep = 256 * 1024;
     std::string sendbuffer;
+    uint64_t mWireBytesRead = 0;    // last values seen at the SSL BIOs
+    uint64_t mWireBytesWritten = 0;
+
+    void updateWireStats();
 
     void appendMessageFragment(char *data, size_t len, size_t remaining);
     bool hasFragments();
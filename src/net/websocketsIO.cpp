@@ -11,6 +11,45 @@ WebsocketsIO::~WebsocketsIO()
     
 }
 
+bool WebsocketsIO::resolveDNS(const char *hostname, DNSResolveCb f)
+{
+    std::string host(hostname);
+    auto it = mPendingDnsQueries.find(host);
+    if (it != mPendingDnsQueries.end())
+    {
+        WEBSOCKETS_LOG_DEBUG("DNS resolution of %s already in progress", hostname);
+        it->second.push_back(f);
+        return false;
+    }
+
+    mPendingDnsQueries[host].push_back(f);
+    bool error = wsResolveDNS(hostname, [this, host](int status, std::vector<std::string> &ipsv4, std::vector<std::string> &ipsv6)
+    {
+        auto it = mPendingDnsQueries.find(host);
+        if (it == mPendingDnsQueries.end())
+        {
+            return;
+        }
+
+        std::vector<DNSResolveCb> callbacks;
+        callbacks.swap(it->second);
+        mPendingDnsQueries.erase(it);
+        for (auto &cb: callbacks)
+        {
+            // every callback gets its own copy, since they may modify them
+            std::vector<std::string> v4(ipsv4);
+            std::vector<std::string> v6(ipsv6);
+            cb(status, v4, v6);
+        }
+    });
+
+    if (error)
+    {
+        mPendingDnsQueries.erase(host);
+    }
+    return error;
+}
+
 WebsocketsClientImpl::WebsocketsClientImpl(WebsocketsIO::Mutex &m, WebsocketsClient *client)
     : mutex(m)
 {
@@ -27,7 +66,7 @@ void WebsocketsClientImpl::wsConnectCb()
 {
     WebsocketsIO::MutexGuard lock(this->mutex);
     WEBSOCKETS_LOG_DEBUG("Connection established");
-    client->wsConnectCb();
+    client->wsConnectCbPrivate(this);
 }
 
 void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len)
@@ -43,13 +82,14 @@ void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preas
         WEBSOCKETS_LOG_DEBUG("Connection closed by server");
     }
 
-    client->wsCloseCbPrivate(errcode, errtype, preason, reason_len);
+    client->wsCloseCbPrivate(this, errcode, errtype, preason, reason_len);
 }
 
 void WebsocketsClientImpl::wsHandleMsgCb(char *data, size_t len)
 {
     WebsocketsIO::MutexGuard lock(this->mutex);
     WEBSOCKETS_LOG_DEBUG("Received %d bytes", len);
+    client->mStats.payloadBytesReceived += len;
     client->wsHandleMsgCb(data, len);
 }
 
@@ -57,9 +97,27 @@ void WebsocketsClientImpl::wsSendMsgCb(const char *data, size_t len)
 {
     WebsocketsIO::MutexGuard lock(this->mutex);
     WEBSOCKETS_LOG_DEBUG("Sent %d bytes", len);
+    client->mStats.payloadBytesSent += len;
     client->wsSendMsgCb(data, len);
 }
 
+void WebsocketsClientImpl::wsWireBytesCb(size_t sent, size_t received)
+{
+    WebsocketsIO::MutexGuard lock(this->mutex);
+    client->mStats.wireBytesSent += sent;
+    client->mStats.wireBytesReceived += received;
+}
+
+void WebsocketsClientImpl::wsRecvBufferCb(size_t capacity)
+{
+    WebsocketsIO::MutexGuard lock(this->mutex);
+    // a connection racing against the current one (or losing the race) doesn't hold the reported buffer
+    if (this == client->ctx)
+    {
+        client->mStats.recvBufferBytes = capacity;
+    }
+}
+
 WebsocketsClient::WebsocketsClient()
 {
     ctx = NULL;
@@ -70,13 +128,14 @@ WebsocketsClient::WebsocketsClient()
 
 WebsocketsClient::~WebsocketsClient()
 {
+    cancelFallback();
     delete ctx;
     ctx = NULL;
 }
 
 bool WebsocketsClient::wsResolveDNS(WebsocketsIO *websocketIO, const char *hostname, std::function<void (int, std::vector<std::string>&, std::vector<std::string>&)> f)
 {
-    return websocketIO->wsResolveDNS(hostname, f);
+    return websocketIO->resolveDNS(hostname, f);
 }
 
 bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, const char *host, int port, const char *path, bool ssl)
@@ -95,7 +154,9 @@ bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, cons
         WEBSOCKETS_LOG_ERROR("Valid context at connect()");
         delete ctx;
     }
+    cancelFallback();
 
+    mIp = ip;
     ctx = websocketIO->wsConnect(ip, host, port, path, ssl, this);
     if (!ctx)
     {
@@ -104,6 +165,68 @@ bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, cons
     return ctx != NULL;
 }
 
+bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, const char *fallbackIp,
+                                 const char *host, int port, const char *path, bool ssl)
+{
+    bool hasFallback = fallbackIp && fallbackIp[0];
+    if (!ip || !ip[0])
+    {
+        return hasFallback && wsConnect(websocketIO, fallbackIp, host, port, path, ssl);
+    }
+
+    if (!wsConnect(websocketIO, ip, host, port, path, ssl))
+    {
+        return hasFallback && wsConnect(websocketIO, fallbackIp, host, port, path, ssl);
+    }
+
+    if (hasFallback)
+    {
+        mWebsocketIO = websocketIO;
+        mFallbackIp = fallbackIp;
+        mHost = host;
+        mPath = path;
+        mPort = port;
+        mSsl = ssl;
+        mFallbackTimer = karere::setTimeout([this]()
+        {
+            mFallbackTimer = 0;
+            startFallback();
+        }, kFallbackDelay, websocketIO->appCtx);
+    }
+    return true;
+}
+
+bool WebsocketsClient::startFallback()
+{
+    if (mFallbackCtx || mFallbackIp.empty())
+    {
+        return mFallbackCtx != NULL;
+    }
+
+    WEBSOCKETS_LOG_DEBUG("No connection to %s yet, racing it against %s", mIp.c_str(), mFallbackIp.c_str());
+    mFallbackCtx = mWebsocketIO->wsConnect(mFallbackIp.c_str(), mHost.c_str(), mPort, mPath.c_str(), mSsl, this);
+    if (!mFallbackCtx)
+    {
+        WEBSOCKETS_LOG_WARNING("Immediate error in wsConnect to %s", mFallbackIp.c_str());
+        mFallbackIp.clear();
+        return false;
+    }
+    return true;
+}
+
+void WebsocketsClient::cancelFallback()
+{
+    if (mFallbackTimer)
+    {
+        karere::cancelTimeout(mFallbackTimer, mWebsocketIO->appCtx);
+        mFallbackTimer = 0;
+    }
+
+    delete mFallbackCtx;
+    mFallbackCtx = NULL;
+    mFallbackIp.clear();
+}
+
 int WebsocketsClient::wsGetNoNameErrorCode(WebsocketsIO *websocketIO)
 {
     return websocketIO->wsGetNoNameErrorCode();
@@ -138,7 +261,8 @@ bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
 void WebsocketsClient::wsDisconnect(bool immediate)
 {
     WEBSOCKETS_LOG_DEBUG("Disconnecting. Immediate: %d", immediate);
-    
+
+    cancelFallback();
     if (!ctx)
     {
         return;
@@ -153,11 +277,19 @@ void WebsocketsClient::wsDisconnect(bool immediate)
 
     if (immediate)
     {
+        logStats();
         delete ctx;
         ctx = NULL;
     }
 }
 
+void WebsocketsClient::logStats() const
+{
+    WEBSOCKETS_LOG_DEBUG("Traffic with %s so far: sent %llu bytes (%llu on the wire), received %llu bytes (%llu on the wire)",
+                         mHost.c_str(), (unsigned long long)mStats.payloadBytesSent, (unsigned long long)mStats.wireBytesSent,
+                         (unsigned long long)mStats.payloadBytesReceived, (unsigned long long)mStats.wireBytesReceived);
+}
+
 bool WebsocketsClient::wsIsConnected()
 {
     if (!ctx)
@@ -174,17 +306,60 @@ bool WebsocketsClient::wsIsConnected()
     return ctx->wsIsConnected();
 }
 
-void WebsocketsClient::wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len)
+void WebsocketsClient::wsConnectCbPrivate(WebsocketsClientImpl *impl)
+{
+    if (impl == mFallbackCtx)
+    {
+        WEBSOCKETS_LOG_DEBUG("Connection to %s won the race against %s", mFallbackIp.c_str(), mIp.c_str());
+        delete ctx;
+        ctx = mFallbackCtx;
+        mFallbackCtx = NULL;
+        mIp = mFallbackIp;
+    }
+    cancelFallback();
+
+    wsConnectCb();
+}
+
+void WebsocketsClient::wsCloseCbPrivate(WebsocketsClientImpl *impl, int errcode, int errtype, const char *preason, size_t reason_len)
 {
     if (!ctx)   // immediate disconnect ocurred before the marshall is executed (only applies to libws)
     {
         return;
     }
 
+    // while racing, the failure of one attempt is not notified as long as the other one may succeed
+    if (impl == mFallbackCtx)
+    {
+        WEBSOCKETS_LOG_DEBUG("Connection to %s failed, still waiting for %s", mFallbackIp.c_str(), mIp.c_str());
+        cancelFallback();
+        return;
+    }
+    if (impl == ctx && mFallbackIp.size())
+    {
+        if (mFallbackTimer)
+        {
+            karere::cancelTimeout(mFallbackTimer, mWebsocketIO->appCtx);
+            mFallbackTimer = 0;
+        }
+
+        if (mFallbackCtx || startFallback())
+        {
+            WEBSOCKETS_LOG_DEBUG("Connection to %s failed, still waiting for %s", mIp.c_str(), mFallbackIp.c_str());
+            delete ctx;
+            ctx = mFallbackCtx;
+            mFallbackCtx = NULL;
+            mIp = mFallbackIp;
+            mFallbackIp.clear();
+            return;
+        }
+    }
+
     delete ctx;
     ctx = NULL;
 
     WEBSOCKETS_LOG_DEBUG("Socket was closed gracefully or by server");
+    logStats();
 
     wsCloseCb(errcode, errtype, preason, reason_len);
 }
@@ -314,6 +489,17 @@ bool DNScache::getIp(int shard, std::string &ipv4, std::string &ipv6)
     return ipv4.size() || ipv6.size();
 }
 
+bool DNScache::isIpv6Preferred(int shard)
+{
+    auto it = mRecords.find(shard);
+    if (it != mRecords.end())
+    {
+        return it->second.connectIpv6Ts > it->second.connectIpv4Ts;
+    }
+
+    return false;
+}
+
 void DNScache::connectDone(int shard, const std::string &ip)
 {
     auto it = mRecords.find(shard);
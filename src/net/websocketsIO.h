@@ -11,6 +11,7 @@
 #include "buffer.h"
 #include "db.h"
 #include "url.h"
+#include "base/timers.hpp"
 
 #define WEBSOCKETS_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_websockets, fmtString, ##__VA_ARGS__)
 #define WEBSOCKETS_LOG_INFO(fmtString,...) KARERE_LOG_INFO(krLogChannel_websockets, fmtString, ##__VA_ARGS__)
@@ -38,6 +39,8 @@ public:
     bool setIp(int shard, std::string ipv4, std::string ipv6);
     bool getIp(int shard, std::string &ipv4, std::string &ipv6);
     void connectDone(int shard, const std::string &ip);
+    // true if the last successful connection to the shard was done through IPv6
+    bool isIpv6Preferred(int shard);
     bool isMatch(int shard, const std::vector<std::string> &ipsv4, const std::vector<std::string> &ipsv6);
     bool isMatch(int shard, const std::string &ipv4, const std::string &ipv6);
     time_t age(int shard);
@@ -65,14 +68,29 @@ class WebsocketsIO : public ::mega::EventTrigger
 public:
     using Mutex = std::recursive_mutex;
     using MutexGuard = std::lock_guard<Mutex>;
+    using DNSResolveCb = std::function<void(int status, std::vector<std::string> &ipsv4, std::vector<std::string> &ipsv6)>;
 
     WebsocketsIO(Mutex &mutex, ::mega::MegaApi *megaApi, void *ctx);
     virtual ~WebsocketsIO();
-    
+
+    struct TlsStats
+    {
+        unsigned int fullHandshakes = 0;
+        unsigned int resumedHandshakes = 0;    // abbreviated handshakes reusing a cached session
+    };
+    // Only meaningful if the implementation supports TLS session resumption
+    const TlsStats &tlsStats() const { return mTlsStats; }
+
 protected:
     Mutex &mutex;
     MyMegaApi mApi;
     void *appCtx;
+    TlsStats mTlsStats;
+
+    // Callbacks waiting for an in-flight resolution, keyed by hostname. Shards hosted
+    // at the same hostname share a single DNS query
+    std::map<std::string, std::vector<DNSResolveCb>> mPendingDnsQueries;
+    bool resolveDNS(const char *hostname, DNSResolveCb f);
     
     // This function is protected to prevent a wrong direct usage
     // It must be only used from WebsocketClient
@@ -85,30 +103,69 @@ protected:
 };
 
 
+// Traffic of a websocket connection. Payload bytes are the (uncompressed) messages sent and
+// received, while wire bytes are the ones actually transferred, after compression and TLS
+struct WebsocketsStats
+{
+    uint64_t payloadBytesSent = 0;
+    uint64_t payloadBytesReceived = 0;
+    uint64_t wireBytesSent = 0;
+    uint64_t wireBytesReceived = 0;
+    size_t recvBufferBytes = 0;     // memory currently held to reassemble fragmented messages
+};
+
 // Abstract class that allows to manage a websocket connection.
 // It's needed to subclass this class in order to receive callbacks
 
 class WebsocketsClient
 {
+    friend WebsocketsClientImpl;
 private:
     WebsocketsClientImpl *ctx;
+    WebsocketsStats mStats;     // accumulated for all the connections of this client
 #if defined(_WIN32) && defined(_MSC_VER)
     std::thread::id thread_id;
 #else
     pthread_t thread_id;
 #endif
 
+    // Connection attempt to the other IP family, racing against `ctx` until one of them connects
+    WebsocketsClientImpl *mFallbackCtx = nullptr;
+    megaHandle mFallbackTimer = 0;
+    std::string mIp;            // IP of `ctx`
+    std::string mFallbackIp;    // IP of `mFallbackCtx`, empty once there's nothing to race against
+    WebsocketsIO *mWebsocketIO = nullptr;
+    std::string mHost;
+    std::string mPath;
+    int mPort = 0;
+    bool mSsl = false;
+
+    bool startFallback();
+    void cancelFallback();
+    void logStats() const;
+
 public:
+    // Head start given to the preferred IP before racing the other family (RFC 8305)
+    static const unsigned kFallbackDelay = 250;
+
     WebsocketsClient();
     virtual ~WebsocketsClient();
     bool wsResolveDNS(WebsocketsIO *websocketIO, const char *hostname, std::function<void(int, std::vector<std::string>&, std::vector<std::string>&)> f);
     bool wsConnect(WebsocketsIO *websocketIO, const char *ip,
                    const char *host, int port, const char *path, bool ssl);
+    // Connects to `ip` and, unless it's connected after `kFallbackDelay` ms or if it fails earlier,
+    // also to `fallbackIp`. The first connection established wins and the other one is dropped
+    bool wsConnect(WebsocketsIO *websocketIO, const char *ip, const char *fallbackIp,
+                   const char *host, int port, const char *path, bool ssl);
+    // IP of the current connection (the winner, if both IPs were raced)
+    const std::string &wsConnectedIp() const { return mIp; }
+    const WebsocketsStats &wsStats() const { return mStats; }
     int wsGetNoNameErrorCode(WebsocketsIO *websocketIO);
     bool wsSendMessage(char *msg, size_t len);  // returns true on success, false if error
     void wsDisconnect(bool immediate);
     bool wsIsConnected();
-    void wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len);
+    void wsConnectCbPrivate(WebsocketsClientImpl *impl);
+    void wsCloseCbPrivate(WebsocketsClientImpl *impl, int errcode, int errtype, const char *preason, size_t reason_len);
 
     virtual void wsConnectCb() = 0;
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len) = 0;
@@ -131,6 +188,8 @@ public:
     void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     void wsHandleMsgCb(char *data, size_t len);
     void wsSendMsgCb(const char *data, size_t len);
+    void wsWireBytesCb(size_t sent, size_t received);
+    void wsRecvBufferCb(size_t capacity);
     
     virtual bool wsSendMessage(char *msg, size_t len) = 0;
     virtual void wsDisconnect(bool immediate) = 0;
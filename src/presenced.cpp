@@ -148,7 +148,6 @@ void Client::onSocketClose(int errcode, int errtype, const std::string& reason)
 
     assert(oldState != kDisconnected);
 
-    usingipv6 = !usingipv6;
     mTargetIp.clear();
 
     if (oldState >= kConnected)
@@ -238,6 +237,27 @@ time_t Client::getLastGreen(Id userid)
     return 0;
 }
 
+void Client::addMemoryUsage(MemoryReport& report) const
+{
+    report.add("presenced.peers", mCurrentPeers.size() * sizeof(IdRefMap::value_type), mCurrentPeers.size());
+    report.addNodes("presenced.presences", mPeersPresence);
+    report.addNodes("presenced.lastGreens", mPeersLastGreen);
+    report.addNodes("presenced.contacts", mContacts);
+
+    size_t bytes = 0;
+    for (auto& it: mChatMembers)
+    {
+        bytes += sizeof(it) + MemoryReport::kNodeOverhead + it.second.items().capacity() * sizeof(Id);
+    }
+    report.add("presenced.chatMembers", bytes, mChatMembers.size());
+    report.add("presenced.recvBuffer", wsStats().recvBufferBytes, 1);
+}
+
+void Client::addMetrics(Metrics& metrics) const
+{
+    mTraffic.addMetrics(metrics, "presenced", Metrics::Labels(), wsStats(), &Command::opcodeToStr);
+}
+
 bool Client::updateLastGreen(Id userid, time_t lastGreen)
 {
     time_t &auxLastGreen = mPeersLastGreen[userid.val];
@@ -602,45 +622,39 @@ void Client::onChatsUpdate(::mega::MegaApi *api, ::mega::MegaTextChatList *rooms
                     continue;   // no peers in this chatroom
                 }
 
+                SetOfIds& members = mChatMembers[chatid];
+                members.reserve(peerList->size());
                 for (int j = 0; j < peerList->size(); j++)
                 {
                     uint64_t userid = peerList->getPeerHandle(j);
-                    mChatMembers[chatid].insert(userid);
+                    members.insert(userid);
                     addPeer(userid);
                 }
             }
             else    // existing room
             {
-                SetOfIds oldPeerList = mChatMembers[chatid];
                 SetOfIds newPeerList;
                 if (peerList)
                 {
+                    newPeerList.reserve(peerList->size());
                     for (int j = 0; j < peerList->size(); j++)
                     {
                         newPeerList.insert(peerList->getPeerHandle(j));
                     }
                 }
 
-                // check for removals
-                for (auto oldIt = oldPeerList.begin(); oldIt != oldPeerList.end(); oldIt++)
+                SetOfIds removed = SetOfIds::difference(it->second, newPeerList);
+                SetOfIds added = SetOfIds::difference(newPeerList, it->second);
+                it->second.swap(newPeerList);
+
+                for (auto userid: removed)
                 {
-                    uint64_t userid = *oldIt;
-                    if (!newPeerList.has(userid))
-                    {
-                        mChatMembers[chatid].erase(userid);
-                        removePeer(userid);
-                    }
+                    removePeer(userid);
                 }
 
-                // check for additions
-                for (auto newIt = newPeerList.begin(); newIt != newPeerList.end(); newIt++)
+                for (auto userid: added)
                 {
-                    uint64_t userid = *newIt;
-                    if (!oldPeerList.has(userid))
-                    {
-                        mChatMembers[chatid].insert(userid);
-                        addPeer(userid);
-                    }
+                    addPeer(userid);
                 }
             }
         }
@@ -795,13 +809,15 @@ void Client::onEvent(::mega::MegaApi *api, ::mega::MegaEvent *event)
                     continue;   // no peers in this chatroom
                 }
 
+                SetOfIds& members = mChatMembers[chatid];
+                members.reserve(peerlist->size());
                 for (int j = 0; j < peerlist->size(); j++)
                 {
                     uint64_t userid = peerlist->getPeerHandle(j);
                     if (isContact(userid) && !isExContact(userid))
                     {
                         mCurrentPeers.insert(userid);
-                        mChatMembers[chatid].insert(userid);
+                        members.insert(userid);
                     }
                 }
             }
@@ -871,49 +887,29 @@ void Client::doConnect()
     string ipv4, ipv6;
     bool cachedIPs = mDnsCache.getIp(kPresencedShard, ipv4, ipv6);
     assert(cachedIPs);
-    mTargetIp = (usingipv6 && ipv6.size()) ? ipv6 : ipv4;
+
+    // start with the family that connected last time, and race it against the other one
+    bool preferIpv6 = ipv6.size() && (ipv4.empty() || mDnsCache.isIpv6Preferred(kPresencedShard));
+    mTargetIp = preferIpv6 ? ipv6 : ipv4;
+    const string &fallbackIp = preferIpv6 ? ipv4 : ipv6;
 
     const karere::Url &url = mDnsCache.getUrl(kPresencedShard);
     assert (url.isValid());
 
     setConnState(kConnecting);
-    PRESENCED_LOG_DEBUG("Connecting to presenced using the IP: %s", mTargetIp.c_str());
+    PRESENCED_LOG_DEBUG("Connecting to presenced using the IP: %s (fallback IP: %s)", mTargetIp.c_str(), fallbackIp.c_str());
 
     bool rt = wsConnect(mKarereClient->websocketIO, mTargetIp.c_str(),
-          url.host.c_str(),
-          url.port,
-          url.path.c_str(),
-          url.isSecure);
+              fallbackIp.c_str(),
+              url.host.c_str(),
+              url.port,
+              url.path.c_str(),
+              url.isSecure);
 
-    if (!rt)    // immediate failure --> try the other IP family (if available)
+    if (!rt)
     {
-        PRESENCED_LOG_DEBUG("Connection to presenced failed using the IP: %s", mTargetIp.c_str());
-
-        string oldTargetIp = mTargetIp;
-        mTargetIp.clear();
-        if (oldTargetIp == ipv6 && ipv4.size())
-        {
-            mTargetIp = ipv4;
-        }
-        else if (oldTargetIp == ipv4 && ipv6.size())
-        {
-            mTargetIp = ipv6;
-        }
-
-        if (mTargetIp.size())
-        {
-            PRESENCED_LOG_DEBUG("Retrying using the IP: %s", mTargetIp.c_str());
-            if (wsConnect(mKarereClient->websocketIO, mTargetIp.c_str(),
-                          url.host.c_str(),
-                          url.port,
-                          url.path.c_str(),
-                          url.isSecure))
-            {
-                return;
-            }
-            PRESENCED_LOG_DEBUG("Connection to presenced failed using the IP: %s", mTargetIp.c_str());
-        }        
-        else
+        PRESENCED_LOG_DEBUG("Connection to presenced failed using the IPs: %s %s", ipv4.c_str(), ipv6.c_str());
+        if (ipv4.empty() || ipv6.empty())
         {
             // do not close the socket, which forces a new retry attempt and turns the DNS response obsolete
             // Instead, let the DNS request to complete, in order to refresh IPs
@@ -996,6 +992,7 @@ bool Client::sendBuf(Buffer&& buf)
     if (!isOnline())
         return false;
     
+    mTraffic.frameOut(buf.buf(), buf.dataSize());
     bool rc = wsSendMessage(buf.buf(), buf.dataSize());
     buf.free();  //just in case, as it's content is xor-ed with the websock datamask so it's unusable
     mTsLastSend = time(NULL);
@@ -1245,6 +1242,7 @@ void Client::wsHandleMsgCb(char *data, size_t len)
 {
     mTsLastRecv = time(NULL);
     mTsLastPingSent = 0;
+    mTraffic.frameIn();
     handleMessage(StaticBuffer(data, len));
 }
 
@@ -1258,6 +1256,8 @@ void Client::handleMessage(const StaticBuffer& buf)
     while (pos < buf.dataSize())
     {
       char opcode = buf.buf()[pos];
+      karere::LoopProfiler::Scope profile("presenced", Command::opcodeToStr(opcode));
+      mTraffic.commandsIn[static_cast<uint8_t>(opcode)].add();
       try
       {
         pos++;
@@ -1344,6 +1344,7 @@ void Client::handleMessage(const StaticBuffer& buf)
             default:
             {
                 PRESENCED_LOG_ERROR("Unknown opcode %d, ignoring all subsequent commands", opcode);
+                mTraffic.parseErrors.add();
                 return;
             }
         }
@@ -1351,6 +1352,7 @@ void Client::handleMessage(const StaticBuffer& buf)
       catch(BufferRangeError& e)
       {
           PRESENCED_LOG_ERROR("Buffer bound check error while parsing %s:\n\t%s\n\tAborting command processing", Command::opcodeToStr(opcode), e.what());
+          mTraffic.parseErrors.add();
           return;
       }
       catch(std::exception& e)
@@ -1421,6 +1423,7 @@ void Client::setConnState(ConnState newState)
     }
     else if (mConnState == kConnected)
     {
+        mTargetIp = wsConnectedIp();    // the winner, if both IP families were raced
         PRESENCED_LOG_DEBUG("Presenced connected to %s", mTargetIp.c_str());
 
         mDnsCache.connectDone(kPresencedShard, mTargetIp);
@@ -303,12 +303,12 @@ public:
     virtual ~Command(){}
 };
 
-struct IdRefMap: public std::map<karere::Id, int>
+struct IdRefMap: public karere::FlatMap<karere::Id, int>
 {
-    typedef std::map<karere::Id, int> Base;
+    typedef karere::FlatMap<karere::Id, int> Base;
     int insert(karere::Id id)
     {
-        auto result = Base::insert(std::make_pair(id, 1));
+        auto result = Base::emplace(id, 1);
         return result.second
             ? 1 //we just inserted the peer
             : ++result.first->second; //already have that peer
@@ -355,9 +355,6 @@ protected:
     /** Target IP address being used for the reconnection in-flight */
     std::string mTargetIp;
 
-    /** ip version to try first (both are tried) */
-    bool usingipv6 = false;
-
     /** RetryController that manages the reconnection's attempts */
     std::unique_ptr<karere::rh::IRetryController> mRetryCtrl;
 
@@ -384,6 +381,9 @@ protected:
     /** Timestamp of the last sent data to presenced */
     time_t mTsLastSend = 0;
 
+    /** Frames and commands sent and received. The bytes are in wsStats() */
+    karere::TrafficStats mTraffic;
+
     /** Configuration of presence for the user */
     Config mConfig;
 
@@ -501,6 +501,12 @@ public:
     bool updateLastGreen(karere::Id userid, time_t lastGreen);
     time_t getLastGreen(karere::Id userid);
 
+    /** @brief Accounts the memory used by the lists of peers, contacts and chat members */
+    void addMemoryUsage(karere::MemoryReport& report) const;
+
+    /** @brief Adds the traffic counters of the connection */
+    void addMetrics(karere::Metrics& metrics) const;
+
     ~Client();
 };
 
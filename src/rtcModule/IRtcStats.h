@@ -4,6 +4,7 @@
 #include "ITypes.h"
 #include <karereId.h>
 #include <functional>
+#include <vector>
 
 namespace rtcModule
 {
@@ -77,6 +78,120 @@ struct Sample
     } cstats;   // connection-stats
 };
 
+// fields of Sample stored by SampleBuffer, except vstats.s.el (a float, see SampleBuffer::kFieldVSEl)
+#define RTCSTATS_SAMPLE_FIELDS(X)           \
+    X(Ts, ts)                               \
+    X(Lq, lq)                               \
+    X(F, f)                                 \
+    X(VRtt, vstats.rtt)                     \
+    X(VRBt, vstats.r.bt)                    \
+    X(VRBps, vstats.r.bps)                  \
+    X(VRAbps, vstats.r.abps)                \
+    X(VRPl, vstats.r.pl)                    \
+    X(VRFps, vstats.r.fps)                  \
+    X(VRDly, vstats.r.dly)                  \
+    X(VRJtr, vstats.r.jtr)                  \
+    X(VRWidth, vstats.r.width)              \
+    X(VRHeight, vstats.r.height)            \
+    X(VRBwav, vstats.r.bwav)                \
+    X(VRFirtx, vstats.r.firtx)              \
+    X(VRPlitx, vstats.r.plitx)              \
+    X(VRNacktx, vstats.r.nacktx)            \
+    X(VSBt, vstats.s.bt)                    \
+    X(VSBps, vstats.s.bps)                  \
+    X(VSAbps, vstats.s.abps)                \
+    X(VSGbps, vstats.s.gbps)                \
+    X(VSFps, vstats.s.fps)                  \
+    X(VSCfps, vstats.s.cfps)                \
+    X(VSWidth, vstats.s.width)              \
+    X(VSHeight, vstats.s.height)            \
+    X(VSBwav, vstats.s.bwav)                \
+    X(VSTargetEncBitrate, vstats.s.targetEncBitrate) \
+    X(ARtt, astats.rtt)                     \
+    X(APlDifference, astats.plDifference)   \
+    X(ARBt, astats.r.bt)                    \
+    X(ARBps, astats.r.bps)                  \
+    X(ARAbps, astats.r.abps)                \
+    X(ARPl, astats.r.pl)                    \
+    X(ARJtr, astats.r.jtr)                  \
+    X(ARDly, astats.r.dly)                  \
+    X(ARAl, astats.r.al)                    \
+    X(ASBt, astats.s.bt)                    \
+    X(ASBps, astats.s.bps)                  \
+    X(ASAbps, astats.s.abps)                \
+    X(CRtt, cstats.rtt)                     \
+    X(CRBt, cstats.r.bt)                    \
+    X(CRBps, cstats.r.bps)                  \
+    X(CRAbps, cstats.r.abps)                \
+    X(CSBt, cstats.s.bt)                    \
+    X(CSBps, cstats.s.bps)                  \
+    X(CSAbps, cstats.s.abps)
+
+/**
+ * @brief Fixed-capacity ring buffer of samples, stored by columns
+ *
+ * Every field of the samples is kept in its own column, as the difference with the
+ * same field of the previous sample (most of them barely change between samples).
+ * The value of the oldest sample is kept apart. Once the buffer is full, the oldest
+ * samples are discarded, so long calls don't grow the stats without bounds.
+ */
+class SampleBuffer
+{
+public:
+    enum Field
+    {
+#define RTCSTATS_FIELD_ENUM(name, path) kField##name,
+        RTCSTATS_SAMPLE_FIELDS(RTCSTATS_FIELD_ENUM)
+#undef RTCSTATS_FIELD_ENUM
+        kFieldVSEl,         // stored with one decimal, multiplied by 10
+        kNumFields
+    };
+
+    enum: size_t { kDefaultCapacity = 2048 }; // ~2.8h of samples at the max sample period (5s)
+
+    explicit SampleBuffer(size_t capacity = kDefaultCapacity);
+    void push(const Sample& sample);
+    void clear();
+
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    size_t capacity() const { return mCapacity; }
+    /** Number of samples pushed so far, including the ones discarded */
+    uint64_t totalCount() const { return mTotalCount; }
+    /** The most recent sample. The buffer must not be empty */
+    const Sample& back() const { return mLast; }
+    /** Decodes the i-th oldest sample. Linear in i, prefer forEach() to iterate */
+    Sample at(size_t i) const;
+
+    /** Calls f(int64_t value) for the field of every sample, from the oldest to the newest */
+    template <class F>
+    void forEach(Field field, F&& f) const
+    {
+        const std::vector<int32_t>& column = mColumns[field];
+        int64_t value = mBase[field];
+        for (size_t i = 0; i < mSize; i++)
+        {
+            if (i)
+            {
+                value += column[(mHead + i) % mCapacity];
+            }
+            f(value);
+        }
+    }
+
+    static int64_t getField(const Sample& sample, Field field);
+    static void setField(Sample& sample, Field field, int64_t value);
+
+protected:
+    size_t mCapacity;
+    size_t mHead = 0;           // position of the oldest sample
+    size_t mSize = 0;
+    uint64_t mTotalCount = 0;
+    int64_t mBase[kNumFields];  // fields of the oldest sample
+    std::vector<int32_t> mColumns[kNumFields];
+    Sample mLast{};
+};
+
 class IConnInfo
 {
 public:
@@ -93,9 +208,11 @@ public:
     virtual bool isCaller() const = 0;
     virtual karere::Id callId() const = 0;
     virtual size_t sampleCnt() const = 0;
-    virtual const std::vector<Sample*>* samples() const = 0;
+    virtual const SampleBuffer* samples() const = 0;
     virtual const IConnInfo* connInfo() const = 0;
     virtual void toJson(std::string&) const = 0;
+    /** Serializes the stats incrementally, passing the output to \c write in chunks */
+    virtual void writeJson(const std::function<void(const char *data, size_t len)>& write) const = 0;
     virtual ~IRtcStats(){}
 };
 
@@ -17,6 +17,31 @@ namespace rtcModule
 class IVideoRenderer
 {
 public:
+    enum VideoFormat
+    {
+        kVideoFormatARGB = 0,   // frames are written to the buffer returned by getImageBuffer()
+        kVideoFormatI420 = 1    // frames are passed as Y/U/V planes to frameI420(), without conversion
+    };
+
+    /**
+     * @brief videoFormat Called _by a worker thread_ for every frame, to know the format the
+     * renderer wants it in. Renderers that upload YUV textures to the GPU should return
+     * \c kVideoFormatI420, which saves a colour conversion and a copy per frame.
+     */
+    virtual int videoFormat() { return kVideoFormatARGB; }
+
+    /**
+     * @brief frameI420 Called _by a worker thread_ instead of \c getImageBuffer() and
+     * \c frameComplete() when \c videoFormat() returns \c kVideoFormatI420. The planes are
+     * owned by the library and are only valid until this function returns.
+     * @param width The width of the frame
+     * @param height The height of the frame
+     */
+    virtual void frameI420(unsigned short /*width*/, unsigned short /*height*/,
+                           const unsigned char* /*dataY*/, int /*strideY*/,
+                           const unsigned char* /*dataU*/, int /*strideU*/,
+                           const unsigned char* /*dataV*/, int /*strideV*/) {}
+
     /**
      * @brief getImageBuffer Called by _a worker thread_ to get a buffer where to write
      * frame image data. The size of the buffer must be width*height*4. The image is
@@ -31,7 +31,7 @@ StatSessInfo::StatSessInfo(karere::Id aSid, uint8_t termCode, const std::string&
 
 Recorder::Recorder(Session& sess, int scanPeriod, int maxSamplePeriod)
     :mScanPeriod(scanPeriod * 1000), mMaxSamplePeriod(maxSamplePeriod * 1000),
-    mCurrSample(new Sample), mSession(sess), mStats(new RtcStats)
+    mCurrSample(new Sample()), mSession(sess), mStats(new RtcStats)
 {
     AddRef();
     if (mScanPeriod < 0)
@@ -43,10 +43,8 @@ Recorder::Recorder(Session& sess, int scanPeriod, int maxSamplePeriod)
 
 void Recorder::addSample()
 {
-    Sample* sample = mCurrSample.release();
-    assert(sample);
-    mStats->mSamples.push_back(sample);
-    mCurrSample.reset(new Sample(*sample));
+    // the current sample keeps accumulating from the values of the one just added
+    mStats->mSamples.push(*mCurrSample);
     resetBwCalculators();
 }
 void Recorder::resetBwCalculators()
@@ -120,7 +118,7 @@ bool Recorder::checkShouldAddSample()
         return true;
     }
 
-    Sample *last = mStats->mSamples.back();
+    const Sample *last = &mStats->mSamples.back();
 
     mCurrSample->astats.plDifference = mCurrSample->astats.r.pl - last->astats.r.pl;
     if (mCurrSample->astats.plDifference)
@@ -300,7 +298,7 @@ void Recorder::onStats(const webrtc::StatsReports &data)
 
     if (onSample)
     {
-        if ((mStats->mSamples.size() == 1) && shouldAddSample) //first sample that we just added
+        if ((mStats->mSamples.totalCount() == 1) && shouldAddSample) //first sample that we just added
             onSample(&(mStats->mConnInfo), 0);
         onSample(mCurrSample.get(), 1);
     }
@@ -337,110 +335,289 @@ Recorder::~Recorder()
 {
 }
 
-RtcStats::~RtcStats()
+SampleBuffer::SampleBuffer(size_t capacity)
+    : mCapacity(capacity < 2 ? 2 : capacity)
 {
-    for (unsigned int i = 0; i < mSamples.size(); i++)
+    clear();
+}
+
+void SampleBuffer::clear()
+{
+    mHead = 0;
+    mSize = 0;
+    for (int i = 0; i < kNumFields; i++)
     {
-        delete mSamples[i];
+        mBase[i] = 0;
+        mColumns[i].clear();
     }
+}
 
-    mSamples.clear();
+void SampleBuffer::push(const Sample& sample)
+{
+    size_t pos;
+    if (mSize < mCapacity)
+    {
+        pos = mSize++;
+    }
+    else
+    {
+        // discard the oldest sample: the next one becomes the base
+        pos = mHead;
+        mHead = (mHead + 1) % mCapacity;
+        for (int i = 0; i < kNumFields; i++)
+        {
+            mBase[i] += mColumns[i][mHead];
+        }
+    }
+
+    for (int i = 0; i < kNumFields; i++)
+    {
+        Field field = static_cast<Field>(i);
+        int64_t value = getField(sample, field);
+        int32_t delta = 0;
+        if (mSize == 1)
+        {
+            mBase[i] = value;
+        }
+        else
+        {
+            delta = static_cast<int32_t>(value - getField(mLast, field));
+        }
+
+        std::vector<int32_t>& column = mColumns[i];
+        if (pos < column.size())
+        {
+            column[pos] = delta;
+        }
+        else
+        {
+            column.push_back(delta);
+        }
+    }
+
+    mLast = sample;
+    mTotalCount++;
+}
+
+Sample SampleBuffer::at(size_t i) const
+{
+    assert(i < mSize);
+    Sample sample;
+    for (int f = 0; f < kNumFields; f++)
+    {
+        int64_t value = mBase[f];
+        for (size_t j = 1; j <= i; j++)
+        {
+            value += mColumns[f][(mHead + j) % mCapacity];
+        }
+        setField(sample, static_cast<Field>(f), value);
+    }
+    return sample;
+}
+
+int64_t SampleBuffer::getField(const Sample& sample, Field field)
+{
+    switch (field)
+    {
+#define RTCSTATS_FIELD_GET(name, path) case kField##name: return sample.path;
+        RTCSTATS_SAMPLE_FIELDS(RTCSTATS_FIELD_GET)
+#undef RTCSTATS_FIELD_GET
+        case kFieldVSEl: return lround(sample.vstats.s.el * 10);
+        default: assert(false); return 0;
+    }
 }
 
-const char* decToString(float v)
+void SampleBuffer::setField(Sample& sample, Field field, int64_t value)
 {
-    static char buf[128];
-    snprintf(buf, 127, "%.1f", v);
-    return buf;
+    switch (field)
+    {
+#define RTCSTATS_FIELD_SET(name, path) case kField##name: sample.path = value; break;
+        RTCSTATS_SAMPLE_FIELDS(RTCSTATS_FIELD_SET)
+#undef RTCSTATS_FIELD_SET
+        case kFieldVSEl: sample.vstats.s.el = value / 10.0f; break;
+        default: assert(false); break;
+    }
 }
 
-#define JSON_ADD_STR(name, val) json.append("\"" #name "\":\"").append(val)+="\",";
-#define JSON_ADD_INT(name, val) json.append("\"" #name "\":").append(std::to_string((long)val))+=',';
-#define JSON_ADD_DECNUM(name, val) json.append("\"" #name "\":").append(decToStr(val))+=',';
-
-#define JSON_SUBOBJ(name) json+="\"" name "\":{";
-#define JSON_END_SUBOBJ() json[json.size()-1]='}'; json+=','
-
-#define JSON_ADD_SAMPLES_WITH_CONV(path, name, conv)   \
-    json.append("\"" #name "\":[");    \
-    if (mSamples.empty())              \
-        json+=']';                     \
-    else                               \
-    {                                  \
-        for (auto sample: mSamples)    \
-            json.append(conv(sample->path name))+=","; \
-        json[json.size()-1]=']';       \
-    }\
-    json+=',';
-
-#define JSON_ADD_SAMPLES(path, name) JSON_ADD_SAMPLES_WITH_CONV(path, name, std::to_string)
-#define JSON_ADD_DEC_SAMPLES(path, name) JSON_ADD_SAMPLES_WITH_CONV(path, name, decToString)
-
-#define JSON_ADD_BWINFO(path)           \
-    JSON_ADD_SAMPLES(path., bt);        \
-    JSON_ADD_SAMPLES(path., bps);       \
-    JSON_ADD_SAMPLES(path., abps)
+namespace
+{
+// Buffers the output of RtcStats::writeJson, passing it to the sink in chunks
+class JsonStreamWriter
+{
+public:
+    JsonStreamWriter(const std::function<void(const char *, size_t)>& sink): mSink(sink) {}
+    ~JsonStreamWriter() { flush(); }
+
+    void write(const char *data, size_t len)
+    {
+        if (mLen + len > sizeof(mBuf))
+        {
+            flush();
+            if (len > sizeof(mBuf))
+            {
+                mSink(data, len);
+                return;
+            }
+        }
+        memcpy(mBuf + mLen, data, len);
+        mLen += len;
+    }
+    void write(const char *str) { write(str, strlen(str)); }
+    void write(const std::string& str) { write(str.data(), str.size()); }
+    void writeInt(int64_t value)
+    {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%lld", (long long)value);
+        write(buf, len);
+    }
+    void writeDec(float value)
+    {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "%.1f", value);
+        write(buf, len);
+    }
+
+    void writeStr(const char *name, const std::string& value, bool last = false)
+    {
+        write("\"");
+        write(name);
+        write("\":\"");
+        write(value);
+        write(last ? "\"" : "\",");
+    }
+    void writeInt(const char *name, int64_t value)
+    {
+        write("\"");
+        write(name);
+        write("\":");
+        writeInt(value);
+        write(",");
+    }
+    void openObject(const char *name)
+    {
+        write("\"");
+        write(name);
+        write("\":{");
+    }
+    void writeColumn(const char *name, const SampleBuffer& samples, SampleBuffer::Field field, bool last = false)
+    {
+        write("\"");
+        write(name);
+        write("\":[");
+        bool first = true;
+        samples.forEach(field, [this, &first, field](int64_t value)
+        {
+            if (!first)
+            {
+                write(",");
+            }
+            first = false;
+            if (field == SampleBuffer::kFieldVSEl)
+            {
+                writeDec(value / 10.0f);
+            }
+            else
+            {
+                writeInt(value);
+            }
+        });
+        write(last ? "]" : "],");
+    }
+    void writeBwInfo(const SampleBuffer& samples, SampleBuffer::Field bt, bool last = false)
+    {
+        // bt, bps and abps are consecutive fields
+        writeColumn("bt", samples, bt);
+        writeColumn("bps", samples, static_cast<SampleBuffer::Field>(bt + 1));
+        writeColumn("abps", samples, static_cast<SampleBuffer::Field>(bt + 2), last);
+    }
+
+protected:
+    const std::function<void(const char *, size_t)>& mSink;
+    char mBuf[4096];
+    size_t mLen = 0;
+
+    void flush()
+    {
+        if (mLen)
+        {
+            mSink(mBuf, mLen);
+            mLen = 0;
+        }
+    }
+};
+}
 
 void RtcStats::toJson(std::string& json) const
 {
+    json.clear();
     json.reserve(10240);
-    json ="{";
-    JSON_ADD_STR(cid, mCallId.toString());
-    JSON_ADD_STR(sid, mSessionId.toString());
-    JSON_ADD_INT(ts, round((float)mStartTs/1000));
-    JSON_ADD_INT(dur, round((float)mDur/1000));
-    JSON_SUBOBJ("samples");
-        JSON_ADD_SAMPLES(, ts);
-        JSON_ADD_SAMPLES(, lq);
-        JSON_ADD_SAMPLES(, f);
-        JSON_SUBOBJ("v");
-            JSON_ADD_SAMPLES(vstats., rtt);
-            JSON_SUBOBJ("s");
-                JSON_ADD_BWINFO(vstats.s);
-                JSON_ADD_SAMPLES(vstats.s., fps);
-                JSON_ADD_SAMPLES(vstats.s., cfps);
-                JSON_ADD_SAMPLES(vstats.s., width);
-                JSON_ADD_SAMPLES(vstats.s., height);
-                JSON_ADD_DEC_SAMPLES(vstats.s., el);
-                JSON_ADD_SAMPLES(vstats.s., bwav);
-                JSON_ADD_SAMPLES(vstats.s., gbps);
-            JSON_END_SUBOBJ();
-            JSON_SUBOBJ("r");
-                JSON_ADD_BWINFO(vstats.r);
-                JSON_ADD_SAMPLES(vstats.r., pl);
-                JSON_ADD_SAMPLES(vstats.r., jtr);
-                JSON_ADD_SAMPLES(vstats.r., fps);
-                JSON_ADD_SAMPLES(vstats.r., dly);
-                JSON_ADD_SAMPLES(vstats.r., width);
-                JSON_ADD_SAMPLES(vstats.r., height);
-                JSON_ADD_SAMPLES(vstats.r., firtx);
-                JSON_ADD_SAMPLES(vstats.r., plitx);
-                JSON_ADD_SAMPLES(vstats.r., nacktx);
-            JSON_END_SUBOBJ(); //r
-        JSON_END_SUBOBJ(); //v
-        JSON_SUBOBJ("a");
-            JSON_ADD_SAMPLES(astats., rtt);
-            JSON_SUBOBJ("s");
-                JSON_ADD_BWINFO(astats.s);
-            JSON_END_SUBOBJ();
-            JSON_SUBOBJ("r");
-                JSON_ADD_BWINFO(astats.r);
-                JSON_ADD_SAMPLES(astats.r., jtr);
-                JSON_ADD_SAMPLES(astats.r., pl);
-                JSON_ADD_SAMPLES(astats.r., dly);
-                JSON_ADD_SAMPLES(astats.r., al);
-            JSON_END_SUBOBJ();
-        JSON_END_SUBOBJ(); //a
-    JSON_END_SUBOBJ(); //samples
-    JSON_ADD_STR(bws, mDeviceInfo);
-    JSON_ADD_INT(rly, mConnInfo.mRly);
-    JSON_ADD_INT(rrly, mConnInfo.mRRly);
-    JSON_ADD_STR(proto, mConnInfo.mProto);
-    JSON_ADD_INT(isJoiner, mIsJoiner);
-    JSON_ADD_STR(caid, mIsJoiner ? mOwnAnonId.toString() : mPeerAnonId.toString());
-    JSON_ADD_STR(aaid, mIsJoiner ? mPeerAnonId.toString() : mOwnAnonId.toString());
-    JSON_ADD_STR(termRsn, mTermRsn);
-    json[json.size()-1]='}'; //all
+    writeJson([&json](const char *data, size_t len)
+    {
+        json.append(data, len);
+    });
+}
+
+void RtcStats::writeJson(const std::function<void(const char *data, size_t len)>& write) const
+{
+    typedef SampleBuffer S;
+    JsonStreamWriter json(write);
+    json.write("{");
+    json.writeStr("cid", mCallId.toString());
+    json.writeStr("sid", mSessionId.toString());
+    json.writeInt("ts", (long)round((float)mStartTs/1000));
+    json.writeInt("dur", (long)round((float)mDur/1000));
+    json.openObject("samples");
+        json.writeColumn("ts", mSamples, S::kFieldTs);
+        json.writeColumn("lq", mSamples, S::kFieldLq);
+        json.writeColumn("f", mSamples, S::kFieldF);
+        json.openObject("v");
+            json.writeColumn("rtt", mSamples, S::kFieldVRtt);
+            json.openObject("s");
+                json.writeBwInfo(mSamples, S::kFieldVSBt);
+                json.writeColumn("fps", mSamples, S::kFieldVSFps);
+                json.writeColumn("cfps", mSamples, S::kFieldVSCfps);
+                json.writeColumn("width", mSamples, S::kFieldVSWidth);
+                json.writeColumn("height", mSamples, S::kFieldVSHeight);
+                json.writeColumn("el", mSamples, S::kFieldVSEl);
+                json.writeColumn("bwav", mSamples, S::kFieldVSBwav);
+                json.writeColumn("gbps", mSamples, S::kFieldVSGbps, true);
+            json.write("},");
+            json.openObject("r");
+                json.writeBwInfo(mSamples, S::kFieldVRBt);
+                json.writeColumn("pl", mSamples, S::kFieldVRPl);
+                json.writeColumn("jtr", mSamples, S::kFieldVRJtr);
+                json.writeColumn("fps", mSamples, S::kFieldVRFps);
+                json.writeColumn("dly", mSamples, S::kFieldVRDly);
+                json.writeColumn("width", mSamples, S::kFieldVRWidth);
+                json.writeColumn("height", mSamples, S::kFieldVRHeight);
+                json.writeColumn("firtx", mSamples, S::kFieldVRFirtx);
+                json.writeColumn("plitx", mSamples, S::kFieldVRPlitx);
+                json.writeColumn("nacktx", mSamples, S::kFieldVRNacktx, true);
+            json.write("}"); //r
+        json.write("},"); //v
+        json.openObject("a");
+            json.writeColumn("rtt", mSamples, S::kFieldARtt);
+            json.openObject("s");
+                json.writeBwInfo(mSamples, S::kFieldASBt, true);
+            json.write("},");
+            json.openObject("r");
+                json.writeBwInfo(mSamples, S::kFieldARBt);
+                json.writeColumn("jtr", mSamples, S::kFieldARJtr);
+                json.writeColumn("pl", mSamples, S::kFieldARPl);
+                json.writeColumn("dly", mSamples, S::kFieldARDly);
+                json.writeColumn("al", mSamples, S::kFieldARAl, true);
+            json.write("}");
+        json.write("}"); //a
+    json.write("},"); //samples
+    json.writeStr("bws", mDeviceInfo);
+    json.writeInt("rly", mConnInfo.mRly);
+    json.writeInt("rrly", mConnInfo.mRRly);
+    json.writeStr("proto", mConnInfo.mProto);
+    json.writeInt("isJoiner", mIsJoiner);
+    json.writeStr("caid", mIsJoiner ? mOwnAnonId.toString() : mPeerAnonId.toString());
+    json.writeStr("aaid", mIsJoiner ? mPeerAnonId.toString() : mOwnAnonId.toString());
+    json.writeStr("termRsn", mTermRsn, true);
+    json.write("}"); //all
 }
 }
 }
@@ -56,17 +56,17 @@ public:
     karere::Id mOwnAnonId;
     karere::Id mPeerAnonId;
     std::string mDeviceInfo;
-    std::vector<Sample*> mSamples;
+    SampleBuffer mSamples;
     ConnInfo mConnInfo;
-    ~RtcStats();
     //IRtcStats implementation
     virtual const std::string& termRsn() const { return mTermRsn; }
     virtual bool isCaller() const { return !mIsJoiner; }
     virtual karere::Id callId() const { return mCallId; }
     virtual size_t sampleCnt() const { return mSamples.size(); }
-    virtual const std::vector<Sample*>* samples() const { return &mSamples; }
+    virtual const SampleBuffer* samples() const { return &mSamples; }
     virtual const IConnInfo* connInfo() const { return &mConnInfo; }
     virtual void toJson(std::string& out) const;
+    virtual void writeJson(const std::function<void(const char *data, size_t len)>& write) const;
 };
 
 class Recorder: public rtc::RefCountedObject<webrtc::StatsObserver>
@@ -159,13 +159,23 @@ public:
         if (mVideoEnable)
         {
             void* userData = NULL;
-            auto buffer = frame.video_frame_buffer()->ToI420();   // smart ptr type changed
+            auto buffer = frame.video_frame_buffer()->ToI420();   // smart ptr type changed (no-op for I420 buffers)
             if (frame.rotation() != webrtc::kVideoRotation_0)
             {
                 buffer = webrtc::I420Buffer::Rotate(*buffer, frame.rotation());
             }
             unsigned short width = (unsigned short)buffer->width();
             unsigned short height = (unsigned short)buffer->height();
+            if (mRenderer->videoFormat() == IVideoRenderer::kVideoFormatI420)
+            {
+                // pass the decoded planes as they are, no conversion to ARGB
+                mRenderer->frameI420(width, height,
+                                     buffer->DataY(), buffer->StrideY(),
+                                     buffer->DataU(), buffer->StrideU(),
+                                     buffer->DataV(), buffer->StrideV());
+                return;
+            }
+
             void* frameBuf = mRenderer->getImageBuffer(width, height, userData);
             if (!frameBuf) //image is frozen or app is minimized/covered
                 return;
@@ -3489,15 +3489,15 @@ Session::~Session()
 void Session::pollStats()
 {
     mRtcConn->GetStats(static_cast<webrtc::StatsObserver*>(mStatRecorder.get()), nullptr, mStatRecorder->getStatsLevel());
-    unsigned int statsSize = mStatRecorder->mStats->mSamples.size();
-    if (statsSize != mPreviousStatsSize)
+    uint64_t statsCount = mStatRecorder->mStats->mSamples.totalCount();
+    if (statsCount != mPreviousStatsCount)
     {
-        manageNetworkQuality(mStatRecorder->mStats->mSamples.back());
-        mPreviousStatsSize = statsSize;
+        manageNetworkQuality(&mStatRecorder->mStats->mSamples.back());
+        mPreviousStatsCount = statsCount;
     }
 }
 
-void Session::manageNetworkQuality(stats::Sample *sample)
+void Session::manageNetworkQuality(const stats::Sample *sample)
 {
     int previousNetworkquality = mNetworkQuality;
     mNetworkQuality = sample->lq;
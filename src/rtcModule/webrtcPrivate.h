@@ -96,7 +96,7 @@ protected:
     bool mVideoReceived = false;
     int mNetworkQuality = kNetworkQualityDefault;    // from 0 (worst) to 5 (best)
     long mAudioPacketLostAverage = 0;
-    unsigned int mPreviousStatsSize = 0;
+    uint64_t mPreviousStatsCount = 0;   // samples added to the stats, to detect new ones
     std::unique_ptr<AudioLevelMonitor> mAudioLevelMonitor;
     TermCode mTermCode = TermCode::kInvalid;
     bool mPeerSupportRenegotiation = false;
@@ -135,7 +135,7 @@ public:
     void pollStats();
     artc::myPeerConnection<Session> rtcConn() const { return mRtcConn; }
     virtual bool videoReceived() const { return mVideoReceived; }
-    void manageNetworkQuality(stats::Sample* sample);
+    void manageNetworkQuality(const stats::Sample* sample);
     void createRtcConn();
     promise::Promise<void> processSdpOfferSendAnswer();
     //PeerConnection events
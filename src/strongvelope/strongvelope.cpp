@@ -684,8 +684,131 @@ ProtocolHandler::reactionEncrypt(const Message &msg, const std::string &reaction
     });
 }
 
-promise::Promise<std::shared_ptr<Buffer>>
-ProtocolHandler::reactionDecrypt(const Message &msg, const std::string &reaction)
+namespace
+{
+// Maximum size of an encrypted reaction decrypted without heap allocations
+enum { kMaxReactionWords = 32 };
+
+// Same packing as ::mega::Utils::str_to_a32<uint32_t>, big-endian words, zero-padded
+void bytesToWords(const char* data, size_t len, uint32_t* words)
+{
+    memset(words, 0, ((len + 3) >> 2) * sizeof(uint32_t));
+    for (size_t i = 0; i < len; i++)
+    {
+        words[i >> 2] |= static_cast<uint32_t>(static_cast<uint8_t>(data[i])) << (24 - (i & 3) * 8);
+    }
+}
+
+uint8_t wordsByte(const uint32_t* words, size_t i)
+{
+    return (words[i >> 2] >> (24 - (i & 3) * 8)) & 255;
+}
+}
+
+/** Decrypts a reaction over stack buffers, with the same result as the str_to_a32/a32_to_str based version */
+std::string decryptReaction(const SendKey& key, karere::Id msgid, const std::string& reaction)
+{
+    size_t numWords = (reaction.size() + 3) >> 2;
+    if (key.dataSize() != SVCRYPTO_KEY_SIZE || numWords < 2)
+    {
+        throw std::runtime_error("Invalid key or encrypted reaction size");
+    }
+
+    uint32_t key32[4];
+    bytesToWords(key.buf(), SVCRYPTO_KEY_SIZE, key32);
+
+    // the cypherkey is the key XOR the base64-encoded msgid
+    char msgIdB64[12];
+    size_t msgIdLen = base64urlencode(&msgid.val, sizeof(msgid.val), msgIdB64);
+    uint32_t msgId32[3];
+    bytesToWords(msgIdB64, msgIdLen, msgId32);
+    size_t msgId32Len = (msgIdLen + 3) >> 2;
+    for (size_t i = 0; i < 4; i++)
+    {
+        key32[i] ^= msgId32[i % msgId32Len];
+    }
+
+    uint32_t stackWords[kMaxReactionWords];
+    std::unique_ptr<uint32_t[]> heapWords;
+    uint32_t* reaction32 = stackWords;
+    if (numWords > kMaxReactionWords)
+    {
+        heapWords.reset(new uint32_t[numWords]);
+        reaction32 = heapWords.get();
+    }
+    bytesToWords(reaction.data(), reaction.size(), reaction32);
+    ::mega::xxteaDecrypt(reaction32, static_cast<uint32_t>(numWords), key32, false);
+
+    // skip the msgid's part (4 most significat bytes) and the left-padding (if any)
+    size_t size = numWords * 4;
+    size_t pos = 4;
+    while (pos < size && wordsByte(reaction32, pos) == 0)
+    {
+        pos++;
+    }
+    assert(pos <= 4 + 3);   // maximum left-padding should not be greater than 3 bytes
+
+    std::string decrypted;
+    decrypted.reserve(size - pos);
+    for (; pos < size; pos++)
+    {
+        decrypted.push_back(static_cast<char>(wordsByte(reaction32, pos)));
+    }
+    return decrypted;
+}
+
+const std::string* ReactionCache::get(karere::Id msgid, uint64_t keyid, const std::string& encrypted)
+{
+    auto it = mEntries.find(Key{msgid, keyid, encrypted});
+    if (it == mEntries.end())
+    {
+        return nullptr;
+    }
+    mLru.splice(mLru.begin(), mLru, it->second.lruPos);
+    return &it->second.decrypted;
+}
+
+void ReactionCache::put(karere::Id msgid, uint64_t keyid, const std::string& encrypted, const std::string& decrypted)
+{
+    auto result = mEntries.emplace(Key{msgid, keyid, encrypted}, Entry());
+    Entry& entry = result.first->second;
+    entry.decrypted = decrypted;
+    if (!result.second)
+    {
+        mLru.splice(mLru.begin(), mLru, entry.lruPos);
+        return;
+    }
+
+    mLru.push_front(&result.first->first);
+    entry.lruPos = mLru.begin();
+    if (mEntries.size() > kMaxEntries)
+    {
+        auto oldest = mEntries.find(*mLru.back());
+        mLru.pop_back();
+        mEntries.erase(oldest);
+    }
+}
+
+void ReactionCache::clear()
+{
+    mEntries.clear();
+    mLru.clear();
+}
+
+void ReactionCache::addMemoryUsage(karere::MemoryReport& report) const
+{
+    size_t bytes = 0;
+    for (auto& it: mEntries)
+    {
+        // one node in the map and another one in the LRU list
+        bytes += sizeof(it) + sizeof(const Key*) + 2 * karere::MemoryReport::kNodeOverhead
+                + it.first.encrypted.capacity() + it.second.decrypted.capacity();
+    }
+    report.add("strongvelope.reactionCache", bytes, mEntries.size());
+}
+
+promise::Promise<std::shared_ptr<SendKey>>
+ProtocolHandler::getReactionKey(karere::Id msgUserid, chatd::KeyId keyid)
 {
     promise::Promise<std::shared_ptr<SendKey>> symPms;
     if (isPublicChat())
@@ -694,48 +817,100 @@ ProtocolHandler::reactionDecrypt(const Message &msg, const std::string &reaction
     }
     else
     {
-        symPms = getKey(UserKeyId(msg.userid, msg.keyid));
+        symPms = getKey(UserKeyId(msgUserid, keyid));
     }
+    return symPms;
+}
 
-    auto wptr = weakHandle();
-    return symPms.then([wptr, &msg, &reaction](const std::shared_ptr<SendKey>& data)
+promise::Promise<std::vector<std::shared_ptr<Buffer>>>
+ProtocolHandler::reactionDecrypt(const std::vector<EncryptedReaction>& reactions)
+{
+    auto results = std::make_shared<std::vector<std::shared_ptr<Buffer>>>(reactions.size());
+
+    // the ones not cached, grouped by the key needed to decrypt them
+    std::map<UserKeyId, std::vector<size_t>> pendingByKey;
+    for (size_t i = 0; i < reactions.size(); i++)
     {
-        wptr.throwIfDeleted();
+        const EncryptedReaction& reaction = reactions[i];
+        const std::string* cached = mReactionCache.get(reaction.msgid, reaction.keyid, reaction.data);
+        if (cached)
+        {
+            (*results)[i] = std::make_shared<Buffer>(cached->data(), cached->size());
+        }
+        else
+        {
+            pendingByKey[UserKeyId(reaction.msgUserid, reaction.keyid)].push_back(i);
+        }
+    }
 
-        // Inside this function str_to_a32 and a32_to_str calls must be done with type <T> = <uint32_t>
-        std::string keyBin (data->buf(), data->dataSize());
-        std::vector<uint32_t> key32 = ::mega::Utils::str_to_a32<uint32_t>(keyBin);
-        size_t key32Len = key32.size();
+    if (pendingByKey.empty())
+    {
+        return *results;
+    }
 
-        std::string msgId = msg.id().toString();
-        std::vector<uint32_t> msgId32 =  ::mega::Utils::str_to_a32<uint32_t>(msgId);
-        size_t msgId32Len = msgId32.size();
+    auto input = std::make_shared<std::vector<EncryptedReaction>>(reactions);
+    auto wptr = weakHandle();
+    std::vector<promise::Promise<void>> promises;
+    for (auto& group: pendingByKey)
+    {
+        std::vector<size_t> indexes = std::move(group.second);
+        auto pms = getReactionKey(group.first.user, static_cast<chatd::KeyId>(group.first.keyid))
+        .then([wptr, this, input, results, indexes](const std::shared_ptr<SendKey>& key)
+        {
+            if (wptr.deleted())
+                return;
 
-        // key32 XOR msgId32 --> Cypherkey to encrypt reaction
-        std::vector<uint32_t> cypherKey(key32Len);
-        for (size_t i = 0; i < key32Len; i++)
+            for (size_t i: indexes)
+            {
+                const EncryptedReaction& reaction = (*input)[i];
+                try
+                {
+                    std::string decrypted = decryptReaction(*key, reaction.msgid, reaction.data);
+                    mReactionCache.put(reaction.msgid, reaction.keyid, reaction.data, decrypted);
+                    (*results)[i] = std::make_shared<Buffer>(decrypted.data(), decrypted.size());
+                }
+                catch (std::exception& e)
+                {
+                    STRONGVELOPE_LOG_WARNING("Failed to decrypt reaction to message %s: %s", reaction.msgid.toString().c_str(), e.what());
+                }
+            }
+        })
+        .fail([](const ::promise::Error& err)
         {
-            cypherKey[i] = key32[i] ^ msgId32[i % msgId32Len];
-        }
+            // the reactions that use this key stay null
+            STRONGVELOPE_LOG_WARNING("Failed to get the key to decrypt reactions: %s", err.what());
+        });
+        promises.push_back(pms);
+    }
 
-        std::vector<uint32_t> reaction32 = ::mega::Utils::str_to_a32<uint32_t>(reaction);
-        ::mega::xxteaDecrypt(reaction32.data(), reaction32.size(), cypherKey.data(), false);
-        std::string decrypted = ::mega::Utils::a32_to_str<uint32_t>(reaction32);
+    return promise::when(promises)
+    .then([results]()
+    {
+        return *results;
+    });
+}
 
-        // skip the msgid's part (4 most significat bytes) and the left-padding (if any)
-        size_t pos = 4;
-        while (pos < decrypted.size() && decrypted[pos] == '\0')
+void ProtocolHandler::addMemoryUsage(karere::MemoryReport& report) const
+{
+    // keys may be shared with in-flight promises, they are accounted where they are cached
+    size_t keyBytes = 0;
+    for (auto& it: mKeys)
+    {
+        keyBytes += sizeof(it) + karere::MemoryReport::kNodeOverhead;
+        if (it.second.key)
         {
-            pos++;
+            keyBytes += sizeof(SendKey);
         }
-        assert(pos <= 4 + 3);   // maximum left-padding should not be greater than 3 bytes
-
-        return std::make_shared<Buffer>(decrypted.data() + pos, decrypted.size() - pos);
-    })
-    .fail([](const ::promise::Error& err)
+    }
+    for (auto& entry: mUnconfirmedKeys)
     {
-        return err;
-    });
+        keyBytes += sizeof(entry) + sizeof(SendKey) + entry.recipients.items().capacity() * sizeof(karere::Id);
+    }
+    report.add("strongvelope.keys", keyBytes, mKeys.size() + mUnconfirmedKeys.size());
+    report.add("strongvelope.symmKeyCache",
+               mSymmKeyCache.size() * (sizeof(decltype(mSymmKeyCache)::value_type) + karere::MemoryReport::kNodeOverhead + sizeof(SendKey)),
+               mSymmKeyCache.size());
+    mReactionCache.addMemoryUsage(report);
 }
 
 unsigned int ProtocolHandler::getCacheVersion() const
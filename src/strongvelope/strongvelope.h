@@ -9,6 +9,7 @@
 #define STRONGVELOPE_H_
 #include <vector>
 #include <map>
+#include <list>
 #include <string>
 #include <assert.h>
 #include <iostream>
@@ -258,9 +259,48 @@ struct UserKeyId
     }
 };
 
+/** @brief LRU cache of decrypted reactions, by message, key and encrypted reaction.
+ * Popular messages receive the same reaction from many users, encrypted the same way.
+ */
+class ReactionCache
+{
+public:
+    enum { kMaxEntries = 512 };
+    /** @brief Returns the decrypted reaction, or nullptr if it's not cached */
+    const std::string* get(karere::Id msgid, uint64_t keyid, const std::string& encrypted);
+    void put(karere::Id msgid, uint64_t keyid, const std::string& encrypted, const std::string& decrypted);
+    void clear();
+    void addMemoryUsage(karere::MemoryReport& report) const;
+
+protected:
+    struct Key
+    {
+        karere::Id msgid;
+        uint64_t keyid;
+        std::string encrypted;
+        bool operator<(const Key& other) const
+        {
+            if (msgid != other.msgid)
+                return msgid < other.msgid;
+            if (keyid != other.keyid)
+                return keyid < other.keyid;
+            return encrypted < other.encrypted;
+        }
+    };
+    struct Entry
+    {
+        std::string decrypted;
+        std::list<const Key*>::iterator lruPos;
+    };
+    std::map<Key, Entry> mEntries;
+    std::list<const Key*> mLru;     // most recently used first
+};
+
 class TlvWriter;
 extern const std::string SVCRYPTO_PAIRWISE_KEY;
 void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
+/** @brief Decrypts a reaction to the message \c msgid, encrypted by ProtocolHandler::reactionEncrypt with \c key */
+std::string decryptReaction(const SendKey& key, karere::Id msgid, const std::string& reaction);
 
 /**
  * @brief The ProtocolHandler class implements ICrypto.
@@ -333,6 +373,9 @@ protected:
     std::shared_ptr<UnifiedKey> mUnifiedKey;
     promise::Promise<std::shared_ptr<UnifiedKey>> mUnifiedKeyDecrypted;
 
+    ReactionCache mReactionCache;
+    promise::Promise<std::shared_ptr<SendKey>> getReactionKey(karere::Id msgUserid, chatd::KeyId keyid);
+
 public:
     karere::Id chatid;
     karere::Id mPh = karere::Id::inval();     // it's only valid during preview mode (required to fetch user-attributes)
@@ -456,7 +499,8 @@ public:
     void setPublicHandle(const uint64_t ph) override;
 
     promise::Promise<std::shared_ptr<Buffer>> reactionEncrypt(const chatd::Message &msg, const std::string &reaction) override;
-    promise::Promise<std::shared_ptr<Buffer>> reactionDecrypt(const chatd::Message &msg, const std::string &reaction) override;
+    promise::Promise<std::vector<std::shared_ptr<Buffer>>> reactionDecrypt(const std::vector<chatd::EncryptedReaction>& reactions) override;
+    void addMemoryUsage(karere::MemoryReport& report) const override;
 };
 }
 namespace chatd
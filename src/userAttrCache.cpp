@@ -594,4 +594,22 @@ UserAttrCache::getAttr(uint64_t user, unsigned attrType, uint64_t ph)
     return ret;
 }
 
+void UserAttrCache::addMemoryUsage(MemoryReport& report) const
+{
+    size_t bytes = 0;
+    size_t cbs = 0;
+    for (auto& it: *this)
+    {
+        const UserAttrCacheItem& item = *it.second;
+        bytes += sizeof(value_type) + MemoryReport::kNodeOverhead + sizeof(UserAttrCacheItem);
+        if (item.data)
+        {
+            bytes += sizeof(Buffer) + item.data->bufSize();
+        }
+        cbs += item.cbs.size();
+    }
+    report.add("userAttrCache.items", bytes, size());
+    report.add("userAttrCache.callbacks", cbs * (sizeof(UserAttrReqCb) + MemoryReport::kNodeOverhead), cbs);
+}
+
 }
@@ -106,6 +106,7 @@ struct UserAttrReqCb: public karere::WeakReferenceable<UserAttrReqCb>
 enum { kCacheFetchNotPending=0, kCacheFetchUpdatePending=1, kCacheFetchNewPending=2};
 
 class UserAttrCache;
+class MemoryReport;
 struct UserAttrCacheItem
 {
     UserAttrCache& parent;
@@ -186,6 +187,8 @@ public:
      * request is currently registered (expired one-shot for example).
      */
     bool removeCb(Handle handle);
+    /** @brief Accounts the memory used by the cached attributes and their callbacks */
+    void addMemoryUsage(MemoryReport& report) const;
 };
 
 }
@@ -4,10 +4,15 @@
 #include "../../src/chatd.h"
 #include "../../src/megachatapi.h"
 #include "../../src/karereCommon.h" // for logging with karere facility
+#include "../../src/megachatapi_impl.h"
+#ifndef KARERE_DISABLE_WEBRTC
+#include "../../src/rtcModule/rtcStats.h"
+#endif
 
 #include <signal.h>
 #include <stdio.h>
 #include <time.h>
+#include <chrono>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -66,8 +71,22 @@ int main(int argc, char **argv)
     MegaChatApiUnitaryTest unitaryTest;
     std::cout << "[========] Unitary tests " << std::endl;
     unitaryTest.UNITARYTEST_ParseUrl();
+    unitaryTest.UNITARYTEST_IdBase64();
+    unitaryTest.UNITARYTEST_MemoryReport();
+    unitaryTest.UNITARYTEST_LoopProfiler();
+    unitaryTest.UNITARYTEST_Metrics();
+    unitaryTest.UNITARYTEST_NodeHistoryBuffer();
+    unitaryTest.UNITARYTEST_FilteredHistory();
+    unitaryTest.UNITARYTEST_EventQueue();
+    unitaryTest.UNITARYTEST_ReactionDecryption();
+#ifndef KARERE_DISABLE_WEBRTC
+    unitaryTest.UNITARYTEST_StatsSampleBuffer();
+#endif
     std::cout << "[========] End Unitary tests " << std::endl;
 
+    // The benchmark below measures the performance of the buffer of attachments, it doesn't check anything
+    //unitaryTest.BENCHMARK_NodeHistoryBuffer();
+
     return t.mFailedTests + unitaryTest.mFailedTests;
 }
 
@@ -4611,10 +4630,39 @@ void MegaLoggerTest::log(int loglevel, const char *message)
     testlog  << message;
 }
 
+MegaChatApiUnitaryTest::TestChecks::TestChecks(MegaChatApiUnitaryTest &test, const std::string &name, const std::string &tag)
+    : mTest(test), mName(name), mTag(tag)
+{
+    mTest.mOKTests ++;
+    std::cout << "          TEST - " << mName << std::endl;
+}
+
+void MegaChatApiUnitaryTest::TestChecks::operator()(bool condition, const std::string &msg)
+{
+    mExecuted ++;
+    if (!condition)
+    {
+        mFailed ++;
+        std::cout << "         [" << " FAILED " << mTag << "] " << msg << std::endl;
+    }
+}
+
+bool MegaChatApiUnitaryTest::TestChecks::finish()
+{
+    if (mFailed > 0)
+    {
+        mTest.mFailedTests ++;
+    }
+
+    std::cout << "          TEST - " << mName << " - Executed Tests : " << mExecuted << "   Failure Tests : " << mFailed << std::endl;
+    return mFailed == 0;
+}
+
 bool MegaChatApiUnitaryTest::UNITARYTEST_ParseUrl()
 {
+    TestChecks check(*this, "Message::parseUrl()", "Parse");
+
     // Test cases
-    mOKTests ++;
     std::map<std::string, int> checkUrls;
     checkUrls["googl."] = 0;
     checkUrls["googl.com\"fsdafasdf"] = 1;
@@ -4708,28 +4756,687 @@ bool MegaChatApiUnitaryTest::UNITARYTEST_ParseUrl()
     checkUrls["hidsfdf.d.ddsfsdsdd"] = 0;
     checkUrls["122.123.122.123/jjkkk"] = 1;
 
-    std::cout << "          TEST - Message::parseUrl()" << std::endl;
-    bool succesful = true;
-    int executedTests = 0;
-    int failureTests = 0;
     std::string url;
     for (auto testCase : checkUrls)
     {
-        executedTests ++;
-        if (chatd::Message::hasUrl(testCase.first, url) != testCase.second)
+        bool parsed = (chatd::Message::hasUrl(testCase.first, url) == testCase.second);
+        if (!parsed)
         {
-            failureTests ++;
-            std::cout << "         [" << " FAILED Parse" << "] " << testCase.first << std::endl;
             LOG_debug << "Failed to parse: " << testCase.first;
-            succesful = false;
+        }
+        check(parsed, testCase.first);
+    }
+
+    return check.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_IdBase64()
+{
+    TestChecks check(*this, "karere::Id base64url", "Id base64url");
+
+    karere::Id commander;
+    base64urldecode("gTxFhlOd_LQ", 11, &commander.val, sizeof(commander.val));
+    check(karere::Id::COMMANDER() == commander, "COMMANDER decoded at compile time");
+    check(karere::Id::COMMANDER().toString() == "gTxFhlOd_LQ", "COMMANDER encoded");
+
+    // the fixed-width codec must match the generic one
+    uint64_t values[] = { 0, 1, 0xFFFFFFFFFFFFFFFF, 0x0123456789ABCDEF, 0xFEDCBA9876543210, karere::Id::COMMANDER().val };
+    for (uint64_t value : values)
+    {
+        karere::Id id(value);
+        std::string encoded = base64urlencode(&value, sizeof(value));
+        std::string encodedPh = base64urlencode(&value, karere::Id::CHATLINKHANDLE);
+        check(id.toString() == encoded, "toString() of " + encoded);
+        check(id.toString(karere::Id::CHATLINKHANDLE) == encodedPh, "toString(6) of " + encodedPh);
+        check(karere::Id(encoded.c_str()) == id, "decoding of " + encoded);
+
+        uint64_t ph = 0;
+        check(base64urldecodeFixed<karere::Id::CHATLINKHANDLE>(encodedPh.c_str(), &ph)
+              && ph == (value & 0xFFFFFFFFFFFF), "decoding of handle " + encodedPh);
+    }
+
+    uint64_t invalid;
+    check(!base64urldecodeFixed<sizeof(uint64_t)>("gTxFhlOd*LQ", &invalid), "invalid chars are detected");
+
+    return check.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_MemoryReport()
+{
+    TestChecks check(*this, "karere::MemoryReport", "MemoryReport");
+
+    karere::MemoryReport report;
+    check(report.total().bytes == 0 && report.total().count == 0, "empty report");
+    check(report.toJson() == "{\"total\":{\"bytes\":0,\"count\":0},\"tags\":{}}", "empty report to JSON");
+
+    report.add("chatd.history", 1000, 10);
+    report.add("chatd.history", 24, 2);
+    std::map<uint64_t, int> nodes = { {1, 1}, {2, 2}, {3, 3} };
+    report.addNodes("presenced.contacts", nodes);
+
+    size_t nodesBytes = 3 * (sizeof(std::pair<const uint64_t, int>) + karere::MemoryReport::kNodeOverhead);
+    check(report.usages().size() == 2, "usages are aggregated by tag");
+    check(report.usages().at("chatd.history").bytes == 1024 && report.usages().at("chatd.history").count == 12, "usages of the same tag are added");
+    check(report.usages().at("presenced.contacts").bytes == nodesBytes && report.usages().at("presenced.contacts").count == 3, "nodes of a map");
+    check(report.total().bytes == 1024 + nodesBytes && report.total().count == 15, "total");
+
+    std::string expected = "{\"total\":{\"bytes\":" + std::to_string(1024 + nodesBytes) + ",\"count\":15},"
+            "\"tags\":{\"chatd.history\":{\"bytes\":1024,\"count\":12},"
+            "\"presenced.contacts\":{\"bytes\":" + std::to_string(nodesBytes) + ",\"count\":3}}}";
+    check(report.toJson() == expected, "report to JSON");
+
+    return check.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_LoopProfiler()
+{
+    TestChecks check(*this, "karere::LoopProfiler", "LoopProfiler");
+
+    karere::LoopProfiler::Histogram histogram;
+    histogram.add(0);
+    histogram.add(1);
+    histogram.add(3);
+    histogram.add(1000);
+    check(histogram.count == 4 && histogram.totalUs == 1004 && histogram.maxUs == 1000, "histogram totals");
+    check(histogram.buckets[0] == 1 && histogram.buckets[1] == 1 && histogram.buckets[2] == 1 && histogram.buckets[10] == 1, "histogram buckets");
+    check(histogram.percentile(50) == 2 && histogram.percentile(99) == 1024, "histogram percentiles");
+    histogram.add(1LL << 40);
+    check(histogram.buckets[karere::LoopProfiler::kNumBuckets - 1] == 1 && histogram.percentile(100) == (1LL << 40), "histogram overflow bucket");
+
+    check(karere::LoopProfiler::callSiteName("static const char* karere::marshallCall(F&&, void*)::Msg::site() [with F = karere::Client::connect()::<lambda()>]")
+          == "karere::Client::connect()::<lambda()>", "call site of a marshalled call");
+    check(karere::LoopProfiler::callSiteName("static const char* karere::setTimer(CB&&, unsigned int, void*)::Msg::site() [with int persist = 0; CB = chatd::Client::f(int)::<lambda()>]")
+          == "chatd::Client::f(int)::<lambda()>", "call site of a timer");
+    check(karere::LoopProfiler::callSiteName("NEWMSG") == "NEWMSG", "call site of an opcode");
+
+    karere::LoopProfiler profiler;
+    profiler.record("chatd", "NEWMSG", -1, 3);
+    check(profiler.toJson() == "{\"enabled\":false,\"slowThresholdUs\":50000,\"entries\":[]}", "nothing is recorded while disabled");
+
+    profiler.setEnabled(true, 0, 0);
+    profiler.record("chatd", "NEWMSG", -1, 3);
+    profiler.record("chatd", "NEWMSG", -1, 5);
+    std::string json = profiler.toJson();
+    check(json.find("\"category\":\"chatd\",\"name\":\"NEWMSG\",\"queue\":{\"count\":0,") != std::string::npos, "unknown queueing delay is not recorded");
+    check(json.find("\"exec\":{\"count\":2,\"totalUs\":8,\"maxUs\":5,\"p50Us\":4,\"p99Us\":8,") != std::string::npos, "execution time to JSON");
+
+    profiler.setEnabled(true, 0, 0);
+    check(profiler.toJson() == "{\"enabled\":true,\"slowThresholdUs\":0,\"entries\":[]}", "enabling resets the stats");
+
+    return check.finish();
+}
+
+static const char* testOpcodeToStr(uint8_t opcode)
+{
+    return (opcode == 1) ? "JOIN" : "UNKNOWN";
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_Metrics()
+{
+    TestChecks check(*this, "karere::Metrics", "Metrics");
+
+    karere::Counter counter;
+    counter.add();
+    counter.add(4);
+    counter.setMax(3);
+    check(counter.get() == 5, "counter add and max");
+
+    karere::TrafficStats traffic;
+    const char joinCmd[] = { 1, 0, 0 };
+    traffic.frameIn();
+    traffic.commandsIn[1].add();
+    traffic.frameOut(joinCmd, sizeof(joinCmd));
+    traffic.parseErrors.add();
+    WebsocketsStats ws;
+    ws.payloadBytesReceived = 10;
+    ws.payloadBytesSent = 3;
+    ws.wireBytesReceived = 6;
+    ws.wireBytesSent = 40;
+    ws.recvBufferBytes = 4096;
+
+    karere::Metrics metrics;
+    traffic.addMetrics(metrics, "chatd", { {"shard", "2"} }, ws, &testOpcodeToStr);
+    check(metrics.families().size() == 9, "one family per counter, only opcodes with traffic");
+    auto& sent = metrics.families().at("chatd_sent_frames_total");
+    check(sent.type == karere::Metrics::kCounter && sent.samples.size() == 1 && sent.samples[0].value == 1
+          && sent.samples[0].labels == karere::Metrics::Labels({ {"shard", "2"}, {"opcode", "JOIN"} }), "frames sent by opcode");
+    check(metrics.families().at("chatd_received_bytes_total").samples[0].value == 10
+          && metrics.families().at("chatd_sent_bytes_total").samples[0].value == 3
+          && metrics.families().at("chatd_wire_received_bytes_total").samples[0].value == 6
+          && metrics.families().at("chatd_wire_sent_bytes_total").samples[0].value == 40, "bytes");
+    auto& recvBuffer = metrics.families().at("chatd_recv_buffer_bytes");
+    check(recvBuffer.type == karere::Metrics::kGauge && recvBuffer.samples[0].value == 4096, "receive buffer");
+
+    karere::Metrics text;
+    text.add("chatd_send_queue_depth", karere::Metrics::kGauge, "Queue depth", { {"chatid", "a\"b"} }, 2);
+    text.add("chatd_send_queue_depth", karere::Metrics::kGauge, "Queue depth", { {"chatid", "c"} }, 1);
+    text.add("presenced_parse_errors_total", karere::Metrics::kCounter, "Errors", {}, 0);
+    check(text.toPrometheus() ==
+          "# HELP chatd_send_queue_depth Queue depth\n"
+          "# TYPE chatd_send_queue_depth gauge\n"
+          "chatd_send_queue_depth{chatid=\"a\\\"b\"} 2\n"
+          "chatd_send_queue_depth{chatid=\"c\"} 1\n"
+          "# HELP presenced_parse_errors_total Errors\n"
+          "# TYPE presenced_parse_errors_total counter\n"
+          "presenced_parse_errors_total 0\n", "Prometheus format");
+    check(text.toJson() ==
+          "{\"chatd_send_queue_depth\":{\"type\":\"gauge\",\"help\":\"Queue depth\",\"samples\":["
+          "{\"labels\":{\"chatid\":\"a\\\"b\"},\"value\":2},{\"labels\":{\"chatid\":\"c\"},\"value\":1}]},"
+          "\"presenced_parse_errors_total\":{\"type\":\"counter\",\"help\":\"Errors\",\"samples\":["
+          "{\"labels\":{},\"value\":0}]}}", "JSON format");
+
+    return check.finish();
+}
+
+static chatd::Message *newAttachment(uint64_t msgid)
+{
+    static const char data[] = "\0\x10" "attachment";
+    return new chatd::Message(msgid, 1, static_cast<uint32_t>(msgid), 0, data, sizeof(data));
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_NodeHistoryBuffer()
+{
+    TestChecks check(*this, "chatd::NodeHistoryBuffer", "NodeHistoryBuffer");
+
+    chatd::NodeHistoryBuffer buffer;
+    buffer.reset(9);
+    check(buffer.empty() && buffer.oldestIdx() == 10 && !buffer.hasIdx(9), "empty buffer");
+    check(buffer.pushNewest(newAttachment(100)) == 10 && buffer.pushNewest(newAttachment(101)) == 11, "newest messages");
+    check(buffer.pushOldest(newAttachment(99)) == 9 && buffer.pushOldest(newAttachment(98)) == 8, "oldest messages");
+    check(buffer.size() == 4 && buffer.oldestIdx() == 8 && buffer.newestIdx() == 11, "range");
+    check(buffer.find(99) == 9 && buffer.at(9)->id() == 99 && buffer.get(101) == buffer.newest()
+          && buffer.find(1) == CHATD_IDX_INVALID && !buffer.get(1), "lookups");
+    buffer.truncateBefore(10);
+    check(buffer.size() == 2 && buffer.oldest()->id() == 100 && buffer.find(99) == CHATD_IDX_INVALID, "truncate");
+    buffer.truncateBefore(12);
+    check(buffer.empty() && buffer.newestIdx() == 11 && buffer.pushNewest(newAttachment(102)) == 12, "truncate all");
+
+    return check.finish();
+}
+
+// 50k attachments in a NodeHistoryBuffer, compared with a list and a map of iterators
+void MegaChatApiUnitaryTest::BENCHMARK_NodeHistoryBuffer()
+{
+    const unsigned kNumMsgs = 50000;
+    typedef std::chrono::steady_clock Clock;
+    auto elapsedMs = [](Clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count() / 1000.0;
+    };
+    uint64_t found = 0;
+
+    auto start = Clock::now();
+    chatd::NodeHistoryBuffer flat;
+    flat.reset(kNumMsgs);
+    for (unsigned i = 0; i < kNumMsgs; i++)
+    {
+        flat.pushOldest(newAttachment(kNumMsgs - i));
+    }
+    double flatLoadMs = elapsedMs(start);
+    start = Clock::now();
+    for (unsigned i = 1; i <= kNumMsgs; i++)
+    {
+        found += (flat.get(i) != nullptr);
+    }
+    for (chatd::Idx idx = flat.newestIdx(); idx >= flat.oldestIdx(); idx--)
+    {
+        found += (flat.at(idx)->size() != 0);
+    }
+    flat.truncateBefore(flat.find(kNumMsgs / 2));
+    double flatQueryMs = elapsedMs(start);
+    bool ok = (found == 2 * kNumMsgs && flat.size() == kNumMsgs / 2 + 1);
+
+    found = 0;
+    start = Clock::now();
+    std::list<std::unique_ptr<chatd::Message>> list;
+    std::map<karere::Id, std::list<std::unique_ptr<chatd::Message>>::iterator> listIndex;
+    for (unsigned i = 0; i < kNumMsgs; i++)
+    {
+        list.emplace_back(newAttachment(kNumMsgs - i));
+        listIndex[list.back()->id()] = --list.end();
+    }
+    double listLoadMs = elapsedMs(start);
+    start = Clock::now();
+    for (unsigned i = 1; i <= kNumMsgs; i++)
+    {
+        found += (listIndex.find(i) != listIndex.end());
+    }
+    for (auto& msg: list)
+    {
+        found += (msg->size() != 0);
+    }
+    auto truncateFrom = std::next(listIndex[kNumMsgs / 2]);
+    for (auto it = truncateFrom; it != list.end(); it++)
+    {
+        listIndex.erase((*it)->id());
+    }
+    list.erase(truncateFrom, list.end());
+    double listQueryMs = elapsedMs(start);
+    ok = ok && (found == 2 * kNumMsgs && list.size() == kNumMsgs / 2 + 1);
+
+    std::cout << "50k attachments" << (ok ? "" : " (WRONG RESULTS)") << " - load: " << flatLoadMs
+              << " ms (list+map: " << listLoadMs << " ms), lookup+iterate+truncate: " << flatQueryMs << " ms (list+map: " << listQueryMs << " ms)" << std::endl;
+}
+
+static std::vector<int> sProcessedEvents;
+
+static void processTestEvent(void *event)
+{
+    sProcessedEvents.push_back(*static_cast<int *>(event));
+}
+
+// Node-history kept in memory, as the DB cache would. Other tables are not used by FilteredHistory
+class NodeHistoryDbMock : public chatd::DbInterface
+{
+public:
+    std::map<chatd::Idx, std::unique_ptr<chatd::Message>> mNodes;
+    unsigned mFetches = 0;
+
+    void addNode(chatd::Idx idx, karere::Id msgid)
+    {
+        static const char data[] = "\0\x10" "attachment";
+        mNodes[idx].reset(new chatd::Message(msgid, 1, static_cast<uint32_t>(idx), 0, data, sizeof(data)));
+    }
+
+    void addMsgToNodeHistory(const chatd::Message &msg, chatd::Idx &idx) override { mNodes[idx].reset(new chatd::Message(msg)); }
+    void deleteMsgFromNodeHistory(const chatd::Message&) override {}
+    void truncateNodeHistory(karere::Id id) override
+    {
+        mNodes.erase(mNodes.begin(), mNodes.upper_bound(getIdxOfMsgidFromNodeHistory(id)));
+    }
+    void getNodeHistoryInfo(chatd::Idx &newest, chatd::Idx &oldest) override
+    {
+        newest = mNodes.empty() ? -1 : mNodes.rbegin()->first;
+        oldest = mNodes.empty() ? 0 : mNodes.begin()->first;
+    }
+    void clearNodeHistory() override { mNodes.clear(); }
+    void fetchDbNodeHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages) override
+    {
+        mFetches++;
+        for (auto it = mNodes.upper_bound(idx); it != mNodes.begin() && messages.size() < count;)
+        {
+            messages.push_back(new chatd::Message(*(--it)->second));
+        }
+    }
+    chatd::Idx getIdxOfMsgidFromNodeHistory(karere::Id msgid) override
+    {
+        for (auto& node: mNodes)
+        {
+            if (node.second->id() == msgid)
+            {
+                return node.first;
+            }
+        }
+        return CHATD_IDX_INVALID;
+    }
+
+    void fetchDbHistory(chatd::Idx, unsigned, std::vector<chatd::Message*>&) override {}
+    void prefetchDbHistory(chatd::Idx, unsigned) override {}
+    bool takePrefetchedDbHistory(chatd::Idx, unsigned, std::vector<chatd::Message*>&) override { return false; }
+    void addMsgToHistory(const chatd::Message&, chatd::Idx) override {}
+    void updateMsgInHistory(karere::Id, const chatd::Message&) override {}
+    void addSendingItem(chatd::Chat::SendingItem&) override {}
+    int updateSendingItemsContentAndDelta(const chatd::Message&) override { return 0; }
+    int updateSendingItemsKeyid(chatd::KeyId, chatd::KeyId) override { return 0; }
+    int updateSendingItemsMsgidAndOpcode(karere::Id, karere::Id) override { return 0; }
+    void addBlobsToSendingItem(uint64_t, const chatd::MsgCommand*, const chatd::KeyCommand*, chatd::KeyId) override {}
+    void deleteSendingItem(uint64_t) override {}
+    void loadSendQueue(chatd::Chat::OutputQueue&) override {}
+    void saveItemToManualSending(const chatd::Chat::SendingItem&, int) override {}
+    bool deleteManualSendItem(uint64_t) override { return false; }
+    void loadManualSendItems(std::vector<chatd::Chat::ManualSendItem>&) override {}
+    void loadManualSendItem(uint64_t, chatd::Chat::ManualSendItem&) override {}
+    void getHistoryInfo(chatd::ChatDbInfo&) override {}
+    void setLastSeen(karere::Id) override {}
+    void setLastReceived(karere::Id) override {}
+    void setLastSeenAndReceived(karere::Id, karere::Id) override {}
+    void setChatVar(const char*, bool) override {}
+    bool chatVar(const char*) override { return false; }
+    bool removeChatVar(const char*) override { return false; }
+    chatd::Idx getOldestIdx() override { return 0; }
+    chatd::Idx getIdxOfMsgidFromHistory(karere::Id) override { return CHATD_IDX_INVALID; }
+    chatd::Idx getUnreadMsgCountAfterIdx(chatd::Idx) override { return 0; }
+    void getLastTextMessage(chatd::Idx, chatd::LastTextMsgState&, uint32_t&) override {}
+    void getMessageDelta(karere::Id, uint16_t*) override {}
+    void setHaveAllHistory(bool) override {}
+    void truncateHistory(const chatd::Message&) override {}
+    void clearHistory() override {}
+    std::string getReactionSn() override { return std::string(); }
+    void setReactionSn(const std::string&) override {}
+    void cleanReactions(karere::Id) override {}
+    void addReaction(karere::Id, karere::Id, const char*) override {}
+    void delReaction(karere::Id, karere::Id, const char*) override {}
+    void getMessageReactions(karere::Id, ::mega::multimap<std::string, karere::Id>&) override {}
+    void getReactionsForRange(chatd::Idx, chatd::Idx, const std::vector<chatd::Message*>&) override {}
+};
+
+class TestNodeHistoryHandler : public chatd::FilteredHistoryHandler
+{
+public:
+    std::vector<karere::Id> mLoaded;
+    karere::Id mTruncated = karere::Id::inval();
+
+    void onReceived(chatd::Message*, chatd::Idx) override {}
+    void onLoaded(chatd::Message *msg, chatd::Idx) override
+    {
+        if (msg)
+        {
+            mLoaded.push_back(msg->id());
+        }
+    }
+    void onDeleted(karere::Id) override {}
+    void onTruncated(karere::Id id) override { mTruncated = id; }
+};
+
+// Chat without text messages, that records the requests of node history to server
+class TestNodeHistoryFetcher : public chatd::NodeHistoryFetcher
+{
+public:
+    bool mLoggedIn = false;
+    std::vector<std::pair<karere::Id, uint32_t>> mRequests;
+
+    bool isLoggedIn() const override { return mLoggedIn; }
+    chatd::Message* oldest() const override { return NULL; }
+    void requestNodeHistoryFromServer(karere::Id oldestMsgid, uint32_t count) override
+    {
+        mRequests.emplace_back(oldestMsgid, count);
+    }
+};
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_FilteredHistory()
+{
+    TestChecks check(*this, "chatd::FilteredHistory", "FilteredHistory");
+    TestNodeHistoryFetcher chat;
+
+    // pages the history, the newest first, until there are no more messages. Returns the size of every page
+    auto getAllPages = [](chatd::FilteredHistory &history, TestNodeHistoryHandler &handler, uint32_t count)
+    {
+        std::vector<size_t> pages;
+        size_t loaded = handler.mLoaded.size();
+        while (history.getHistory(count) != chatd::HistSource::kHistSourceNone)
+        {
+            pages.push_back(handler.mLoaded.size() - loaded);
+            loaded = handler.mLoaded.size();
+        }
+        return pages;
+    };
+    // checks every message from msgid \c newest to \c oldest was loaded once, in order
+    auto loadedInOrder = [](const TestNodeHistoryHandler &handler, uint64_t newest, uint64_t oldest)
+    {
+        bool ok = (handler.mLoaded.size() == newest - oldest + 1);
+        for (size_t i = 0; ok && i < handler.mLoaded.size(); i++)
+        {
+            ok = (handler.mLoaded[i] == newest - i);
+        }
+        return ok;
+    };
+
+    // 600 attachments in DB (msgid = 1000 + idx), paged by 100: the DB is read in chunks of 256
+    NodeHistoryDbMock db;
+    for (chatd::Idx idx = 0; idx < 600; idx++)
+    {
+        db.addNode(idx, 1000 + idx);
+    }
+    TestNodeHistoryHandler handler;
+    chatd::FilteredHistory history(db, chat);
+    history.setHaveAllHistory(true);
+    history.setHandler(&handler);
+
+    check(history.getHistory(100) == chatd::HistSource::kHistSourceDb && db.mFetches == 1, "first page from DB");
+    check(history.getHistory(100) == chatd::HistSource::kHistSourceRam && db.mFetches == 1, "second page from RAM");
+    std::vector<size_t> pages = getAllPages(history, handler, 100);
+    check(pages == std::vector<size_t>({56, 100, 100, 56, 88}), "pages end at the chunk boundaries");
+    check(db.mFetches == 3, "DB read once per chunk");
+    check(loadedInOrder(handler, 1599, 1000), "every message loaded once across chunks");
+    check(history.getMessageIdx(1000) == 0 && history.getMessage(1255)->type == chatd::Message::kMsgAttachment, "messages from DB");
+    check(chat.mRequests.empty(), "no requests to server once all history is known");
+
+    // once DB is exhausted, older messages are requested to server, from the oldest one known
+    NodeHistoryDbMock serverDb;
+    serverDb.addNode(0, 1000);
+    TestNodeHistoryHandler serverHandler;
+    TestNodeHistoryFetcher serverChat;
+    chatd::FilteredHistory serverHistory(serverDb, serverChat);
+    serverHistory.setHandler(&serverHandler);
+    check(serverHistory.getHistory(10) == chatd::HistSource::kHistSourceDb, "first page from DB");
+    check(serverHistory.getHistory(10) == chatd::HistSource::kHistSourceNotLoggedIn && serverChat.mRequests.empty(), "not logged in");
+    serverChat.mLoggedIn = true;
+    check(serverHistory.getHistory(10) == chatd::HistSource::kHistSourceServer
+          && serverHistory.getHistory(10) == chatd::HistSource::kHistSourceServer, "pages from server");
+    check(serverChat.mRequests.size() == 1 && serverChat.mRequests[0].first == karere::Id(1000)
+          && serverChat.mRequests[0].second == 10, "one request in flight, from the oldest attachment");
+    serverHistory.finishFetchingFromServer();
+    serverHistory.getHistory(10);
+    check(serverChat.mRequests.size() == 2, "next request once the previous one finished");
+
+    // truncate older messages not loaded in RAM yet
+    NodeHistoryDbMock truncDb;
+    for (chatd::Idx idx = 0; idx < 600; idx++)
+    {
+        truncDb.addNode(idx, 1000 + idx);
+    }
+    TestNodeHistoryHandler truncHandler;
+    chatd::FilteredHistory truncHistory(truncDb, chat);
+    truncHistory.setHaveAllHistory(true);
+    truncHistory.setHandler(&truncHandler);
+    truncHistory.getHistory(100);
+    truncHistory.truncateHistory(1200);
+    check(truncHandler.mTruncated == karere::Id(1200) && truncDb.mNodes.begin()->first == 201, "truncated in DB");
+    pages = getAllPages(truncHistory, truncHandler, 100);
+    check(pages == std::vector<size_t>({100, 56, 100, 43}) && truncDb.mFetches == 2, "pages after truncation");
+    check(loadedInOrder(truncHandler, 1599, 1201), "truncated messages not loaded");
+
+    // truncate messages already in RAM, some of them not notified yet
+    truncHistory.truncateHistory(1500);
+    check(truncHistory.getMessage(1499) == NULL && truncHistory.getMessage(1500) != NULL, "truncated in RAM");
+    check(truncHistory.getHistory(100) == chatd::HistSource::kHistSourceNone && truncHandler.mLoaded.size() == 399,
+          "no more messages after truncation");
+
+    return check.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_EventQueue()
+{
+    TestChecks check(*this, "megachat::EventQueue", "EventQueue");
+
+    megachat::EventQueue queue;
+    int events[] = { 1, 2, 3 };
+    sProcessedEvents.clear();
+    check(!queue.push(&events[0]), "no notification while the consumer is awake");
+    check(!queue.prepareWait(), "events pushed since the last drain are detected before waiting");
+    check(queue.push(&events[1]), "the first event after preparing to wait notifies the consumer");
+    check(!queue.push(&events[2]), "the next events don't notify it again");
+    queue.setAwake();
+    check(queue.size() == 3 && !queue.isEmpty(), "pending events");
+    check(queue.drain(processTestEvent) == 3 && sProcessedEvents == std::vector<int>({ 1, 2, 3 }), "events are processed in order");
+    check(queue.drain(processTestEvent) == 0 && queue.isEmpty() && queue.prepareWait(), "empty queue");
+
+    megachat::EventQueue::Stats stats = queue.getStats();
+    check(stats.posted == 3 && stats.processed == 3 && stats.wakeups == 1 && stats.batches == 1, "counters");
+    check(stats.depth == 0 && stats.maxDepth == 3 && stats.maxLatencyUs <= stats.totalLatencyUs, "depth and latency");
+
+    karere::Metrics metrics;
+    queue.addMetrics(metrics);
+    check(metrics.families().size() == 8
+          && metrics.families().at("karere_events_posted_total").samples[0].value == 3
+          && metrics.families().at("karere_events_wakeups_total").samples[0].value == 1
+          && metrics.families().at("karere_events_queue_max_depth").type == karere::Metrics::kGauge
+          && metrics.families().at("karere_events_queue_max_depth").samples[0].value == 3, "metrics");
+
+    return check.finish();
+}
+
+// Encrypts a reaction as ProtocolHandler::reactionEncrypt does, through str_to_a32/a32_to_str
+static std::string encryptReaction(const strongvelope::SendKey& key, karere::Id msgid, const std::string& reaction)
+{
+    std::string keyBin(key.buf(), key.dataSize());
+    std::vector<uint32_t> key32 = ::mega::Utils::str_to_a32<uint32_t>(keyBin);
+    std::string msgId(msgid.toString());
+    std::vector<uint32_t> msgId32 = ::mega::Utils::str_to_a32<uint32_t>(msgId);
+    std::vector<uint32_t> cypherKey(key32.size());
+    for (size_t i = 0; i < key32.size(); i++)
+    {
+        cypherKey[i] = key32[i] ^ msgId32[i % msgId32.size()];
+    }
+
+    size_t paddingSize = (4 - reaction.size() % 4) % 4;
+    std::string buf(msgId.data(), 4);
+    buf.append(paddingSize, '\0');
+    buf.append(reaction);
+    std::vector<uint32_t> emoji32 = ::mega::Utils::str_to_a32<uint32_t>(buf);
+    ::mega::xxteaEncrypt(emoji32.data(), static_cast<uint32_t>(emoji32.size()), cypherKey.data(), false);
+    return ::mega::Utils::a32_to_str<uint32_t>(emoji32);
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_ReactionDecryption()
+{
+    TestChecks check(*this, "strongvelope::decryptReaction", "ReactionDecryption");
+
+    char keyData[16];
+    for (unsigned i = 0; i < sizeof(keyData); i++)
+    {
+        keyData[i] = static_cast<char>(0xa5 ^ (i * 17));
+    }
+    strongvelope::SendKey key(keyData, sizeof(keyData));
+    karere::Id msgids[] = { karere::Id(0x0123456789abcdefULL), karere::Id(0xfedcba9876543210ULL) };
+
+    // lengths from 1 to 8 bytes (multiples of 4 and not) and one larger than the stack buffer
+    std::vector<std::string> reactions = { "a", "ab", "\xE2\x9D\xA4", "\xF0\x9F\x98\x80", "\xF0\x9F\x98\x80" "a",
+                                           "\xE2\x9D\xA4\xEF\xB8\x8F", "\xE2\x9D\xA4\xEF\xB8\x8F" "a",
+                                           "\xF0\x9F\x91\x8D\xF0\x9F\x8F\xBB", std::string(150, 'x') };
+    for (const karere::Id& msgid: msgids)
+    {
+        for (const std::string& reaction: reactions)
+        {
+            std::string encrypted = encryptReaction(key, msgid, reaction);
+            check(strongvelope::decryptReaction(key, msgid, encrypted) == reaction,
+                  "reaction of " + std::to_string(reaction.size()) + " bytes to " + msgid.toString());
         }
     }
 
-    if (failureTests > 0)
+    bool thrown = false;
+    try
+    {
+        strongvelope::decryptReaction(key, msgids[0], "1234");
+    }
+    catch (std::runtime_error&)
     {
-        mFailedTests ++;
+        thrown = true;
     }
+    check(thrown, "encrypted reaction too short");
 
-    std::cout << "          TEST - Message::parseUrl() - Executed Tests : " << executedTests << "   Failure Tests : " << failureTests << std::endl;
-    return succesful;
+    return check.finish();
 }
+
+#ifndef KARERE_DISABLE_WEBRTC
+static rtcModule::stats::Sample makeStatsSample(int i)
+{
+    // synthetic values, equivalent to what the recorder gets from the StatsReports of a call
+    rtcModule::stats::Sample sample = rtcModule::stats::Sample();
+    sample.ts = i * 1000;
+    sample.lq = i % 5;
+    sample.f = (i % 2) ? 3 : 7;
+    sample.vstats.rtt = 200 - i * 15;   // decreasing: negative deltas
+    sample.vstats.r.bt = 1000000L * i;
+    sample.vstats.r.width = (i < 5) ? 640 : 1280;
+    sample.vstats.s.el = i * 0.5f;
+    sample.astats.r.pl = i / 3;
+    sample.cstats.s.abps = 500 + i;
+    return sample;
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_StatsSampleBuffer()
+{
+    using namespace rtcModule::stats;
+
+    TestChecks check(*this, "stats::SampleBuffer", "SampleBuffer");
+
+    // more samples than the capacity: the oldest ones are discarded
+    RtcStats stats;
+    stats.mSamples = SampleBuffer(4);
+    for (int i = 0; i < 10; i++)
+    {
+        stats.mSamples.push(makeStatsSample(i));
+    }
+
+    check(stats.mSamples.size() == 4, "size is bounded by the capacity");
+    check(stats.mSamples.totalCount() == 10, "total count includes discarded samples");
+    check(stats.mSamples.back().ts == 9000 && stats.mSamples.back().vstats.rtt == 65, "back() is the last sample");
+    for (size_t i = 0; i < stats.mSamples.size(); i++)
+    {
+        Sample expected = makeStatsSample(static_cast<int>(i) + 6);
+        Sample sample = stats.mSamples.at(i);
+        check(sample.ts == expected.ts
+              && sample.lq == expected.lq
+              && sample.f == expected.f
+              && sample.vstats.rtt == expected.vstats.rtt
+              && sample.vstats.r.bt == expected.vstats.r.bt
+              && sample.vstats.r.width == expected.vstats.r.width
+              && sample.vstats.s.el == expected.vstats.s.el
+              && sample.astats.r.pl == expected.astats.r.pl
+              && sample.cstats.s.abps == expected.cstats.s.abps,
+              "sample " + std::to_string(i) + " is decoded from the deltas");
+    }
+
+    stats.mCallId = 1;
+    stats.mSessionId = 2;
+    stats.mOwnAnonId = 3;
+    stats.mPeerAnonId = 4;
+    stats.mStartTs = 1500000000000;
+    stats.mDur = 10000;
+    stats.mIsJoiner = false;
+    stats.mTermRsn = "hangup";
+    std::string json;
+    stats.toJson(json);
+    check(json ==
+          "{\"cid\":\"AQAAAAAAAAA\",\"sid\":\"AgAAAAAAAAA\",\"ts\":1500000000,\"dur\":10,"
+          "\"samples\":{\"ts\":[6000,7000,8000,9000],\"lq\":[1,2,3,4],\"f\":[7,3,7,3],"
+          "\"v\":{\"rtt\":[110,95,80,65],"
+          "\"s\":{\"bt\":[0,0,0,0],\"bps\":[0,0,0,0],\"abps\":[0,0,0,0],\"fps\":[0,0,0,0],\"cfps\":[0,0,0,0],"
+          "\"width\":[0,0,0,0],\"height\":[0,0,0,0],\"el\":[3.0,3.5,4.0,4.5],\"bwav\":[0,0,0,0],\"gbps\":[0,0,0,0]},"
+          "\"r\":{\"bt\":[6000000,7000000,8000000,9000000],\"bps\":[0,0,0,0],\"abps\":[0,0,0,0],\"pl\":[0,0,0,0],"
+          "\"jtr\":[0,0,0,0],\"fps\":[0,0,0,0],\"dly\":[0,0,0,0],\"width\":[1280,1280,1280,1280],\"height\":[0,0,0,0],"
+          "\"firtx\":[0,0,0,0],\"plitx\":[0,0,0,0],\"nacktx\":[0,0,0,0]}},"
+          "\"a\":{\"rtt\":[0,0,0,0],\"s\":{\"bt\":[0,0,0,0],\"bps\":[0,0,0,0],\"abps\":[0,0,0,0]},"
+          "\"r\":{\"bt\":[0,0,0,0],\"bps\":[0,0,0,0],\"abps\":[0,0,0,0],\"jtr\":[0,0,0,0],\"pl\":[2,2,2,3],"
+          "\"dly\":[0,0,0,0],\"al\":[0,0,0,0]}}},"
+          "\"bws\":\"\",\"rly\":0,\"rrly\":0,\"proto\":\"\",\"isJoiner\":0,"
+          "\"caid\":\"BAAAAAAAAAA\",\"aaid\":\"AwAAAAAAAAA\",\"termRsn\":\"hangup\"}", "toJson() of the last 4 samples");
+
+    // long call: the streaming serializer passes the output in several chunks
+    RtcStats longStats;
+    longStats.mStartTs = 1500000000000;
+    longStats.mDur = 5000000;
+    longStats.mIsJoiner = true;
+    const int kNumSamples = 1000;
+    std::string expectedTs = "\"samples\":{\"ts\":[";
+    for (int i = 0; i < kNumSamples; i++)
+    {
+        longStats.mSamples.push(makeStatsSample(i));
+        expectedTs.append(i ? "," : "").append(std::to_string(i * 1000));
+    }
+    expectedTs.append("],");
+
+    std::string streamed;
+    unsigned chunks = 0;
+    size_t maxChunk = 0;
+    longStats.writeJson([&streamed, &chunks, &maxChunk](const char *data, size_t len)
+    {
+        streamed.append(data, len);
+        chunks++;
+        maxChunk = std::max(maxChunk, len);
+    });
+    check(chunks > 3 && maxChunk <= 4096, "writeJson() of " + std::to_string(kNumSamples) + " samples in "
+          + std::to_string(chunks) + " chunks of at most 4096 bytes");
+    check(streamed.find(expectedTs) != std::string::npos, "ts column across chunks");
+    check(streamed.find("\"el\":[0.0,0.5,1.0,") != std::string::npos
+          && streamed.find(",499.0,499.5],\"bwav\"") != std::string::npos, "el column across chunks");
+    const std::string lastField = "\"termRsn\":\"\"}";
+    check(streamed.size() > lastField.size()
+          && streamed.compare(streamed.size() - lastField.size(), lastField.size(), lastField) == 0, "last field in the last chunk");
+    longStats.toJson(json);
+    check(json == streamed, "toJson() of " + std::to_string(kNumSamples) + " samples");
+
+    return check.finish();
+}
+#endif
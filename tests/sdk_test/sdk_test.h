@@ -416,9 +416,39 @@ class MegaChatApiUnitaryTest
 {
 public:
     bool UNITARYTEST_ParseUrl();
+    bool UNITARYTEST_IdBase64();
+    bool UNITARYTEST_MemoryReport();
+    bool UNITARYTEST_LoopProfiler();
+    bool UNITARYTEST_Metrics();
+    bool UNITARYTEST_NodeHistoryBuffer();
+    bool UNITARYTEST_FilteredHistory();
+    bool UNITARYTEST_EventQueue();
+    bool UNITARYTEST_ReactionDecryption();
+#ifndef KARERE_DISABLE_WEBRTC
+    bool UNITARYTEST_StatsSampleBuffer();
+#endif
+    void BENCHMARK_NodeHistoryBuffer();
 
     unsigned mOKTests = 0;
     unsigned mFailedTests = 0;
+
+protected:
+    // Checks of a unitary test: reports the failed ones, and the summary of the test upon finish()
+    class TestChecks
+    {
+    public:
+        TestChecks(MegaChatApiUnitaryTest &test, const std::string &name, const std::string &tag);
+        void operator()(bool condition, const std::string &msg);
+        // accounts the test as failed if any check failed, and returns whether all of them succeeded
+        bool finish();
+
+    private:
+        MegaChatApiUnitaryTest &mTest;
+        std::string mName;
+        std::string mTag;
+        int mExecuted = 0;
+        int mFailed = 0;
+    };
 };
 
 #endif // CHATTEST_H